@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+namespace impala
+{
+
+// 大きなバッチの領域にヒュージページを使うか
+// TRANSPARENTはmadvise(MADV_HUGEPAGE)で透過的ヒュージページを要求し、EXPLICITはMAP_HUGETLBで予約済みのヒュージページから確保する
+// EXPLICITで確保できない場合は通常のページを使う
+enum class HugePageMode
+{
+	NONE,
+	TRANSPARENT,
+	EXPLICIT
+};
+
+inline std::optional<HugePageMode> parseHugePageMode(std::string_view str)
+{
+	if (str == "none") {
+		return HugePageMode::NONE;
+	}
+	if (str == "transparent") {
+		return HugePageMode::TRANSPARENT;
+	}
+	if (str == "explicit") {
+		return HugePageMode::EXPLICIT;
+	}
+	return std::nullopt;
+}
+
+// BatchBufferAllocatorが使う確保関数. プロセス全体で共有し、設定はServerの構築時に行う
+namespace batch_buffer
+{
+
+inline constexpr std::size_t ALIGNMENT = 64;
+// これ以上の大きさの領域はmmapで直接確保し、解放時にOSに返す
+inline constexpr std::size_t HUGE_PAGE_SIZE = std::size_t{2} << 20;
+
+inline std::atomic<HugePageMode> huge_page_mode{HugePageMode::NONE};
+
+inline std::size_t mappedSize(std::size_t bytes) noexcept
+{
+	return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+inline void* allocate(std::size_t bytes)
+{
+	if (bytes < HUGE_PAGE_SIZE) {
+		return ::operator new(bytes, std::align_val_t{ALIGNMENT});
+	}
+	const auto size = mappedSize(bytes);
+	const auto mode = huge_page_mode.load(std::memory_order_relaxed);
+	if (mode == HugePageMode::EXPLICIT) {
+		void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED) {
+			return ptr;
+		}
+	}
+	// 透過的ヒュージページが使われるよう、先頭を2MiB境界に揃える
+	const auto padding = mode == HugePageMode::TRANSPARENT ? HUGE_PAGE_SIZE : 0;
+	void* mapped = ::mmap(nullptr, size + padding, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED) {
+		throw std::bad_alloc{};
+	}
+	auto* ptr = static_cast<std::byte*>(mapped);
+	if (padding > 0) {
+		const auto address = reinterpret_cast<std::uintptr_t>(mapped);
+		const auto head = (HUGE_PAGE_SIZE - address % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+		if (head > 0) {
+			::munmap(ptr, head);
+		}
+		if (padding - head > 0) {
+			::munmap(ptr + head + size, padding - head);
+		}
+		ptr += head;
+		::madvise(ptr, size, MADV_HUGEPAGE);
+	}
+	return ptr;
+}
+
+inline void deallocate(void* ptr, std::size_t bytes) noexcept
+{
+	if (bytes < HUGE_PAGE_SIZE) {
+		::operator delete(ptr, bytes, std::align_val_t{ALIGNMENT});
+	} else {
+		::munmap(ptr, mappedSize(bytes));
+	}
+}
+
+}  // namespace batch_buffer
+
+// バッチの観測を格納する領域のアロケータ
+// 64バイト境界に揃え、値を指定しない構築(resizeなど)では要素を初期化しない
+template <class T>
+class BatchBufferAllocator
+{
+public:
+	using value_type = T;
+
+	BatchBufferAllocator() noexcept = default;
+	template <class U>
+	BatchBufferAllocator(const BatchBufferAllocator<U>&) noexcept
+	{
+	}
+
+	T* allocate(std::size_t n)
+	{
+		return static_cast<T*>(batch_buffer::allocate(n * sizeof(T)));
+	}
+	void deallocate(T* ptr, std::size_t n) noexcept
+	{
+		batch_buffer::deallocate(ptr, n * sizeof(T));
+	}
+
+	template <class U>
+	void construct(U* ptr) noexcept(std::is_nothrow_default_constructible_v<U>)
+	{
+		::new (static_cast<void*>(ptr)) U;
+	}
+	template <class U, class... Args>
+	void construct(U* ptr, Args&&... args)
+	{
+		::new (static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+	}
+
+	template <class U>
+	bool operator==(const BatchBufferAllocator<U>&) const noexcept
+	{
+		return true;
+	}
+	template <class U>
+	bool operator!=(const BatchBufferAllocator<U>&) const noexcept
+	{
+		return false;
+	}
+};
+
+template <class T>
+using BatchBuffer = std::vector<T, BatchBufferAllocator<T>>;
+
+}  // namespace impala
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "concurrent_queue.hpp"
+#include "metrics.hpp"
+
+namespace impala
+{
+
+// 追加はロックを取らず、取り出しは最小バッチサイズに達するか、
+// 最も古い要素の待ち時間がmax_latencyを超えた時点でバッチ単位で行うキュー
+template <class T>
+class BatchQueue
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	BatchQueue(std::size_t capacity, std::size_t min_batch_size, std::size_t max_batch_size, std::optional<std::chrono::microseconds> max_latency)
+	    : m_queue{capacity}, m_batch_size_bounds{BatchSizeBounds{min_batch_size, max_batch_size}}, m_max_latency{max_latency}, m_wake_threshold{min_batch_size}
+	{
+		assert(0 < min_batch_size && min_batch_size <= max_batch_size);
+		m_enqueue_times.reserve(max_batch_size);
+	}
+
+	// 次のpopBatchから有効になる
+	void setBatchSizeBounds(std::size_t min_batch_size, std::size_t max_batch_size)
+	{
+		assert(0 < min_batch_size && min_batch_size <= max_batch_size);
+		std::lock_guard lock{m_bounds_lock};
+		m_batch_size_bounds = {min_batch_size, max_batch_size};
+	}
+
+	// 満杯の場合はvalueをmoveせずにfalseを返す
+	bool tryPush(T&& value)
+	{
+		if (!m_queue.tryEmplace(std::move(value), Clock::now())) {
+			return false;
+		}
+		// popBatchのしきい値の書き込みと対になるフェンス. 待機に入る側がこの要素を見落とした場合は、こちらが新しいしきい値を読んで起こす
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_queue.sizeApprox() >= m_wake_threshold.load(std::memory_order_seq_cst)) {
+			m_event.notifyOne();
+		}
+		return true;
+	}
+
+	// batchに要素を追加する。exit_requestedがtrueになった場合はfalseを返す
+	// 待機中もm_collect_lockを保持するため、バッチを集める消費者は常に1つで、他の消費者はロックを待つ
+	// 複数の消費者が同時に集めると要素が分かれ、どの消費者も最小バッチサイズに届かなくなるため
+	template <class ExitPredicate>
+	bool popBatch(std::vector<T>& batch, ExitPredicate&& exit_requested)
+	{
+		std::lock_guard collect_lock{m_collect_lock};
+		const auto [min_batch_size, max_batch_size] = batchSizeBounds();
+		std::optional<Clock::time_point> deadline;
+		const auto initial_size = batch.size();
+		m_enqueue_times.clear();
+		m_depth_sum.fetch_add(m_queue.sizeApprox(), std::memory_order_relaxed);
+		while (true) {
+			while (batch.size() < max_batch_size) {
+				auto entry = m_queue.tryPop();
+				if (!entry) {
+					break;
+				}
+				if (!deadline && m_max_latency.has_value()) {
+					deadline = entry->enqueue_time + m_max_latency.value();
+				}
+				batch.emplace_back(std::move(entry->value));
+				m_enqueue_times.emplace_back(entry->enqueue_time);
+			}
+			if (batch.size() >= min_batch_size) {
+				m_size_flush_count.fetch_add(1, std::memory_order_relaxed);
+				recordPopped(batch.size() - initial_size);
+				return true;
+			}
+			if (deadline && !batch.empty() && Clock::now() >= deadline.value()) {
+				m_deadline_flush_count.fetch_add(1, std::memory_order_relaxed);
+				recordPopped(batch.size() - initial_size);
+				return true;
+			}
+			m_wake_threshold.store(min_batch_size - batch.size(), std::memory_order_seq_cst);
+			// tryPushのフェンスと対になり、しきい値を公開してからキューの長さを読む
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			auto ready = [&, min_batch_size = min_batch_size] { return m_queue.sizeApprox() + batch.size() >= min_batch_size || exit_requested(); };
+			if (deadline) {
+				m_event.waitUntil(deadline.value(), ready);
+			} else if (m_max_latency.has_value()) {
+				// 先頭の要素がまだ無いので、到着を見逃しても遅延がmax_latencyに収まる間隔で確認する
+				m_event.waitUntil(Clock::now() + m_max_latency.value(), ready);
+			} else {
+				m_event.wait(ready);
+			}
+			m_wake_threshold.store(min_batch_size, std::memory_order_seq_cst);
+			if (exit_requested()) {
+				return false;
+			}
+		}
+	}
+
+	void notifyExit()
+	{
+		m_event.notifyAll();
+	}
+
+	std::size_t sizeApprox() const noexcept
+	{
+		return m_queue.sizeApprox();
+	}
+	std::size_t capacity() const noexcept
+	{
+		return m_queue.capacity();
+	}
+	std::size_t sizeFlushCount() const noexcept
+	{
+		return m_size_flush_count.load(std::memory_order_relaxed);
+	}
+	std::size_t deadlineFlushCount() const noexcept
+	{
+		return m_deadline_flush_count.load(std::memory_order_relaxed);
+	}
+	// popBatchで取り出した要素の累計
+	std::size_t poppedCount() const noexcept
+	{
+		return m_popped_count.load(std::memory_order_relaxed);
+	}
+	// popBatchの開始時点のキュー長の累計
+	std::size_t depthSum() const noexcept
+	{
+		return m_depth_sum.load(std::memory_order_relaxed);
+	}
+	// 要素が追加されてからpopBatchで返されるまでの時間
+	LatencyHistogram& dwellHistogram() noexcept
+	{
+		return m_dwell_histogram;
+	}
+	const LatencyHistogram& dwellHistogram() const noexcept
+	{
+		return m_dwell_histogram;
+	}
+	std::size_t minBatchSize()
+	{
+		return batchSizeBounds().min;
+	}
+	std::size_t maxBatchSize()
+	{
+		return batchSizeBounds().max;
+	}
+
+private:
+	struct Entry
+	{
+		Entry(T&& v, Clock::time_point t) : value{std::move(v)}, enqueue_time{t} {}
+
+		T value;
+		Clock::time_point enqueue_time;
+	};
+
+	struct BatchSizeBounds
+	{
+		std::size_t min;
+		std::size_t max;
+	};
+
+	void recordPopped(std::size_t count)
+	{
+		m_popped_count.fetch_add(count, std::memory_order_relaxed);
+		const auto now = Clock::now();
+		for (auto enqueue_time : m_enqueue_times) {
+			m_dwell_histogram.add(now - enqueue_time);
+		}
+	}
+
+	BatchSizeBounds batchSizeBounds()
+	{
+		std::lock_guard lock{m_bounds_lock};
+		return m_batch_size_bounds;
+	}
+
+	BoundedMPMCQueue<Entry> m_queue;
+	std::mutex m_bounds_lock;
+	BatchSizeBounds m_batch_size_bounds;
+	const std::optional<std::chrono::microseconds> m_max_latency;
+	std::atomic<std::size_t> m_wake_threshold;
+	std::mutex m_collect_lock;
+	// m_collect_lockで保護される
+	std::vector<Clock::time_point> m_enqueue_times;
+	EventNotifier m_event;
+	std::atomic<std::size_t> m_size_flush_count{0};
+	std::atomic<std::size_t> m_deadline_flush_count{0};
+	std::atomic<std::size_t> m_popped_count{0};
+	std::atomic<std::size_t> m_depth_sum{0};
+	LatencyHistogram m_dwell_histogram;
+};
+
+}  // namespace impala
@@ -0,0 +1,174 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "batch_queue.hpp"
+#include "concurrent_queue.hpp"
+
+// 複数の生産者・消費者でBoundedMPMCQueueとBatchQueueを動かし、全ての要素がちょうど1回ずつ取り出されることを確かめる
+namespace
+{
+
+using namespace impala;
+
+constexpr int NUM_PRODUCERS = 4;
+constexpr int ITEMS_PER_PRODUCER = 20000;
+constexpr int NUM_ITEMS = NUM_PRODUCERS * ITEMS_PER_PRODUCER;
+
+// 各要素が取り出された回数
+class PopCounter
+{
+public:
+	PopCounter() : m_counts{std::make_unique<std::atomic<int>[]>(NUM_ITEMS)}
+	{
+		for (int i = 0; i < NUM_ITEMS; ++i) {
+			m_counts[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void record(int item)
+	{
+		m_counts[item].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	bool check(const char* name) const
+	{
+		for (int i = 0; i < NUM_ITEMS; ++i) {
+			if (const auto count = m_counts[i].load(std::memory_order_relaxed); count != 1) {
+				std::cerr << name << " : item " << i << " popped " << count << " times" << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	std::unique_ptr<std::atomic<int>[]> m_counts;
+};
+
+// 生産者pはp * ITEMS_PER_PRODUCERから始まる連番を追加する. 満杯なら空くまで譲る
+template <class Push>
+void runProducers(Push push)
+{
+	std::vector<std::thread> producers;
+	for (int p = 0; p < NUM_PRODUCERS; ++p) {
+		producers.emplace_back([&push, p] {
+			for (int i = 0; i < ITEMS_PER_PRODUCER; ++i) {
+				int item = p * ITEMS_PER_PRODUCER + i;
+				while (!push(item, i)) {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for (auto& producer : producers) {
+		producer.join();
+	}
+}
+
+bool testBoundedMPMCQueue()
+{
+	constexpr int NUM_CONSUMERS = 4;
+	BoundedMPMCQueue<int> queue{64};
+	PopCounter counter;
+	std::atomic<int> popped{0};
+	std::vector<std::thread> consumers;
+	for (int c = 0; c < NUM_CONSUMERS; ++c) {
+		consumers.emplace_back([&] {
+			while (popped.load(std::memory_order_relaxed) < NUM_ITEMS) {
+				if (auto item = queue.tryPop()) {
+					counter.record(item.value());
+					popped.fetch_add(1, std::memory_order_relaxed);
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	runProducers([&](int item, int) { return queue.tryPush(std::move(item)); });
+	for (auto& consumer : consumers) {
+		consumer.join();
+	}
+	return counter.check("BoundedMPMCQueue") && queue.sizeApprox() == 0;
+}
+
+// 生産者が時々止まる間に、max_latencyがあれば締め切りでバッチが出る
+bool testBatchQueue(const char* name, std::optional<std::chrono::microseconds> max_latency)
+{
+	constexpr int NUM_CONSUMERS = 2;
+	constexpr std::size_t MIN_BATCH_SIZE = 32;
+	constexpr std::size_t MAX_BATCH_SIZE = 64;
+	BatchQueue<int> queue{1024, MIN_BATCH_SIZE, MAX_BATCH_SIZE, max_latency};
+	PopCounter counter;
+	std::atomic<bool> producers_done{false};
+	std::atomic<bool> oversized{false};
+	// exit_requestedがtrueになるまでバッチを取り出す. 終了時に集めかけの要素もbatchに残る
+	auto consume = [&](auto exit_requested) {
+		std::vector<int> batch;
+		while (true) {
+			batch.clear();
+			const bool ok = queue.popBatch(batch, exit_requested);
+			if (batch.size() > MAX_BATCH_SIZE) {
+				oversized.store(true, std::memory_order_relaxed);
+			}
+			for (auto item : batch) {
+				counter.record(item);
+			}
+			if (!ok) {
+				break;
+			}
+		}
+	};
+	std::vector<std::thread> consumers;
+	for (int c = 0; c < NUM_CONSUMERS; ++c) {
+		consumers.emplace_back([&] { consume([&] { return producers_done.load(std::memory_order_acquire); }); });
+	}
+	runProducers([&](int item, int i) {
+		if (i % 1000 == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds{2});
+		}
+		return queue.tryPush(std::move(item));
+	});
+	producers_done.store(true, std::memory_order_release);
+	queue.notifyExit();
+	for (auto& consumer : consumers) {
+		consumer.join();
+	}
+	// 最小バッチサイズに満たずに残った要素を取り出す
+	consume([] { return true; });
+
+	bool ok = counter.check(name);
+	if (oversized.load(std::memory_order_relaxed)) {
+		std::cerr << name << " : batch larger than " << MAX_BATCH_SIZE << std::endl;
+		ok = false;
+	}
+	if (queue.sizeFlushCount() == 0) {
+		std::cerr << name << " : no size flush" << std::endl;
+		ok = false;
+	}
+	if (max_latency.has_value() ? queue.deadlineFlushCount() == 0 : queue.deadlineFlushCount() != 0) {
+		std::cerr << name << " : deadlineFlushCount " << queue.deadlineFlushCount() << std::endl;
+		ok = false;
+	}
+	return ok;
+}
+
+}  // namespace
+
+int main()
+{
+	bool ok = testBoundedMPMCQueue();
+	ok = testBatchQueue("BatchQueue with max_latency", std::chrono::microseconds{200}) && ok;
+	// 締め切りが無い場合はEventNotifierの通知だけで起きる
+	ok = testBatchQueue("BatchQueue without max_latency", std::nullopt) && ok;
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "ok" << std::endl;
+	return 0;
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+
+#include "server_config.hpp"
+
+namespace impala
+{
+
+// 推論・学習の最大バッチサイズを1つずつ乗算的に動かし、env-steps/secが改善した方向に進む座標山登り
+// 最小バッチサイズは設定値の最小/最大の比を保って追従する
+// キュー長と平均バッチサイズは最初に動かす向きを、キューの待ち時間のp99は大きくしてよいかを決める
+// max_*_latencyが指定されている場合、待ち時間のp99がそれを超えた区間の拡大は改善とみなさず、以降その大きさ以上には広げない
+// どちらを動かしても改善しなくなったら刻み幅を縮め、十分小さくなった時点で確定する
+class BatchSizeAutotuner
+{
+public:
+	struct BatchSizeBounds
+	{
+		std::size_t min;
+		std::size_t max;
+	};
+	struct Measurement
+	{
+		double env_steps_per_second;
+		double average_prediction_batch_size;
+		double average_training_batch_size;
+		double average_prediction_queue_depth;
+		double average_training_queue_depth;
+		double average_prediction_latency_ms;
+		double average_training_latency_ms;
+		// キューに追加されてからバッチとして取り出されるまでの時間のp99
+		double prediction_dwell_p99_ms;
+		double training_dwell_p99_ms;
+	};
+
+	static inline constexpr double INITIAL_STEP = 1.5;
+	static inline constexpr double MIN_STEP = 1.05;
+	// これ以上スループットが上がらなければ改善とみなさない
+	static inline constexpr double IMPROVEMENT_THRESHOLD = 1.02;
+	// 調整範囲の下限は設定された最大バッチサイズのこの割合
+	static inline constexpr std::size_t MAX_SHRINK_FACTOR = 16;
+
+	explicit BatchSizeAutotuner(const ServerConfig& config)
+	    : m_dimensions{{{"prediction", config.min_prediction_batch_size, config.max_prediction_batch_size, toMilliseconds(config.max_prediction_latency)},
+	          {"training", config.min_training_batch_size, config.max_training_batch_size, toMilliseconds(config.max_training_latency)}}}
+	{
+	}
+
+	BatchSizeBounds predictionBatchSizeBounds() const noexcept
+	{
+		return m_dimensions[PREDICTION].bounds(m_dimensions[PREDICTION].current);
+	}
+	BatchSizeBounds trainingBatchSizeBounds() const noexcept
+	{
+		return m_dimensions[TRAINING].bounds(m_dimensions[TRAINING].current);
+	}
+	bool settled() const noexcept
+	{
+		return m_settled;
+	}
+
+	// 計測区間毎に、その区間の計測値を渡す
+	// 呼び出し後のpredictionBatchSizeBounds/trainingBatchSizeBoundsを次の区間で使う
+	void update(const Measurement& measurement)
+	{
+		if (m_settled) {
+			return;
+		}
+		if (m_warming_up) {
+			// バッチサイズを変えた直後の区間は、変更前の状態が混ざるので捨てる
+			m_warming_up = false;
+			return;
+		}
+		log(measurement);
+		auto& dimension = m_dimensions[m_current_dimension];
+		const bool grown_past_latency = dimension.current > dimension.best && exceedsLatency(m_current_dimension, measurement);
+		if (!m_has_best) {
+			m_best_throughput = measurement.env_steps_per_second;
+			m_has_best = true;
+			initializeDirections(measurement);
+		} else if (!grown_past_latency && measurement.env_steps_per_second > m_best_throughput * IMPROVEMENT_THRESHOLD) {
+			m_best_throughput = measurement.env_steps_per_second;
+			dimension.best = dimension.current;
+			m_improved_in_round = true;
+			// 同じ方向にもう一歩進める
+			if (tryMove(dimension)) {
+				return;
+			}
+			nextTrial();
+			return;
+		} else {
+			if (grown_past_latency) {
+				// これより大きくしても待ち時間の上限を守れない
+				dimension.upper_limit = dimension.best;
+			}
+			dimension.current = dimension.best;
+			if (!dimension.reversed) {
+				dimension.reversed = true;
+				dimension.direction = -dimension.direction;
+				if (tryMove(dimension)) {
+					return;
+				}
+			}
+			nextTrial();
+			return;
+		}
+		if (!tryMove(m_dimensions[m_current_dimension])) {
+			nextTrial();
+		}
+	}
+
+private:
+	static inline constexpr std::size_t PREDICTION = 0;
+	static inline constexpr std::size_t TRAINING = 1;
+
+	struct Dimension
+	{
+		Dimension(const char* n, std::size_t configured_min, std::size_t configured_max, std::optional<double> max_dwell)
+		    : name{n}, min_ratio{static_cast<double>(configured_min) / static_cast<double>(configured_max)},
+		      lower_limit{std::max<std::size_t>(configured_max / MAX_SHRINK_FACTOR, 1)}, upper_limit{configured_max},
+		      best{configured_max}, current{configured_max}, max_dwell_ms{max_dwell}
+		{
+		}
+
+		BatchSizeBounds bounds(std::size_t max) const noexcept
+		{
+			const auto min = static_cast<std::size_t>(std::lround(static_cast<double>(max) * min_ratio));
+			return {std::clamp<std::size_t>(min, 1, max), max};
+		}
+
+		const char* name;
+		double min_ratio;
+		std::size_t lower_limit;
+		std::size_t upper_limit;
+		std::size_t best;
+		std::size_t current;
+		std::optional<double> max_dwell_ms;
+		int direction = 1;
+		bool reversed = false;
+	};
+
+	template <class Duration>
+	static std::optional<double> toMilliseconds(const std::optional<Duration>& duration)
+	{
+		if (!duration.has_value()) {
+			return std::nullopt;
+		}
+		return std::chrono::duration<double, std::milli>(duration.value()).count();
+	}
+
+	bool exceedsLatency(std::size_t index, const Measurement& measurement) const noexcept
+	{
+		const auto& limit = m_dimensions[index].max_dwell_ms;
+		const auto dwell = index == PREDICTION ? measurement.prediction_dwell_p99_ms : measurement.training_dwell_p99_ms;
+		return limit.has_value() && dwell > limit.value();
+	}
+
+	void initializeDirections(const Measurement& measurement)
+	{
+		// 待ち時間が上限を超えているなら小さくする方から試す
+		// そうでなく、バッチが埋まり切っているか、キューに最大バッチサイズ以上溜まっているなら大きくする方から試す
+		auto choose = [&](std::size_t index, double average_batch_size, double average_queue_depth) {
+			const auto max = static_cast<double>(m_dimensions[index].current);
+			if (exceedsLatency(index, measurement)) {
+				return -1;
+			}
+			return average_batch_size >= 0.9 * max || average_queue_depth >= max ? 1 : -1;
+		};
+		m_dimensions[PREDICTION].direction = choose(PREDICTION, measurement.average_prediction_batch_size, measurement.average_prediction_queue_depth);
+		m_dimensions[TRAINING].direction = choose(TRAINING, measurement.average_training_batch_size, measurement.average_training_queue_depth);
+	}
+
+	// 現在の最良値から刻み幅分動かす。範囲外で動かせない場合はfalseを返す
+	bool tryMove(Dimension& dimension)
+	{
+		const auto base = static_cast<double>(dimension.best);
+		const auto target = dimension.direction > 0 ? base * m_step : base / m_step;
+		auto next = std::clamp(static_cast<std::size_t>(std::lround(target)), dimension.lower_limit, dimension.upper_limit);
+		if (next == dimension.best) {
+			// 刻み幅が小さくても最低1は動かす
+			next = std::clamp(dimension.direction > 0 ? dimension.best + 1 : dimension.best - 1, dimension.lower_limit, dimension.upper_limit);
+		}
+		if (next == dimension.best) {
+			return false;
+		}
+		dimension.current = next;
+		m_warming_up = true;
+		return true;
+	}
+
+	// 現在の次元の探索を終え、次の次元に移る
+	void nextTrial()
+	{
+		m_dimensions[m_current_dimension].current = m_dimensions[m_current_dimension].best;
+		m_current_dimension = (m_current_dimension + 1) % m_dimensions.size();
+		if (m_current_dimension == 0) {
+			if (!m_improved_in_round) {
+				m_step = std::sqrt(m_step);
+				if (m_step < MIN_STEP) {
+					m_settled = true;
+					std::cout << "autotune settled :";
+					logBounds();
+					std::cout << " , env steps/sec " << std::setprecision(6) << m_best_throughput << std::endl;
+					return;
+				}
+			}
+			m_improved_in_round = false;
+		}
+		for ([[maybe_unused]] std::size_t i = 0; i < m_dimensions.size(); ++i) {
+			auto& dimension = m_dimensions[m_current_dimension];
+			dimension.reversed = false;
+			if (tryMove(dimension)) {
+				return;
+			}
+			dimension.direction = -dimension.direction;
+			dimension.reversed = true;
+			if (tryMove(dimension)) {
+				return;
+			}
+			m_current_dimension = (m_current_dimension + 1) % m_dimensions.size();
+		}
+		// どちらも動かせない(範囲が1点しかない)
+		m_settled = true;
+		std::cout << "autotune settled :";
+		logBounds();
+		std::cout << std::endl;
+	}
+
+	void log(const Measurement& measurement) const
+	{
+		std::cout << "autotune trial :";
+		logBounds();
+		std::cout << " , env steps/sec " << std::setprecision(6) << measurement.env_steps_per_second
+		          << " , batch size " << measurement.average_prediction_batch_size << " " << measurement.average_training_batch_size
+		          << " , queue depth " << measurement.average_prediction_queue_depth << " " << measurement.average_training_queue_depth
+		          << " , latency(ms) " << measurement.average_prediction_latency_ms << " " << measurement.average_training_latency_ms
+		          << " , dwell p99(ms) " << measurement.prediction_dwell_p99_ms << " " << measurement.training_dwell_p99_ms << std::endl;
+	}
+	void logBounds() const
+	{
+		for (auto&& dimension : m_dimensions) {
+			const auto bounds = dimension.bounds(dimension.current);
+			std::cout << " " << dimension.name << " " << bounds.min << "-" << bounds.max;
+		}
+	}
+
+	std::array<Dimension, 2> m_dimensions;
+	std::size_t m_current_dimension = PREDICTION;
+	double m_step = INITIAL_STEP;
+	double m_best_throughput = 0.0;
+	bool m_has_best = false;
+	bool m_improved_in_round = false;
+	bool m_warming_up = true;
+	bool m_settled = false;
+};
+
+}  // namespace impala
@@ -0,0 +1,168 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server.hpp"
+#include "sokoban_env.hpp"
+#include "synthetic_model.hpp"
+
+// Python/PyTorchを使わず、SyntheticModelに対してエージェント・Predictor・Trainerの全体を動かし、スループットを計測する
+struct SokobanBenchParams
+{
+	static inline constexpr std::size_t NUM_AGENTS = 2048;
+	static inline constexpr std::size_t NUM_PREDICTORS = 2;
+	static inline constexpr std::size_t NUM_TRAINERS = 2;
+	static inline constexpr std::optional<std::size_t> NUM_AGENT_WORKERS = 8;
+
+	static inline constexpr std::size_t MIN_PREDICTION_BATCH_SIZE = 512;
+	static inline constexpr std::size_t MAX_PREDICTION_BATCH_SIZE = 1024;
+	static inline constexpr std::size_t MIN_TRAINING_BATCH_SIZE = 512;
+	static inline constexpr std::size_t MAX_TRAINING_BATCH_SIZE = 1024;
+	static inline constexpr std::size_t TRAINING_QUEUE_CAPACITY = 4096;
+	static inline constexpr std::optional<std::chrono::microseconds> MAX_PREDICTION_LATENCY = std::chrono::microseconds{5000};
+	static inline constexpr std::optional<std::chrono::microseconds> MAX_TRAINING_LATENCY = std::chrono::microseconds{50000};
+	static inline constexpr std::size_t PREDICTION_PIPELINE_DEPTH = 2;
+	static inline constexpr std::size_t TRAINING_PIPELINE_DEPTH = 2;
+
+	static inline constexpr bool SEPARATE_INFERENCE_MODEL = true;
+	static inline constexpr std::optional<std::size_t> WEIGHT_PUBLISH_INTERVAL_UPDATES = 4;
+	static inline constexpr std::optional<std::chrono::milliseconds> WEIGHT_PUBLISH_INTERVAL = std::chrono::milliseconds{200};
+
+	static inline constexpr std::size_t T_MAX = 5;
+	static inline constexpr std::optional<std::size_t> MAX_EPISODE_LENGTH = 120;
+
+	static inline constexpr std::optional<std::size_t> LOG_INTERVAL_STEPS = std::nullopt;
+	static inline constexpr std::optional<std::size_t> SAVE_INTERVAL_STEPS = std::nullopt;
+
+	static inline constexpr bool AUTOTUNE_BATCH_SIZE = false;
+	static inline constexpr std::chrono::milliseconds AUTOTUNE_INTERVAL = std::chrono::milliseconds{10000};
+
+	static inline constexpr std::optional<std::string_view> METRICS_FILE = std::nullopt;
+	static inline constexpr std::chrono::milliseconds METRICS_INTERVAL = std::chrono::milliseconds{10000};
+
+	static inline constexpr bool PIN_THREADS = false;
+
+	static inline constexpr std::optional<std::size_t> MAX_POLICY_LAG = std::nullopt;
+	static inline constexpr bool THROTTLE_STALE_AGENTS = false;
+
+	static inline constexpr std::optional<std::size_t> REPLAY_CAPACITY = std::nullopt;
+	static inline constexpr double REPLAY_RATIO = 1.0;
+	static inline constexpr double REPLAY_PRIORITY_EXPONENT = 0.0;
+
+	static inline constexpr std::size_t BATCH_RENDER_THREADS = 0;
+	static inline constexpr std::string_view BATCH_HUGE_PAGES = "none";
+	static inline constexpr bool DEDUPLICATE_OBSERVATIONS = true;
+	static inline constexpr std::size_t LEVEL_GENERATOR_THREADS = 0;
+	static inline constexpr std::size_t LEVEL_GENERATOR_BOXES = 2;
+	static inline constexpr std::size_t LEVEL_GENERATOR_DIFFICULTY = 3;
+	static inline constexpr std::optional<std::size_t> LEVEL_GENERATOR_SEED = std::nullopt;
+	static inline constexpr bool TERMINATE_ON_DEAD_SQUARES = false;
+	static inline constexpr bool TERMINATE_ON_FREEZE_DEADLOCKS = false;
+	static inline constexpr bool TERMINATE_ON_STATE_CYCLES = false;
+	static inline constexpr double EARLY_TERMINATION_PENALTY = 10.0;
+};
+
+namespace
+{
+
+// ServerConfigのキーに加えて、以下のベンチマーク固有の引数を受け付ける
+struct BenchOptions
+{
+	std::size_t steps = 10000000;
+	std::chrono::microseconds predict_latency{2000};
+	std::chrono::microseconds train_latency{20000};
+	// 0以外の場合、観測を描画せずセルの値のままバッチにする(SokobanCellEnv)
+	bool cell_code_observation = false;
+	// 0以外の場合、描画した画像をuint8にしてバッチにする(SokobanQuantizedEnv)
+	bool quantized_observation = false;
+};
+
+bool parseBenchArg(std::string_view arg, BenchOptions& options)
+{
+	auto parse = [&](std::string_view key, auto&& setter) {
+		if (arg.substr(0, key.size()) != key) {
+			return false;
+		}
+		const auto value = arg.substr(key.size());
+		if (value.empty() || value.find_first_not_of("0123456789") != std::string_view::npos) {
+			std::cerr << "invalid argument : " << arg << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+		setter(std::stoull(std::string{value}));
+		return true;
+	};
+	return parse("--bench_steps=", [&](auto v) { options.steps = v; })
+	       || parse("--predict_latency_us=", [&](auto v) { options.predict_latency = std::chrono::microseconds{v}; })
+	       || parse("--train_latency_us=", [&](auto v) { options.train_latency = std::chrono::microseconds{v}; })
+	       || parse("--cell_code_observation=", [&](auto v) { options.cell_code_observation = v != 0; })
+	       || parse("--quantized_observation=", [&](auto v) { options.quantized_observation = v != 0; });
+}
+
+template <class Environment>
+void runBench(const impala::ServerConfig& config, const BenchOptions& options)
+{
+	using namespace impala;
+	using Model = SyntheticModel<typename Environment::Action, typename Environment::BatchTraits::value_type>;
+	using BenchServer = Server<Environment, Model, SokobanBenchParams>;
+
+	auto server = std::make_unique<BenchServer>(config, options.predict_latency, options.train_latency);
+	const auto start = std::chrono::steady_clock::now();
+	server->run(options.steps);
+	const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	// run()の引数は学習した新しいステップ数で、エージェントはそれより先に進んでいることがあるため、環境のステップ数は数え直す
+	const auto env_steps = server->countEnvSteps();
+	const auto trained_samples = server->trainedSamples();
+	std::cout << "bench : " << env_steps << " env steps in " << seconds << " s , " << static_cast<double>(env_steps) / seconds << " env steps/sec";
+	std::cout << " , trained samples " << trained_samples << " (" << static_cast<double>(trained_samples) / seconds << " /sec)" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+	using namespace impala;
+
+	BenchOptions options;
+	std::vector<const char*> server_args{argv[0]};
+	for (int i = 1; i < argc; ++i) {
+		if (!parseBenchArg(argv[i], options)) {
+			server_args.emplace_back(argv[i]);
+		}
+	}
+	auto config = ServerConfig::fromParameters<SokobanBenchParams>();
+	auto env_config = SokobanEnvConfig::fromParameters<SokobanBenchParams>();
+	parseConfigArgs(static_cast<int>(server_args.size()), server_args.data(), config, env_config);
+	if (!config.isValid(SokobanBenchParams::SEPARATE_INFERENCE_MODEL)) {
+		std::cerr << "invalid server config" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!env_config.isValid()) {
+		std::cerr << "invalid sokoban config" << std::endl;
+		return EXIT_FAILURE;
+	}
+	config.print(std::cout);
+	env_config.print(std::cout);
+	std::cout << "bench_steps = " << options.steps << "\n";
+	std::cout << "predict_latency_us = " << options.predict_latency.count() << "\n";
+	std::cout << "train_latency_us = " << options.train_latency.count() << "\n";
+	std::cout << "cell_code_observation = " << (options.cell_code_observation ? "true" : "false") << "\n";
+	std::cout << "quantized_observation = " << (options.quantized_observation ? "true" : "false") << std::endl;
+
+	SokobanEnv::configure(env_config, config.num_agents);
+	if (options.cell_code_observation) {
+		runBench<SokobanCellEnv>(config, options);
+	} else if (options.quantized_observation) {
+		runBench<SokobanQuantizedEnv>(config, options);
+	} else {
+		runBench<SokobanEnv>(config, options);
+	}
+	if (env_config.level_generator_threads > 0) {
+		std::cout << "level generator misses : " << SokobanEnv::levelGeneratorMisses() << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace impala
+{
+
+// Dmitry VyukovのBounded MPMC Queue
+// push/popはロックを取らず、容量は2のべき乗に切り上げられる
+template <class T>
+class BoundedMPMCQueue
+{
+public:
+	explicit BoundedMPMCQueue(std::size_t capacity) : m_capacity{roundUpToPowerOfTwo(capacity)}, m_mask{m_capacity - 1}, m_cells{std::make_unique<Cell[]>(m_capacity)}
+	{
+		for (std::size_t i = 0; i < m_capacity; ++i) {
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+	BoundedMPMCQueue(const BoundedMPMCQueue&) = delete;
+	BoundedMPMCQueue& operator=(const BoundedMPMCQueue&) = delete;
+
+	// 満杯の場合はvalueをmoveせずにfalseを返す
+	bool tryPush(T&& value)
+	{
+		return tryEmplace(std::move(value));
+	}
+
+	// 満杯の場合は要素を構築せずにfalseを返す
+	template <class... Args>
+	bool tryEmplace(Args&&... args)
+	{
+		Cell* cell;
+		auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &m_cells[pos & m_mask];
+			const auto seq = cell->sequence.load(std::memory_order_acquire);
+			const auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = m_enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data.emplace(std::forward<Args>(args)...);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	std::optional<T> tryPop()
+	{
+		Cell* cell;
+		auto pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &m_cells[pos & m_mask];
+			const auto seq = cell->sequence.load(std::memory_order_acquire);
+			const auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+			if (diff == 0) {
+				if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return std::nullopt;
+			} else {
+				pos = m_dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		std::optional<T> value{std::move(cell->data)};
+		cell->data.reset();
+		cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+		return value;
+	}
+
+	// 書き込み途中の要素も数えるため、直後のtryPopが失敗することがある
+	std::size_t sizeApprox() const noexcept
+	{
+		const auto dequeue_pos = m_dequeue_pos.load(std::memory_order_seq_cst);
+		const auto enqueue_pos = m_enqueue_pos.load(std::memory_order_seq_cst);
+		return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+	}
+	std::size_t capacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+private:
+	static std::size_t roundUpToPowerOfTwo(std::size_t n) noexcept
+	{
+		std::size_t result = 1;
+		while (result < n) {
+			result <<= 1;
+		}
+		return result;
+	}
+
+	struct alignas(64) Cell
+	{
+		std::atomic<std::size_t> sequence;
+		std::optional<T> data;
+	};
+
+	const std::size_t m_capacity;
+	const std::size_t m_mask;
+	std::unique_ptr<Cell[]> m_cells;
+	alignas(64) std::atomic<std::size_t> m_enqueue_pos{0};
+	alignas(64) std::atomic<std::size_t> m_dequeue_pos{0};
+};
+
+// 待機中のスレッドが居ない間はnotifyがロックを取らないcondition_variable
+// 条件を満たす状態を作った側は、その後にnotifyOne/notifyAllを呼ぶこと
+class EventNotifier
+{
+public:
+	template <class Predicate>
+	void wait(Predicate pred)
+	{
+		std::unique_lock lock{m_mutex};
+		m_waiters.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		m_event.wait(lock, pred);
+		m_waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+	template <class Clock, class Duration, class Predicate>
+	bool waitUntil(const std::chrono::time_point<Clock, Duration>& deadline, Predicate pred)
+	{
+		std::unique_lock lock{m_mutex};
+		m_waiters.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		auto result = m_event.wait_until(lock, deadline, pred);
+		m_waiters.fetch_sub(1, std::memory_order_relaxed);
+		return result;
+	}
+
+	void notifyOne()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_waiters.load(std::memory_order_relaxed) == 0) {
+			return;
+		}
+		{
+			std::lock_guard lock{m_mutex};
+		}
+		m_event.notify_one();
+	}
+	void notifyAll()
+	{
+		{
+			std::lock_guard lock{m_mutex};
+		}
+		m_event.notify_all();
+	}
+
+private:
+	std::atomic<std::size_t> m_waiters{0};
+	std::mutex m_mutex;
+	std::condition_variable m_event;
+};
+
+}  // namespace impala
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace impala
+{
+
+// forEachField(f)で各項目の名前と参照をfに渡す設定の構造体に、文字列による設定と表示を加える
+template <class Derived>
+class ConfigFields
+{
+public:
+	// 未知のキーや解釈できない値の場合はfalseを返す
+	bool set(std::string_view key, std::string_view value)
+	{
+		bool found = false;
+		bool ok = false;
+		derived().forEachField([&](std::string_view name, auto& field) {
+			if (name == key) {
+				found = true;
+				ok = parseValue(value, field);
+			}
+		});
+		return found && ok;
+	}
+
+	void print(std::ostream& out)
+	{
+		derived().forEachField([&](std::string_view name, const auto& field) {
+			out << name << " = ";
+			printValue(out, field);
+			out << "\n";
+		});
+		out << std::flush;
+	}
+
+private:
+	Derived& derived() noexcept
+	{
+		return static_cast<Derived&>(*this);
+	}
+
+	static bool parseValue(std::string_view str, std::size_t& value)
+	{
+		if (str.empty() || str.find_first_not_of("0123456789") != std::string_view::npos) {
+			return false;
+		}
+		try {
+			value = std::stoull(std::string{str});
+		} catch (const std::invalid_argument&) {
+			return false;
+		} catch (const std::out_of_range&) {
+			return false;
+		}
+		return true;
+	}
+	static bool parseValue(std::string_view str, double& value)
+	{
+		if (str.find_first_of("0123456789") == std::string_view::npos || str.find_first_not_of("0123456789.") != std::string_view::npos || str.find('.') != str.rfind('.')) {
+			return false;
+		}
+		try {
+			value = std::stod(std::string{str});
+		} catch (const std::invalid_argument&) {
+			return false;
+		} catch (const std::out_of_range&) {
+			return false;
+		}
+		return true;
+	}
+	static bool parseValue(std::string_view str, std::string& value)
+	{
+		value = std::string{str};
+		return true;
+	}
+	static bool parseValue(std::string_view str, bool& value)
+	{
+		if (str == "true" || str == "1") {
+			value = true;
+			return true;
+		}
+		if (str == "false" || str == "0") {
+			value = false;
+			return true;
+		}
+		return false;
+	}
+	template <class Rep, class Period>
+	static bool parseValue(std::string_view str, std::chrono::duration<Rep, Period>& value)
+	{
+		std::size_t count;
+		if (!parseValue(str, count)) {
+			return false;
+		}
+		value = std::chrono::duration<Rep, Period>{static_cast<Rep>(count)};
+		return true;
+	}
+	template <class T>
+	static bool parseValue(std::string_view str, std::optional<T>& value)
+	{
+		if (str == "none") {
+			value = std::nullopt;
+			return true;
+		}
+		T v;
+		if (!parseValue(str, v)) {
+			return false;
+		}
+		value = v;
+		return true;
+	}
+
+	static void printValue(std::ostream& out, std::size_t value)
+	{
+		out << value;
+	}
+	static void printValue(std::ostream& out, double value)
+	{
+		out << value;
+	}
+	static void printValue(std::ostream& out, const std::string& value)
+	{
+		out << value;
+	}
+	static void printValue(std::ostream& out, bool value)
+	{
+		out << (value ? "true" : "false");
+	}
+	template <class Rep, class Period>
+	static void printValue(std::ostream& out, std::chrono::duration<Rep, Period> value)
+	{
+		out << value.count();
+	}
+	template <class T>
+	static void printValue(std::ostream& out, const std::optional<T>& value)
+	{
+		if (value.has_value()) {
+			printValue(out, value.value());
+		} else {
+			out << "none";
+		}
+	}
+};
+
+namespace config_detail
+{
+
+inline std::string_view trim(std::string_view str)
+{
+	const auto first = str.find_first_not_of(" \t\r");
+	if (first == std::string_view::npos) {
+		return {};
+	}
+	const auto last = str.find_last_not_of(" \t\r");
+	return str.substr(first, last - first + 1);
+}
+
+}  // namespace config_detail
+
+// "key = value" 形式の行を読み込む. '#'以降はコメント
+// 各キーはconfigsのいずれか1つが持つもので、そのconfigに設定する
+template <class... Configs>
+void loadConfigFile(const std::string& path, Configs&... configs)
+{
+	using config_detail::trim;
+	std::ifstream in{path};
+	if (!in) {
+		std::cerr << "cannot open config file : " << path << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		auto content = trim(std::string_view{line}.substr(0, line.find('#')));
+		if (content.empty()) {
+			continue;
+		}
+		auto pos = content.find('=');
+		if (pos == std::string_view::npos || !(configs.set(trim(content.substr(0, pos)), trim(content.substr(pos + 1))) || ...)) {
+			std::cerr << "invalid config line in " << path << " : " << line << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// --config=<path> で設定ファイルを読み込み、--<key>=<value> で個別の値を上書きする
+template <class... Configs>
+void parseConfigArgs(int argc, const char* const* argv, Configs&... configs)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string_view arg{argv[i]};
+		auto pos = arg.find('=');
+		if (arg.substr(0, 2) != "--" || pos == std::string_view::npos) {
+			std::cerr << "invalid argument : " << arg << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+		auto key = arg.substr(2, pos - 2);
+		auto value = arg.substr(pos + 1);
+		if (key == "config") {
+			loadConfigFile(std::string{value}, configs...);
+		} else if (!(configs.set(key, value) || ...)) {
+			std::cerr << "invalid argument : " << arg << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+}
+
+}  // namespace impala
@@ -0,0 +1,35 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "sokoban_env.hpp"
+
+// テキスト形式の問題集(sokoban_problems.txt)を、SokobanEnvがmmapするバイナリ形式(sokoban_problems.bin)に変換する
+int main(int argc, char* argv[])
+{
+	using namespace impala;
+
+	if (argc != 3) {
+		std::cerr << "usage : " << argv[0] << " <input.txt> <output.bin>" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::ifstream in{argv[1]};
+	if (!in) {
+		std::cerr << "cannot open input file : " << argv[1] << std::endl;
+		return EXIT_FAILURE;
+	}
+	const auto problems = SokobanEnv::parseProblemText(in, argv[1]);
+	if (problems.empty()) {
+		std::cerr << "no problems in " << argv[1] << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::ofstream out{argv[2], std::ios::binary | std::ios::trunc};
+	SokobanEnv::writeProblemFile(out, problems);
+	out.close();
+	if (!out) {
+		std::cerr << "cannot write output file : " << argv[2] << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout << "convert " << problems.size() << " problems : " << argv[1] << " -> " << argv[2] << std::endl;
+	return 0;
+}
@@ -4,6 +4,8 @@
 #include <functional>
 #include <optional>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "action.hpp"
@@ -27,7 +29,7 @@ template <class T,
             std::is_same<typename T::Observation, decltype(std::declval<T&>().reset())>,
             std::is_same<std::tuple<typename T::Observation, typename T::Reward, EnvState>, decltype(std::declval<T&>().step(std::declval<typename T::Action>()))>,
             std::is_same<void, decltype(std::declval<const T&>().render())>,
-            std::is_same<typename T::ObsBatch, decltype(T::makeBatch(std::declval<std::vector<std::optional<typename T::Observation>>&>().begin(), std::declval<std::vector<std::optional<typename T::Observation>>&>().end()))>,
+            std::is_same<typename T::ObsBatch, decltype(T::makeBatch(std::declval<std::vector<const typename T::Observation*>&>().begin(), std::declval<std::vector<const typename T::Observation*>&>().end()))>,
             std::is_same<typename T::ObsBatch, decltype(T::makeBatch(std::declval<std::vector<std::reference_wrapper<std::add_const_t<typename T::Observation>>>&>().begin(), std::declval<std::vector<std::reference_wrapper<std::add_const_t<typename T::Observation>>>&>().end()))>>,
         std::nullptr_t> = nullptr>
 inline constexpr std::true_type isEnvironmentHelper(const volatile T*);
@@ -47,5 +49,37 @@ struct IsEnvironment
 template <class T>
 inline constexpr bool IsEnvironmentV = IsEnvironment<T>::value;
 
+// 既存のObsBatchの領域に書き込む makeBatch(first, last, ObsBatch&) を持つか
+// 持つ場合、Serverは学習バッチの領域を確保し直さずに再利用する
+template <class T, class = void>
+struct HasInPlaceMakeBatch : public std::false_type
+{};
+
+template <class T>
+struct HasInPlaceMakeBatch<T, std::void_t<decltype(T::makeBatch(std::declval<std::vector<const typename T::Observation*>&>().begin(), std::declval<std::vector<const typename T::Observation*>&>().end(), std::declval<typename T::ObsBatch&>()))>>
+    : public std::true_type
+{};
+
+template <class T>
+inline constexpr bool HasInPlaceMakeBatchV = HasInPlaceMakeBatch<T>::value;
+
+// 呼び出し側の観測に書き込む reset(Observation&) と step(action, Observation&) を持つか
+// 持つ場合、Serverのエージェントは観測の領域を使い回し、定常状態では確保を行わない
+template <class T, class = void>
+struct HasInPlaceStep : public std::false_type
+{};
+
+template <class T>
+struct HasInPlaceStep<T,
+    std::enable_if_t<
+        std::conjunction_v<
+            std::is_same<void, decltype(std::declval<T&>().reset(std::declval<typename T::Observation&>()))>,
+            std::is_same<std::tuple<typename T::Reward, EnvState>, decltype(std::declval<T&>().step(std::declval<typename T::Action>(), std::declval<typename T::Observation&>()))>>>>
+    : public std::true_type
+{};
+
+template <class T>
+inline constexpr bool HasInPlaceStepV = HasInPlaceStep<T>::value;
+
 
 }  // namespace impala
@@ -1,5 +1,10 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <string_view>
+#include <type_traits>
 
 #include "action.hpp"
 #include "environment.hpp"
@@ -14,25 +19,88 @@ struct SokobanTrainParams
 	static inline constexpr std::size_t NUM_AGENTS = 2048;
 	static inline constexpr std::size_t NUM_PREDICTORS = 2;
 	static inline constexpr std::size_t NUM_TRAINERS = 2;
+	static inline constexpr std::optional<std::size_t> NUM_AGENT_WORKERS = 8;
 
 	static inline constexpr std::size_t MIN_PREDICTION_BATCH_SIZE = 512;
 	static inline constexpr std::size_t MAX_PREDICTION_BATCH_SIZE = 1024;
 	static inline constexpr std::size_t MIN_TRAINING_BATCH_SIZE = 512;
 	static inline constexpr std::size_t MAX_TRAINING_BATCH_SIZE = 1024;
+	static inline constexpr std::size_t TRAINING_QUEUE_CAPACITY = 4096;
+	static inline constexpr std::optional<std::chrono::microseconds> MAX_PREDICTION_LATENCY = std::chrono::microseconds{5000};
+	static inline constexpr std::optional<std::chrono::microseconds> MAX_TRAINING_LATENCY = std::chrono::microseconds{50000};
+	static inline constexpr std::size_t PREDICTION_PIPELINE_DEPTH = 2;
+	static inline constexpr std::size_t TRAINING_PIPELINE_DEPTH = 2;
+
+	static inline constexpr bool SEPARATE_INFERENCE_MODEL = true;
+	static inline constexpr std::optional<std::size_t> WEIGHT_PUBLISH_INTERVAL_UPDATES = 4;
+	static inline constexpr std::optional<std::chrono::milliseconds> WEIGHT_PUBLISH_INTERVAL = std::chrono::milliseconds{200};
 
 	static inline constexpr std::size_t T_MAX = 5;
 	static inline constexpr std::optional<std::size_t> MAX_EPISODE_LENGTH = 120;
 
 	static inline constexpr std::optional<std::size_t> LOG_INTERVAL_STEPS = 10000;
 	static inline constexpr std::optional<std::size_t> SAVE_INTERVAL_STEPS = 1000000;
+
+	static inline constexpr bool AUTOTUNE_BATCH_SIZE = false;
+	static inline constexpr std::chrono::milliseconds AUTOTUNE_INTERVAL = std::chrono::milliseconds{10000};
+
+	static inline constexpr std::optional<std::string_view> METRICS_FILE = std::nullopt;
+	static inline constexpr std::chrono::milliseconds METRICS_INTERVAL = std::chrono::milliseconds{10000};
+
+	static inline constexpr bool PIN_THREADS = false;
+
+	static inline constexpr std::optional<std::size_t> MAX_POLICY_LAG = std::nullopt;
+	static inline constexpr bool THROTTLE_STALE_AGENTS = false;
+
+	static inline constexpr std::optional<std::size_t> REPLAY_CAPACITY = std::nullopt;
+	static inline constexpr double REPLAY_RATIO = 1.0;
+	static inline constexpr double REPLAY_PRIORITY_EXPONENT = 0.0;
+
+	static inline constexpr std::size_t BATCH_RENDER_THREADS = 0;
+	static inline constexpr std::string_view BATCH_HUGE_PAGES = "none";
+	static inline constexpr bool DEDUPLICATE_OBSERVATIONS = true;
+	static inline constexpr std::size_t LEVEL_GENERATOR_THREADS = 0;
+	static inline constexpr std::size_t LEVEL_GENERATOR_BOXES = 2;
+	static inline constexpr std::size_t LEVEL_GENERATOR_DIFFICULTY = 3;
+	static inline constexpr std::optional<std::size_t> LEVEL_GENERATOR_SEED = std::nullopt;
+	static inline constexpr bool TERMINATE_ON_DEAD_SQUARES = false;
+	static inline constexpr bool TERMINATE_ON_FREEZE_DEADLOCKS = false;
+	static inline constexpr bool TERMINATE_ON_STATE_CYCLES = false;
+	static inline constexpr double EARLY_TERMINATION_PENALTY = 10.0;
+
+	// trueの場合、観測を描画せずにセルの値のままPythonに渡し、モデルの中でone-hotにする
+	static inline constexpr bool CELL_CODE_OBSERVATION = false;
+	// trueの場合、描画した画像の各画素をuint8にしてPythonに渡し、torchの側でfloatに戻す
+	static inline constexpr bool QUANTIZED_OBSERVATION = false;
 };
 
-int main()
+int main(int argc, char* argv[])
 {
 	using namespace impala;
+	using Environment = std::conditional_t<SokobanTrainParams::CELL_CODE_OBSERVATION, SokobanCellEnv,
+	    std::conditional_t<SokobanTrainParams::QUANTIZED_OBSERVATION, SokobanQuantizedEnv, SokobanEnv>>;
+	using Model = std::conditional_t<SokobanTrainParams::CELL_CODE_OBSERVATION, CellCodeNetwork,
+	    std::conditional_t<SokobanTrainParams::QUANTIZED_OBSERVATION, QuantizedNetwork, Network>>;
+	using SokobanServer = Server<Environment, Model, SokobanTrainParams>;
+	auto config = SokobanServer::defaultConfig();
+	auto env_config = SokobanEnvConfig::fromParameters<SokobanTrainParams>();
+	parseConfigArgs(argc, argv, config, env_config);
+	if (!config.isValid(SokobanTrainParams::SEPARATE_INFERENCE_MODEL)) {
+		std::cerr << "invalid server config" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!env_config.isValid()) {
+		std::cerr << "invalid sokoban config" << std::endl;
+		return EXIT_FAILURE;
+	}
+	config.print(std::cout);
+	env_config.print(std::cout);
 	PythonInitializer py_initializer{false};
-	SokobanEnv::loadProblems();
-	auto server = std::make_unique<Server<SokobanEnv, Network, SokobanTrainParams>>();
-	server->run(1000000000);
+	SokobanEnv::configure(env_config, config.num_agents);
+	auto server = std::make_unique<SokobanServer>(config);
+	{
+		PythonGILReleaser gil_releaser;
+		server->run(1000000000);
+	}
 	return 0;
 }
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+namespace impala
+{
+
+// 非負整数の分布をロックを取らずに記録するヒストグラム
+// 2のべき乗毎の区間を更にSUB_BUCKETS等分したバケットで数えるため、分位点の相対誤差は高々1/SUB_BUCKETS
+class Histogram
+{
+public:
+	static inline constexpr std::size_t SUB_BUCKET_BITS = 3;
+	static inline constexpr std::size_t SUB_BUCKETS = std::size_t{1} << SUB_BUCKET_BITS;
+	static inline constexpr std::size_t NUM_BUCKETS = 64 * SUB_BUCKETS;
+
+	struct Snapshot
+	{
+		std::array<std::uint64_t, NUM_BUCKETS> counts{};
+		std::uint64_t count = 0;
+		std::uint64_t total = 0;
+
+		// prevを取得してからの差分
+		Snapshot since(const Snapshot& prev) const noexcept
+		{
+			Snapshot result;
+			for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+				result.counts[i] = counts[i] - prev.counts[i];
+			}
+			result.count = count - prev.count;
+			result.total = total - prev.total;
+			return result;
+		}
+
+		// 分位点を返す。空の場合は0
+		std::uint64_t quantile(double q) const noexcept
+		{
+			std::uint64_t num_values = 0;
+			for (auto c : counts) {
+				num_values += c;
+			}
+			if (num_values == 0) {
+				return 0;
+			}
+			const auto rank = std::max<std::uint64_t>(static_cast<std::uint64_t>(q * static_cast<double>(num_values) + 0.5), 1);
+			std::uint64_t cumulative = 0;
+			for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+				cumulative += counts[i];
+				if (cumulative >= rank) {
+					return bucketUpperBound(i);
+				}
+			}
+			return bucketUpperBound(NUM_BUCKETS - 1);
+		}
+	};
+
+	void add(std::uint64_t value) noexcept
+	{
+		m_buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+		m_total.fetch_add(value, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		auto max = m_max.load(std::memory_order_relaxed);
+		while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+		}
+	}
+
+	// 記録中に取得した場合、各値は厳密には同じ時点のものにならない
+	Snapshot snapshot() const noexcept
+	{
+		Snapshot result;
+		for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+			result.counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+		}
+		result.count = m_count.load(std::memory_order_relaxed);
+		result.total = m_total.load(std::memory_order_relaxed);
+		return result;
+	}
+	// 前回の呼び出し以降の最大値を返す
+	std::uint64_t takeMax() noexcept
+	{
+		return m_max.exchange(0, std::memory_order_relaxed);
+	}
+	std::uint64_t count() const noexcept
+	{
+		return m_count.load(std::memory_order_relaxed);
+	}
+	std::uint64_t total() const noexcept
+	{
+		return m_total.load(std::memory_order_relaxed);
+	}
+
+private:
+	static std::size_t bucketIndex(std::uint64_t value) noexcept
+	{
+		if (value < SUB_BUCKETS) {
+			return static_cast<std::size_t>(value);
+		}
+		const auto msb = static_cast<std::size_t>(63 - __builtin_clzll(value));
+		const auto shift = msb - SUB_BUCKET_BITS;
+		const auto sub = static_cast<std::size_t>(value >> shift) & (SUB_BUCKETS - 1);
+		return (shift + 1) * SUB_BUCKETS + sub;
+	}
+	static std::uint64_t bucketUpperBound(std::size_t index) noexcept
+	{
+		if (index < SUB_BUCKETS) {
+			return index;
+		}
+		const auto shift = index / SUB_BUCKETS - 1;
+		const auto sub = index % SUB_BUCKETS;
+		return (static_cast<std::uint64_t>(SUB_BUCKETS + sub + 1) << shift) - 1;
+	}
+
+	std::array<std::atomic<std::uint64_t>, NUM_BUCKETS> m_buckets{};
+	std::atomic<std::uint64_t> m_count{0};
+	std::atomic<std::uint64_t> m_total{0};
+	std::atomic<std::uint64_t> m_max{0};
+};
+
+// 所要時間をナノ秒単位で記録するヒストグラム
+class LatencyHistogram : public Histogram
+{
+public:
+	using Duration = std::chrono::steady_clock::duration;
+
+	void add(Duration duration) noexcept
+	{
+		Histogram::add(static_cast<std::uint64_t>(std::max<std::int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), 0)));
+	}
+};
+
+// Prometheusのテキスト形式でメトリクスを書き出す
+// 一時ファイルに書いてから置き換えるため、node_exporterのtextfile collectorなどが書き込み途中の内容を読むことはない
+class PrometheusTextFile
+{
+public:
+	explicit PrometheusTextFile(const std::string& path) : m_path{path}, m_temp_path{path + ".tmp"}, m_out{m_temp_path} {}
+
+	void counter(std::string_view name, std::string_view help, double value)
+	{
+		header(name, help, "counter");
+		m_out << name << " " << value << "\n";
+	}
+	void gauge(std::string_view name, std::string_view help, double value)
+	{
+		header(name, help, "gauge");
+		m_out << name << " " << value << "\n";
+	}
+	// 分位点と最大値はintervalの区間、_sumと_countは起動時からの累計を出力する
+	// 値はscale倍して出力する(ナノ秒のLatencyHistogramを秒にする場合は1e-9)
+	void summary(std::string_view name, std::string_view help, const Histogram::Snapshot& interval, const Histogram::Snapshot& total, std::uint64_t max, double scale)
+	{
+		header(name, help, "summary");
+		for (auto q : {0.5, 0.99}) {
+			// バケットの上端を返すため、最大値を超えないよう丸める
+			m_out << name << "{quantile=\"" << q << "\"} " << static_cast<double>(std::min(interval.quantile(q), max)) * scale << "\n";
+		}
+		m_out << name << "{quantile=\"1\"} " << static_cast<double>(max) * scale << "\n";
+		m_out << name << "_sum " << static_cast<double>(total.total) * scale << "\n";
+		m_out << name << "_count " << total.count << "\n";
+	}
+
+	// 書き込みに失敗した場合はfalseを返す
+	bool commit()
+	{
+		m_out.close();
+		if (!m_out) {
+			return false;
+		}
+		return std::rename(m_temp_path.c_str(), m_path.c_str()) == 0;
+	}
+
+private:
+	void header(std::string_view name, std::string_view help, std::string_view type)
+	{
+		m_out << "# HELP " << name << " " << help << "\n";
+		m_out << "# TYPE " << name << " " << type << "\n";
+	}
+
+	std::string m_path;
+	std::string m_temp_path;
+	std::ofstream m_out;
+};
+
+}  // namespace impala
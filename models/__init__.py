@@ -1,3 +1,4 @@
 from .a3c_model import A3CModel
+from .a3c_cell_model import A3CCellModel
 
-__all__ = ['A3CModel', ]
+__all__ = ['A3CModel', 'A3CCellModel', ]
@@ -0,0 +1,36 @@
+import torch.nn as nn
+import torch.nn.functional as F
+
+# SokobanEnv::CellStateの種類の数
+NUM_CELL_STATES = 7
+
+
+# 描画していない8x8のセルの値を入力とするA3CModel
+class A3CCellModel(nn.Module):
+    def __init__(self):
+        super(A3CCellModel, self).__init__()
+        self.conv_1 = nn.Conv2d(NUM_CELL_STATES, 32, 3, 1, 1)
+        self.conv_2 = nn.Conv2d(32, 64, 3, 1, 1)
+        self.conv_3 = nn.Conv2d(64, 64, 3, 1, 1)
+        self.l_1 = nn.Linear(4096, 512)
+        self.l_pi = nn.Linear(512, 4)
+        self.l_v = nn.Linear(512, 1)
+
+    def hidden(self, x):
+        # (N, 8, 8)のセルの値を(N, 7, 8, 8)のone-hotにする
+        x = F.one_hot(x.long(), NUM_CELL_STATES).permute(0, 3, 1, 2).float()
+        h = F.leaky_relu(self.conv_1(x))
+        h = F.leaky_relu(self.conv_2(h))
+        h = F.leaky_relu(self.conv_3(h))
+        h = h.view(-1, 4096)
+        return F.leaky_relu(self.l_1(h))
+
+    def forward(self, x):
+        h = self.hidden(x)
+        return self.l_pi(h), self.l_v(h)
+
+    def pi(self, x):
+        return self.l_pi(self.hidden(x))
+
+    def v(self, x):
+        return self.l_v(self.hidden(x))
@@ -1,3 +1,5 @@
+#include <string>
+
 #include <range/v3/view/indices.hpp>
 
 #include "network.hpp"
@@ -5,56 +7,68 @@
 namespace impala
 {
 
-Network::Network()
+template <class ObservationFormat>
+BasicNetwork<ObservationFormat>::BasicNetwork()
 {
+	PythonGILGuard gil;
 	try {
 		m_python_main_ns = makePythonMainNameSpace();
+		m_python_main_ns["observation_format"] = std::string{ObservationFormat::name};
 		boost::python::exec_file("train.py", m_python_main_ns);
 		m_predict_func = m_python_main_ns["predict_func"];
 		m_train_func = m_python_main_ns["train_func"];
 		m_save_func = m_python_main_ns["save_model"];
-	} catch (boost::python::error_already_set) {
+		m_enable_inference_model_func = m_python_main_ns["enable_inference_model"];
+		m_publish_weights_func = m_python_main_ns["publish_weights"];
+	} catch (const boost::python::error_already_set&) {
 		::PyErr_Print();
 		std::terminate();
 	}
 }
 
-std::vector<std::tuple<std::int64_t, float>> Network::predict(ranges::span<typename StateTraits::value_type> states)
+template <class ObservationFormat>
+typename BasicNetwork<ObservationFormat>::Prediction BasicNetwork<ObservationFormat>::predict(ranges::span<typename StateTraits::value_type> states, ranges::span<std::int64_t> state_indices)
 {
+	PythonGILGuard gil;
 	try {
 		namespace np = boost::python::numpy;
-		const auto batch_size = static_cast<std::size_t>(states.size()) / StateTraits::size_of_all;
+		const auto batch_size = static_cast<std::size_t>(state_indices.size());
 		auto states_ndarray = StateTraits::convertToBatchedNdArray(states);
-		auto result = m_predict_func(states_ndarray);
+		auto state_indices_ndarray = NdArrayTraits<std::int64_t, 1>::convertToBatchedNdArray(state_indices);
+		auto result = m_predict_func(states_ndarray, state_indices_ndarray);
 		auto actions = np::from_object(result[0], np::dtype::get_builtin<std::int64_t>(), 1);
 		assert(static_cast<std::size_t>(actions.shape(0)) == batch_size);
 		assert(actions.strides(0) == sizeof(std::int64_t));
 		auto behaviour_policy = np::from_object(result[1], np::dtype::get_builtin<float>(), 1);
 		assert(static_cast<std::size_t>(behaviour_policy.shape(0)) == batch_size);
 		assert(behaviour_policy.strides(0) == sizeof(float));
-		std::vector<std::tuple<std::int64_t, float>> data;
-		data.reserve(batch_size);
+		Prediction prediction;
+		prediction.actions_and_policies.reserve(batch_size);
 		for (auto i : ranges::view::indices(batch_size)) {
 			auto action_id = reinterpret_cast<std::int64_t*>(actions.get_data())[i];
 			auto bp = reinterpret_cast<float*>(behaviour_policy.get_data())[i];
-			data.emplace_back(action_id, bp);
+			prediction.actions_and_policies.emplace_back(action_id, bp);
 		}
-		return data;
-	} catch (boost::python::error_already_set) {
+		prediction.weight_version = boost::python::extract<std::int64_t>(result[2]);
+		return prediction;
+	} catch (const boost::python::error_already_set&) {
 		::PyErr_Print();
 		std::terminate();
 	}
 }
 
-Network::Loss Network::train(ranges::span<typename StateTraits::value_type> states, ranges::span<std::int64_t> action_ids, ranges::span<Reward> rewards, ranges::span<float> behaviour_policies, ranges::span<std::int64_t> data_sizes, ranges::span<std::int64_t> observation_sizes)
+template <class ObservationFormat>
+typename BasicNetwork<ObservationFormat>::Loss BasicNetwork<ObservationFormat>::train(ranges::span<typename StateTraits::value_type> states, ranges::span<std::int64_t> state_indices, ranges::span<std::int64_t> action_ids, ranges::span<Reward> rewards, ranges::span<float> behaviour_policies, ranges::span<std::int64_t> data_sizes, ranges::span<std::int64_t> observation_sizes)
 {
+	PythonGILGuard gil;
 	try {
 		namespace np = boost::python::numpy;
 		const auto t_max = static_cast<std::size_t>(data_sizes.size());
 		assert(data_sizes.size() + 1 == observation_sizes.size());
-		const auto batch_size = static_cast<std::size_t>(states.size()) / StateTraits::size_of_all / (t_max + 1);
+		const auto batch_size = static_cast<std::size_t>(state_indices.size()) / (t_max + 1);
 		assert(static_cast<std::size_t>(action_ids.size()) == batch_size * t_max && static_cast<std::size_t>(rewards.size()) == batch_size * t_max && static_cast<std::size_t>(behaviour_policies.size()) == batch_size * t_max);
-		auto states_ndarray = StateTraits::convertToBatchedNdArray(states, t_max + 1, batch_size);
+		auto states_ndarray = StateTraits::convertToBatchedNdArray(states);
+		auto state_indices_ndarray = NdArrayTraits<std::int64_t, 1>::convertToBatchedNdArray(state_indices, t_max + 1, batch_size);
 		auto action_ids_ndarray = NdArrayTraits<std::int64_t, 1>::convertToBatchedNdArray(action_ids, t_max, batch_size);
 		auto rewards_ndarray = NdArrayTraits<Reward, 1>::convertToBatchedNdArray(rewards, t_max, batch_size);
 		auto bp_ndarray = NdArrayTraits<float, 1>::convertToBatchedNdArray(behaviour_policies, t_max, batch_size);
@@ -66,26 +80,61 @@ Network::Loss Network::train(ranges::span<typename StateTraits::value_type> stat
 		for (auto&& s : observation_sizes) {
 			observation_sizes_list.append(s);
 		}
-		auto result = m_train_func(states_ndarray, action_ids_ndarray, rewards_ndarray, bp_ndarray, data_sizes_list, observation_sizes_list);
+		auto result = m_train_func(states_ndarray, state_indices_ndarray, action_ids_ndarray, rewards_ndarray, bp_ndarray, data_sizes_list, observation_sizes_list);
 		Loss loss;
 		loss.v_loss = boost::python::extract<double>(result[0]);
 		loss.pi_loss = boost::python::extract<double>(result[1]);
 		loss.entropy_loss = boost::python::extract<double>(result[2]);
+		auto priorities = np::from_object(result[3], np::dtype::get_builtin<float>(), 1);
+		assert(static_cast<std::size_t>(priorities.shape(0)) == batch_size);
+		assert(priorities.strides(0) == sizeof(float));
+		const auto* priorities_data = reinterpret_cast<const float*>(priorities.get_data());
+		loss.priorities.assign(priorities_data, priorities_data + batch_size);
 		return loss;
-	} catch (boost::python::error_already_set) {
+	} catch (const boost::python::error_already_set&) {
 		::PyErr_Print();
 		std::terminate();
 	}
 }
 
-void Network::save(int index)
+template <class ObservationFormat>
+void BasicNetwork<ObservationFormat>::save(int index)
 {
+	PythonGILGuard gil;
 	try {
 		m_save_func(index);
-	} catch (boost::python::error_already_set) {
+	} catch (const boost::python::error_already_set&) {
+		::PyErr_Print();
+		std::terminate();
+	}
+}
+
+template <class ObservationFormat>
+void BasicNetwork<ObservationFormat>::enableInferenceModel()
+{
+	PythonGILGuard gil;
+	try {
+		m_enable_inference_model_func();
+	} catch (const boost::python::error_already_set&) {
 		::PyErr_Print();
 		std::terminate();
 	}
 }
 
+template <class ObservationFormat>
+void BasicNetwork<ObservationFormat>::publishWeights()
+{
+	PythonGILGuard gil;
+	try {
+		m_publish_weights_func();
+	} catch (const boost::python::error_already_set&) {
+		::PyErr_Print();
+		std::terminate();
+	}
+}
+
+template class BasicNetwork<ImageObservationFormat>;
+template class BasicNetwork<QuantizedImageObservationFormat>;
+template class BasicNetwork<CellCodeObservationFormat>;
+
 }  // namespace impala
@@ -3,6 +3,7 @@
 #include <cassert>
 #include <cstdint>
 #include <iterator>
+#include <string_view>
 #include <type_traits>
 
 #include <boost/python.hpp>
@@ -14,7 +15,28 @@
 namespace impala
 {
 
-class Network
+// Pythonに渡す観測の形式. nameはtrain.pyのobservation_formatに設定され、使うモデルが選ばれる
+// 描画した3x80x80の画像
+struct ImageObservationFormat
+{
+	using StateTraits = NdArrayTraits<float, 3, 80, 80>;
+	static inline constexpr std::string_view name = "image";
+};
+// 描画した画像の各画素をSokobanQuantizedEnv::PIXEL_SCALE単位のuint8にしたもの. torchの側でfloatに戻す
+struct QuantizedImageObservationFormat
+{
+	using StateTraits = NdArrayTraits<std::uint8_t, 3, 80, 80>;
+	static inline constexpr std::string_view name = "image_u8";
+};
+// 描画していない8x8のセルの値. 画像の1/1200の大きさで、モデルの中でone-hotにする
+struct CellCodeObservationFormat
+{
+	using StateTraits = NdArrayTraits<std::uint8_t, 8, 8>;
+	static inline constexpr std::string_view name = "cell_codes";
+};
+
+template <class ObservationFormat>
+class BasicNetwork
 {
 public:
 	struct Loss
@@ -22,21 +44,40 @@ public:
 		double v_loss;
 		double pi_loss;
 		double entropy_loss;
+		// バッチの各列のセグメントのTD誤差. リプレイの優先度に使う
+		std::vector<float> priorities;
+	};
+	struct Prediction
+	{
+		std::vector<std::tuple<std::int64_t, float>> actions_and_policies;
+		// 推論に使われたモデルの更新回数
+		std::int64_t weight_version;
 	};
 
-	using StateTraits = NdArrayTraits<float, 3, 80, 80>;
+	using StateTraits = typename ObservationFormat::StateTraits;
 	using Reward = float;
 
-	Network();
-	std::vector<std::tuple<std::int64_t, float>> predict(ranges::span<typename StateTraits::value_type> states);
-	Loss train(ranges::span<typename StateTraits::value_type> states, ranges::span<std::int64_t> action_ids, ranges::span<Reward> rewards, ranges::span<float> behaviour_policies, ranges::span<std::int64_t> data_sizes, ranges::span<std::int64_t> observation_sizes);
+	BasicNetwork();
+	// statesはバッチ内の異なる観測のみを並べたもので、state_indicesが各位置の観測のstatesでの位置を表す
+	Prediction predict(ranges::span<typename StateTraits::value_type> states, ranges::span<std::int64_t> state_indices);
+	Loss train(ranges::span<typename StateTraits::value_type> states, ranges::span<std::int64_t> state_indices, ranges::span<std::int64_t> action_ids, ranges::span<Reward> rewards, ranges::span<float> behaviour_policies, ranges::span<std::int64_t> data_sizes, ranges::span<std::int64_t> observation_sizes);
 	void save(int index);
 
+	// 推論専用のモデルの複製を作成し、以降のpredictはpublishWeightsで公開された重みを使う
+	void enableInferenceModel();
+	void publishWeights();
+
 private:
 	boost::python::object m_python_main_ns;
 	boost::python::object m_predict_func;
 	boost::python::object m_train_func;
 	boost::python::object m_save_func;
+	boost::python::object m_enable_inference_model_func;
+	boost::python::object m_publish_weights_func;
 };
 
+using Network = BasicNetwork<ImageObservationFormat>;
+using QuantizedNetwork = BasicNetwork<QuantizedImageObservationFormat>;
+using CellCodeNetwork = BasicNetwork<CellCodeObservationFormat>;
+
 }  // namespace impala
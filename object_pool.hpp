@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "concurrent_queue.hpp"
+
+namespace impala
+{
+
+// 事前に確保したオブジェクトを貸し出し、返却されたものを再利用するプール
+// 貸し出し・返却はロックを取らない
+template <class T>
+class ObjectPool
+{
+public:
+	explicit ObjectPool(std::size_t size) : m_objects(size), m_free_list{size}
+	{
+		fillFreeList();
+	}
+	// 全てのオブジェクトをfactory()の返り値で初期化する
+	template <class Factory>
+	ObjectPool(std::size_t size, Factory&& factory) : m_free_list{size}
+	{
+		m_objects.reserve(size);
+		for (std::size_t i = 0; i < size; ++i) {
+			m_objects.emplace_back(factory());
+		}
+		fillFreeList();
+	}
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator=(const ObjectPool&) = delete;
+
+	// 空の場合はnullptrを返す
+	T* tryAcquire()
+	{
+		auto object = m_free_list.tryPop();
+		return object ? object.value() : nullptr;
+	}
+	void release(T* object)
+	{
+		assert(&m_objects.front() <= object && object <= &m_objects.back());
+		[[maybe_unused]] bool pushed = m_free_list.tryPush(std::move(object));
+		assert(pushed);
+	}
+
+	std::size_t size() const noexcept
+	{
+		return m_objects.size();
+	}
+
+private:
+	void fillFreeList()
+	{
+		for (auto& object : m_objects) {
+			T* ptr = &object;
+			[[maybe_unused]] bool pushed = m_free_list.tryPush(std::move(ptr));
+			assert(pushed);
+		}
+	}
+
+	std::vector<T> m_objects;
+	BoundedMPMCQueue<T*> m_free_list;
+};
+
+}  // namespace impala
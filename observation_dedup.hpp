@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+namespace impala
+{
+
+// バッチ内の同じ観測を1つにまとめ、描画とモデルへの転送・推論を異なる観測の数で済ませる
+// Observationは data() と sizeOfAll() を持ち、要素をバイト列として比較できること(InlineTensor<CellState, ...>など)
+template <class Observation>
+class ObservationDeduplicator
+{
+public:
+	// 無効な場合は全ての観測をそのまま並べる
+	explicit ObservationDeduplicator(bool enabled) : m_enabled{enabled} {}
+
+	// [first, last)の異なる観測を最初に現れた順にuniqueに並べ、各位置の観測のuniqueでの位置をindicesに入れる
+	// 要素はObservationへの参照かポインタで、nullptrの位置のindicesは0になる
+	template <class ForwardIterator>
+	void deduplicate(ForwardIterator first, ForwardIterator last, std::vector<const Observation*>& unique, std::vector<std::int64_t>& indices)
+	{
+		const auto count = static_cast<std::size_t>(std::distance(first, last));
+		unique.clear();
+		indices.resize(count);
+		if (!m_enabled) {
+			for (; first != last; ++first) {
+				unique.emplace_back(pointerOf(*first));
+			}
+			std::iota(indices.begin(), indices.end(), std::int64_t{0});
+			return;
+		}
+		std::size_t capacity = 1;
+		while (capacity < count * 2) {
+			capacity *= 2;
+		}
+		// 各スロットはuniqueでの位置+1を持ち、0は空を表す
+		m_slots.assign(capacity, 0);
+		m_hashes.clear();
+		for (std::size_t i = 0; i < count; ++i, ++first) {
+			const Observation* obs = pointerOf(*first);
+			if (obs == nullptr) {
+				indices[i] = 0;
+				continue;
+			}
+			const auto hash = hashOf(*obs);
+			auto slot = static_cast<std::size_t>(hash) & (capacity - 1);
+			while (true) {
+				if (m_slots[slot] == 0) {
+					m_slots[slot] = static_cast<std::uint32_t>(unique.size() + 1);
+					indices[i] = static_cast<std::int64_t>(unique.size());
+					unique.emplace_back(obs);
+					m_hashes.emplace_back(hash);
+					break;
+				}
+				const auto index = m_slots[slot] - 1;
+				if (m_hashes[index] == hash && equal(*unique[index], *obs)) {
+					indices[i] = static_cast<std::int64_t>(index);
+					break;
+				}
+				slot = (slot + 1) & (capacity - 1);
+			}
+		}
+	}
+
+private:
+	template <class T>
+	static const Observation* pointerOf(const T& obs)
+	{
+		if constexpr (std::is_convertible_v<const T&, const Observation*>) {
+			return obs;
+		} else {
+			return &static_cast<const Observation&>(obs);
+		}
+	}
+
+	static std::size_t byteSize(const Observation& obs)
+	{
+		return obs.sizeOfAll() * sizeof(*obs.data());
+	}
+	static bool equal(const Observation& a, const Observation& b)
+	{
+		return std::memcmp(a.data(), b.data(), byteSize(a)) == 0;
+	}
+	// 8バイトずつ乗算で混ぜる
+	static std::uint64_t hashOf(const Observation& obs)
+	{
+		const auto* bytes = reinterpret_cast<const unsigned char*>(obs.data());
+		const auto size = byteSize(obs);
+		std::uint64_t hash = 0x9e3779b97f4a7c15ull ^ size;
+		std::size_t i = 0;
+		for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t)) {
+			std::uint64_t word;
+			std::memcpy(&word, bytes + i, sizeof(word));
+			hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+			hash ^= hash >> 32;
+		}
+		for (; i < size; ++i) {
+			hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+		}
+		return hash ^ (hash >> 29);
+	}
+
+	bool m_enabled;
+	std::vector<std::uint32_t> m_slots;
+	// uniqueの各観測のハッシュ値
+	std::vector<std::uint64_t> m_hashes;
+};
+
+}  // namespace impala
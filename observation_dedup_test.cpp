@@ -0,0 +1,135 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "observation_dedup.hpp"
+#include "sokoban_env.hpp"
+
+// ObservationDeduplicatorの結果を、全ての組をmemcmpで比べた結果と比べる
+namespace
+{
+
+using namespace impala;
+
+using Observation = SokobanEnv::Observation;
+using CellState = SokobanEnv::CellState;
+
+constexpr int ROOM_WIDTH = SokobanEnv::ROOM_WIDTH;
+constexpr int ROOM_HEIGHT = SokobanEnv::ROOM_HEIGHT;
+
+bool sameContent(const Observation& a, const Observation& b)
+{
+	return std::memcmp(a.data(), b.data(), a.sizeOfAll() * sizeof(*a.data())) == 0;
+}
+
+// 1セルだけ異なる観測を多く作り、ハッシュのスロットの衝突と内容の比較を通らせる
+std::vector<Observation> makePool(std::size_t size, std::mt19937_64& engine)
+{
+	Observation base;
+	for (int y = 0; y < ROOM_HEIGHT; ++y) {
+		for (int x = 0; x < ROOM_WIDTH; ++x) {
+			base[y][x] = CellState::WALL;
+		}
+	}
+	std::vector<Observation> pool;
+	std::uniform_int_distribution<int> cell_dist{0, ROOM_WIDTH * ROOM_HEIGHT - 1};
+	std::uniform_int_distribution<int> state_dist{0, 6};
+	while (pool.size() < size) {
+		auto obs = base;
+		const auto cell = cell_dist(engine);
+		obs[cell / ROOM_WIDTH][cell % ROOM_WIDTH] = static_cast<CellState>(state_dist(engine));
+		bool found = false;
+		for (auto&& other : pool) {
+			found = found || sameContent(other, obs);
+		}
+		if (!found) {
+			pool.emplace_back(obs);
+		}
+	}
+	return pool;
+}
+
+// nullptrを除き、内容が最初に現れた位置の観測が最初に現れた順にuniqueに並ぶ
+bool check(const char* name, const std::vector<const Observation*>& batch, const std::vector<const Observation*>& unique, const std::vector<std::int64_t>& indices)
+{
+	std::vector<const Observation*> expected_unique;
+	std::vector<std::int64_t> expected_indices;
+	for (auto* obs : batch) {
+		if (obs == nullptr) {
+			expected_indices.emplace_back(0);
+			continue;
+		}
+		std::int64_t index = 0;
+		while (index < static_cast<std::int64_t>(expected_unique.size()) && !sameContent(*expected_unique[index], *obs)) {
+			++index;
+		}
+		if (index == static_cast<std::int64_t>(expected_unique.size())) {
+			expected_unique.emplace_back(obs);
+		}
+		expected_indices.emplace_back(index);
+	}
+	if (unique != expected_unique || indices != expected_indices) {
+		std::cerr << name << " : " << unique.size() << " unique observations , expected " << expected_unique.size() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+}  // namespace
+
+int main()
+{
+	std::mt19937_64 engine{1};
+	bool ok = true;
+	ObservationDeduplicator<Observation> deduplicator{true};
+	std::vector<const Observation*> unique;
+	std::vector<std::int64_t> indices;
+
+	for (std::size_t pool_size : {1, 8, 200}) {
+		const auto pool = makePool(pool_size, engine);
+		// 同じ内容の別のオブジェクトも同じ観測として扱う
+		const auto copies = pool;
+		std::uniform_int_distribution<std::size_t> pick{0, pool_size - 1};
+		for (std::size_t batch_size : {0, 1, 7, 64, 513}) {
+			std::vector<const Observation*> batch;
+			std::vector<Observation> values;
+			for (std::size_t i = 0; i < batch_size; ++i) {
+				const auto index = pick(engine);
+				batch.emplace_back(engine() % 10 == 0 ? nullptr : engine() % 2 == 0 ? &pool[index] : &copies[index]);
+				values.emplace_back(pool[index]);
+			}
+			// nullptrを含むポインタの列
+			deduplicator.deduplicate(batch.begin(), batch.end(), unique, indices);
+			ok = check("pointers", batch, unique, indices) && ok;
+
+			// 観測そのものの列
+			std::vector<const Observation*> value_pointers;
+			for (auto&& value : values) {
+				value_pointers.emplace_back(&value);
+			}
+			deduplicator.deduplicate(values.begin(), values.end(), unique, indices);
+			ok = check("values", value_pointers, unique, indices) && ok;
+		}
+	}
+
+	// 無効な場合はnullptrも含めて全ての位置をそのまま並べる
+	{
+		ObservationDeduplicator<Observation> disabled{false};
+		const auto pool = makePool(2, engine);
+		const std::vector<const Observation*> batch{&pool[0], &pool[0], nullptr, &pool[1]};
+		disabled.deduplicate(batch.begin(), batch.end(), unique, indices);
+		if (unique != batch || indices != std::vector<std::int64_t>{0, 1, 2, 3}) {
+			std::cerr << "disabled : observations were merged" << std::endl;
+			ok = false;
+		}
+	}
+
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "ok" << std::endl;
+	return 0;
+}
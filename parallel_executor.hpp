@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace impala
+{
+
+// 範囲を一定の大きさに分けて、複数のスレッドで並列に処理するワーカー
+// 複数のスレッドから同時にparallelForを呼んでよく、呼び出したスレッドも処理に加わる
+class ParallelExecutor
+{
+public:
+	ParallelExecutor() = default;
+	ParallelExecutor(const ParallelExecutor&) = delete;
+	ParallelExecutor& operator=(const ParallelExecutor&) = delete;
+	~ParallelExecutor()
+	{
+		{
+			std::lock_guard lock{m_mutex};
+			m_exit_flag = true;
+		}
+		m_work_event.notify_all();
+		for (auto&& thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	// ワーカーのスレッド数をnum_threads以上にする. 減らすことはない
+	void reserveThreads(std::size_t num_threads)
+	{
+		reserveThreads(num_threads, [](std::size_t) {});
+	}
+	// 新しく作ったスレッドは、処理を始める前にそのスレッド上でon_start(何番目のワーカーか)を呼ぶ
+	template <class OnStart>
+	void reserveThreads(std::size_t num_threads, OnStart on_start)
+	{
+		std::lock_guard lock{m_mutex};
+		while (m_threads.size() < num_threads) {
+			m_threads.emplace_back([this, on_start, index = m_threads.size()] {
+				on_start(index);
+				run();
+			});
+		}
+	}
+	std::size_t numThreads()
+	{
+		std::lock_guard lock{m_mutex};
+		return m_threads.size();
+	}
+
+	// [0, count)をchunk_size毎に分けた各範囲についてf(first, last)を呼び、全て終わるまで待つ
+	template <class Function>
+	void parallelFor(std::size_t count, std::size_t chunk_size, Function&& f)
+	{
+		chunk_size = std::max<std::size_t>(chunk_size, 1);
+		const auto num_chunks = (count + chunk_size - 1) / chunk_size;
+		if (num_chunks <= 1 || numThreads() == 0) {
+			if (count > 0) {
+				f(std::size_t{0}, count);
+			}
+			return;
+		}
+		Job job{[&](std::size_t first, std::size_t last) { f(first, last); }, count, chunk_size, num_chunks};
+		{
+			std::lock_guard lock{m_mutex};
+			m_jobs.emplace_back(&job);
+		}
+		m_work_event.notify_all();
+		runChunks(job);
+		// 全ての範囲が取られた後は新しいワーカーが加わらないよう取り除き、処理中のワーカーを待つ
+		std::unique_lock lock{m_mutex};
+		m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &job));
+		m_done_event.wait(lock, [&] { return job.num_workers == 0; });
+	}
+
+	// このプロセスで共有する、バッチの作成に使うワーカー
+	// スレッド数が0の間は、parallelForは呼び出したスレッドだけで処理する
+	static ParallelExecutor& shared()
+	{
+		static ParallelExecutor executor;
+		return executor;
+	}
+
+	// 2次キャッシュの大きさ. 取得できない場合は1MiBとみなす
+	static std::size_t l2CacheSize()
+	{
+		static const std::size_t size = [] {
+			const auto value = ::sysconf(_SC_LEVEL2_CACHE_SIZE);
+			return value > 0 ? static_cast<std::size_t>(value) : std::size_t{1} << 20;
+		}();
+		return size;
+	}
+
+private:
+	struct Job
+	{
+		std::function<void(std::size_t, std::size_t)> function;
+		std::size_t count;
+		std::size_t chunk_size;
+		std::size_t num_chunks;
+		std::atomic<std::size_t> next_chunk = 0;
+		// m_mutexで保護される
+		std::size_t num_workers = 0;
+
+		bool hasRemainingChunks() const noexcept
+		{
+			return next_chunk.load(std::memory_order_relaxed) < num_chunks;
+		}
+	};
+
+	static void runChunks(Job& job)
+	{
+		while (true) {
+			const auto chunk = job.next_chunk.fetch_add(1, std::memory_order_relaxed);
+			if (chunk >= job.num_chunks) {
+				break;
+			}
+			const auto first = chunk * job.chunk_size;
+			job.function(first, std::min(first + job.chunk_size, job.count));
+		}
+	}
+
+	void run()
+	{
+		while (true) {
+			Job* job = nullptr;
+			{
+				std::unique_lock lock{m_mutex};
+				auto find_job = [&] {
+					auto it = std::find_if(m_jobs.begin(), m_jobs.end(), [](const Job* j) { return j->hasRemainingChunks(); });
+					return it == m_jobs.end() ? nullptr : *it;
+				};
+				m_work_event.wait(lock, [&] { return m_exit_flag || (job = find_job()) != nullptr; });
+				if (m_exit_flag) {
+					break;
+				}
+				++job->num_workers;
+			}
+			runChunks(*job);
+			{
+				std::lock_guard lock{m_mutex};
+				--job->num_workers;
+			}
+			m_done_event.notify_all();
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_work_event;
+	std::condition_variable m_done_event;
+	// 範囲が残っている可能性のあるジョブ. ジョブは呼び出し元のスタックにある
+	std::deque<Job*> m_jobs;
+	bool m_exit_flag = false;
+};
+
+}  // namespace impala
@@ -22,6 +22,9 @@ public:
 	{
 		assert(!::Py_IsInitialized());
 		::Py_InitializeEx(init_signal_handler ? 0 : 1);
+#if PY_VERSION_HEX < 0x03070000
+		::PyEval_InitThreads();
+#endif
 		boost::python::numpy::initialize();
 	}
 	~PythonInitializer()
@@ -30,6 +33,38 @@ public:
 	}
 };
 
+// 他のスレッドがPythonを呼べるよう、スコープ内でGILを解放する
+class PythonGILReleaser
+{
+public:
+	PythonGILReleaser() : m_state{::PyEval_SaveThread()} {}
+	~PythonGILReleaser()
+	{
+		::PyEval_RestoreThread(m_state);
+	}
+	PythonGILReleaser(const PythonGILReleaser&) = delete;
+	PythonGILReleaser& operator=(const PythonGILReleaser&) = delete;
+
+private:
+	::PyThreadState* m_state;
+};
+
+// 任意のスレッドからPythonを呼ぶ間、GILを取得する
+class PythonGILGuard
+{
+public:
+	PythonGILGuard() : m_state{::PyGILState_Ensure()} {}
+	~PythonGILGuard()
+	{
+		::PyGILState_Release(m_state);
+	}
+	PythonGILGuard(const PythonGILGuard&) = delete;
+	PythonGILGuard& operator=(const PythonGILGuard&) = delete;
+
+private:
+	::PyGILState_STATE m_state;
+};
+
 inline boost::python::object makePythonMainNameSpace()
 {
 	namespace fs = std::experimental::filesystem;
@@ -71,12 +106,11 @@ inline boost::python::tuple stridesOfNdArrayHelper2([[maybe_unused]] std::size_t
 }  // namespace detail
 
 template <class T, std::size_t... Ns>
-class NdArrayTraits
+class NdArrayTraits : public TensorBatchTraits<T, Ns...>
 {
 public:
-	using value_type = T;
-
-	static inline constexpr std::size_t size_of_all = (Ns * ...);
+	using typename TensorBatchTraits<T, Ns...>::value_type;
+	using TensorBatchTraits<T, Ns...>::size_of_all;
 
 	static boost::python::tuple shapeOfNdArray()
 	{
@@ -102,51 +136,10 @@ public:
 		namespace np = boost::python::numpy;
 		return np::from_data(tensor.data(), np::dtype::get_builtin<T>(), shapeOfNdArray(), stridesOfNdArray(), boost::python::object());
 	}
-
-	template <class ForwardIterator,
-	    std::enable_if_t<
-	        std::conjunction_v<
-	            std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>,
-	            std::disjunction<
-	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const Tensor<T, Ns...>&>,
-	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const std::optional<Tensor<T, Ns...>>&>>>,
-	        std::nullptr_t> = nullptr>
-	static std::vector<T> makeBufferForBatch(ForwardIterator first, ForwardIterator last)
-	{
-		const auto batch_size = static_cast<std::size_t>(std::distance(first, last));
-		std::vector<T> buffer(batch_size * size_of_all);
-		auto dest = buffer.begin();
-		for (; first != last; ++first) {
-			if constexpr (std::is_convertible_v<typename std::iterator_traits<ForwardIterator>::reference, const Tensor<T, Ns...>&>) {
-				const Tensor<T, Ns...>& src = *first;
-				std::copy_n(src.data(), size_of_all, dest);
-			} else {
-				const std::optional<Tensor<T, Ns...>>& src = *first;
-				if (src.has_value()) {
-					std::copy_n(src.value().data(), size_of_all, dest);
-				}
-			}
-			dest += size_of_all;
-		}
-		return buffer;
-	}
-	template <class ForwardIterator, class Callback,
-	    std::enable_if_t<
-	        std::conjunction_v<
-	            std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>,
-	            std::is_invocable<Callback, typename std::iterator_traits<ForwardIterator>::reference, TensorRef<T, Ns...>&>>,
-	        std::nullptr_t> = nullptr>
-	static std::vector<T> makeBufferForBatch(ForwardIterator first, ForwardIterator last, Callback&& callback)
+	static boost::python::numpy::ndarray convertToNdArray(InlineTensor<T, Ns...>& tensor)
 	{
-		const auto batch_size = static_cast<std::size_t>(std::distance(first, last));
-		std::vector<T> buffer(batch_size * size_of_all);
-		auto dest = buffer.data();
-		for (; first != last; ++first) {
-			TensorRef<T, Ns...> tensor_ref{dest};
-			std::invoke(callback, *first, tensor_ref);
-			dest += size_of_all;
-		}
-		return buffer;
+		namespace np = boost::python::numpy;
+		return np::from_data(tensor.data(), np::dtype::get_builtin<T>(), shapeOfNdArray(), stridesOfNdArray(), boost::python::object());
 	}
 
 	// 返り値のndarrayはspanの元となったメモリ領域を直接参照するため、lifetimeに注意
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace impala
+{
+
+// 学習済みのデータを複製して保持し、優先度に比例した確率で取り出すリングバッファ
+// 満杯の場合は最も古いものを上書きする。全ての操作はロックを取る
+// Tは assign(const T&) で上書きできること
+template <class T>
+class ReplayBuffer
+{
+public:
+	// 全ての領域をfactory()の返り値で初期化する
+	// 優先度はTD誤差の絶対値のpriority_exponent乗. 0の場合は一様に取り出す
+	template <class Factory>
+	ReplayBuffer(std::size_t capacity, double priority_exponent, Factory&& factory)
+	    : m_ids(capacity), m_priority_exponent{priority_exponent}
+	{
+		assert(capacity > 0 && priority_exponent >= 0.0);
+		m_slots.reserve(capacity);
+		for (std::size_t i = 0; i < capacity; ++i) {
+			m_slots.emplace_back(factory());
+		}
+		while (m_num_leaves < capacity) {
+			m_num_leaves *= 2;
+		}
+		m_tree.assign(2 * m_num_leaves, 0.0);
+	}
+	ReplayBuffer(const ReplayBuffer&) = delete;
+	ReplayBuffer& operator=(const ReplayBuffer&) = delete;
+
+	// valueを複製して追加し、そのidを返す. 優先度はこれまでの最大値になる
+	std::uint64_t insert(const T& value)
+	{
+		std::lock_guard lock{m_mutex};
+		const auto id = m_next_id++;
+		const auto slot = static_cast<std::size_t>(id % m_slots.size());
+		m_slots[slot].assign(value);
+		m_ids[slot] = id;
+		setPriority(slot, m_max_priority);
+		return id;
+	}
+
+	// 優先度に比例した確率でcount個を復元抽出し、f(const T&, id)を呼ぶ. 空の場合は何もしない
+	// fはロックを取ったまま呼ばれる
+	template <class URBG, class Function>
+	void sample(std::size_t count, URBG& engine, Function&& f)
+	{
+		std::lock_guard lock{m_mutex};
+		if (m_tree[1] <= 0.0) {
+			return;
+		}
+		std::uniform_real_distribution<double> dist{0.0, m_tree[1]};
+		for (std::size_t i = 0; i < count; ++i) {
+			const auto slot = findSlot(dist(engine));
+			f(static_cast<const T&>(m_slots[slot]), m_ids[slot]);
+		}
+	}
+
+	// 学習で得たTD誤差から優先度を更新する. 既に上書きされたidは無視する
+	void updatePriorities(const std::vector<std::uint64_t>& ids, const std::vector<float>& td_errors)
+	{
+		assert(ids.size() == td_errors.size());
+		if (m_priority_exponent == 0.0) {
+			return;
+		}
+		std::lock_guard lock{m_mutex};
+		for (std::size_t i = 0; i < ids.size(); ++i) {
+			const auto slot = static_cast<std::size_t>(ids[i] % m_slots.size());
+			if (m_ids[slot] != ids[i]) {
+				continue;
+			}
+			const auto priority = std::pow(static_cast<double>(std::abs(td_errors[i])) + MIN_TD_ERROR, m_priority_exponent);
+			m_max_priority = std::max(m_max_priority, priority);
+			setPriority(slot, priority);
+		}
+	}
+
+	std::size_t size()
+	{
+		std::lock_guard lock{m_mutex};
+		return static_cast<std::size_t>(std::min<std::uint64_t>(m_next_id, m_slots.size()));
+	}
+	std::size_t capacity() const noexcept
+	{
+		return m_slots.size();
+	}
+
+private:
+	// TD誤差が0のデータも取り出されるようにする
+	static inline constexpr double MIN_TD_ERROR = 1e-3;
+
+	// m_treeは各ノードに子の優先度の和を持つ完全二分木で、葉がスロットに対応する
+	void setPriority(std::size_t slot, double priority)
+	{
+		auto node = m_num_leaves + slot;
+		const auto diff = priority - m_tree[node];
+		for (; node > 0; node /= 2) {
+			m_tree[node] += diff;
+		}
+	}
+	std::size_t findSlot(double value) const
+	{
+		std::size_t node = 1;
+		while (node < m_num_leaves) {
+			const auto left = 2 * node;
+			// 丸め誤差で優先度0の(未使用の)葉に降りないようにする
+			if ((value < m_tree[left] && m_tree[left] > 0.0) || m_tree[left + 1] <= 0.0) {
+				node = left;
+			} else {
+				value -= m_tree[left];
+				node = left + 1;
+			}
+		}
+		return std::min(node - m_num_leaves, m_slots.size() - 1);
+	}
+
+	std::mutex m_mutex;
+	std::vector<T> m_slots;
+	// 各スロットに格納したデータのid
+	std::vector<std::uint64_t> m_ids;
+	std::vector<double> m_tree;
+	std::size_t m_num_leaves = 1;
+	const double m_priority_exponent;
+	double m_max_priority = 1.0;
+	std::uint64_t m_next_id = 0;
+};
+
+}  // namespace impala
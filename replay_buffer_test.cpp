@@ -0,0 +1,159 @@
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "replay_buffer.hpp"
+
+// ReplayBufferが優先度に比例した割合で取り出し、updatePrioritiesで割合が変わることを確かめる
+namespace
+{
+
+using namespace impala;
+
+struct Item
+{
+	int value;
+
+	void assign(const Item& other)
+	{
+		value = other.value;
+	}
+};
+
+using Buffer = ReplayBuffer<Item>;
+
+constexpr std::size_t NUM_SAMPLES = 200000;
+// NUM_SAMPLES回での割合の誤差の許容値. 標準偏差の5倍程度
+constexpr double TOLERANCE = 0.006;
+
+Buffer makeBuffer(std::size_t capacity, double priority_exponent)
+{
+	return Buffer{capacity, priority_exponent, [] { return Item{-1}; }};
+}
+
+// 各要素のvalueはidと同じであること
+bool checkProportions(const char* name, Buffer& buffer, std::uint64_t num_ids, const std::vector<double>& expected)
+{
+	std::mt19937_64 engine{1};
+	std::vector<std::size_t> counts(num_ids, 0);
+	bool ok = true;
+	buffer.sample(NUM_SAMPLES, engine, [&](const Item& item, std::uint64_t id) {
+		if (id >= num_ids || item.value != static_cast<int>(id)) {
+			ok = false;
+			return;
+		}
+		++counts[id];
+	});
+	if (!ok) {
+		std::cerr << name << " : sampled an unexpected item" << std::endl;
+		return false;
+	}
+	double total = 0.0;
+	for (auto weight : expected) {
+		total += weight;
+	}
+	for (std::uint64_t id = 0; id < num_ids; ++id) {
+		const auto actual = static_cast<double>(counts[id]) / NUM_SAMPLES;
+		if (std::abs(actual - expected[id] / total) > TOLERANCE) {
+			std::cerr << name << " : id " << id << " sampled " << actual << " expected " << expected[id] / total << std::endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// 満杯になるまでは、idは追加した順の番号になる
+void insertItems(Buffer& buffer, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		buffer.insert(Item{static_cast<int>(buffer.size())});
+	}
+}
+
+// TD誤差はMIN_TD_ERRORだけ足されてから冪乗される
+float tdErrorFor(double priority)
+{
+	return static_cast<float>(priority - 1e-3);
+}
+
+}  // namespace
+
+int main()
+{
+	bool ok = true;
+
+	{
+		auto buffer = makeBuffer(4, 1.0);
+		std::mt19937_64 engine{1};
+		bool called = false;
+		buffer.sample(10, engine, [&](const Item&, std::uint64_t) { called = true; });
+		if (called) {
+			std::cerr << "empty : sampled from an empty buffer" << std::endl;
+			ok = false;
+		}
+		// 追加直後は全て同じ優先度
+		insertItems(buffer, 4);
+		ok = checkProportions("initial", buffer, 4, {1.0, 1.0, 1.0, 1.0}) && ok;
+		buffer.updatePriorities({0, 1, 2, 3}, {tdErrorFor(1.0), tdErrorFor(2.0), tdErrorFor(3.0), tdErrorFor(4.0)});
+		ok = checkProportions("updated", buffer, 4, {1.0, 2.0, 3.0, 4.0}) && ok;
+		// TD誤差の符号は無視する
+		buffer.updatePriorities({3}, {-tdErrorFor(2.0)});
+		ok = checkProportions("negative", buffer, 4, {1.0, 2.0, 3.0, 2.0}) && ok;
+	}
+
+	{
+		// 容量が2のべき乗でなく、まだ埋まっていない葉は取り出されない
+		auto buffer = makeBuffer(5, 1.0);
+		insertItems(buffer, 3);
+		buffer.updatePriorities({0, 1, 2}, {tdErrorFor(1.0), tdErrorFor(3.0), tdErrorFor(2.0)});
+		ok = checkProportions("partial", buffer, 3, {1.0, 3.0, 2.0}) && ok;
+		// 新しい要素はこれまでの最大の優先度になる
+		insertItems(buffer, 1);
+		ok = checkProportions("max priority", buffer, 4, {1.0, 3.0, 2.0, 3.0}) && ok;
+	}
+
+	{
+		auto buffer = makeBuffer(2, 2.0);
+		insertItems(buffer, 2);
+		buffer.updatePriorities({0, 1}, {tdErrorFor(1.0), tdErrorFor(3.0)});
+		ok = checkProportions("exponent", buffer, 2, {1.0, 9.0}) && ok;
+	}
+
+	{
+		// 上書きされたidの更新は無視し、上書きした要素の優先度を変えない
+		auto buffer = makeBuffer(2, 1.0);
+		insertItems(buffer, 2);
+		buffer.updatePriorities({0, 1}, {tdErrorFor(1.0), tdErrorFor(1.0)});
+		const auto id = buffer.insert(Item{2});
+		buffer.updatePriorities({0}, {tdErrorFor(100.0)});
+		std::mt19937_64 engine{1};
+		std::array<std::size_t, 3> counts{};
+		buffer.sample(NUM_SAMPLES, engine, [&](const Item& item, std::uint64_t sampled_id) {
+			if (sampled_id <= id && item.value == static_cast<int>(sampled_id)) {
+				++counts[sampled_id];
+			}
+		});
+		if (id != 2 || counts[0] != 0 || std::abs(static_cast<double>(counts[2]) / NUM_SAMPLES - 0.5) > TOLERANCE) {
+			std::cerr << "stale id : counts " << counts[0] << " " << counts[1] << " " << counts[2] << std::endl;
+			ok = false;
+		}
+	}
+
+	{
+		// priority_exponentが0の場合は一様に取り出す
+		auto buffer = makeBuffer(3, 0.0);
+		insertItems(buffer, 3);
+		buffer.updatePriorities({0, 1, 2}, {tdErrorFor(1.0), tdErrorFor(10.0), tdErrorFor(100.0)});
+		ok = checkProportions("uniform", buffer, 3, {1.0, 1.0, 1.0}) && ok;
+	}
+
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "ok" << std::endl;
+	return 0;
+}
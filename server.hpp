@@ -1,20 +1,38 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <condition_variable>
 #include <deque>
+#include <exception>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
 #include <optional>
+#include <random>
+#include <string_view>
 #include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
 
-#include <boost/container/static_vector.hpp>
 #include <range/v3/view/indices.hpp>
 #include <range/v3/view/zip.hpp>
 
+#include "batch_queue.hpp"
+#include "batch_size_autotuner.hpp"
+#include "concurrent_queue.hpp"
 #include "environment.hpp"
+#include "metrics.hpp"
+#include "object_pool.hpp"
+#include "observation_dedup.hpp"
+#include "parallel_executor.hpp"
+#include "replay_buffer.hpp"
+#include "server_config.hpp"
+#include "thread_placement.hpp"
 
 namespace impala
 {
@@ -24,19 +42,49 @@ struct DefaultServerParams
 	static inline constexpr std::size_t NUM_AGENTS = 2048;
 	static inline constexpr std::size_t NUM_PREDICTORS = 2;
 	static inline constexpr std::size_t NUM_TRAINERS = 2;
+	static inline constexpr std::optional<std::size_t> NUM_AGENT_WORKERS = std::nullopt;
 
 	static inline constexpr std::size_t MIN_PREDICTION_BATCH_SIZE = 512;
 	static inline constexpr std::size_t MAX_PREDICTION_BATCH_SIZE = 1024;
 	static inline constexpr std::size_t MIN_TRAINING_BATCH_SIZE = 512;
 	static inline constexpr std::size_t MAX_TRAINING_BATCH_SIZE = 1024;
+	static inline constexpr std::size_t TRAINING_QUEUE_CAPACITY = 4096;
+	static inline constexpr std::optional<std::chrono::microseconds> MAX_PREDICTION_LATENCY = std::nullopt;
+	static inline constexpr std::optional<std::chrono::microseconds> MAX_TRAINING_LATENCY = std::nullopt;
+	static inline constexpr std::size_t PREDICTION_PIPELINE_DEPTH = 1;
+	static inline constexpr std::size_t TRAINING_PIPELINE_DEPTH = 1;
+
+	static inline constexpr bool SEPARATE_INFERENCE_MODEL = false;
+	static inline constexpr std::optional<std::size_t> WEIGHT_PUBLISH_INTERVAL_UPDATES = 1;
+	static inline constexpr std::optional<std::chrono::milliseconds> WEIGHT_PUBLISH_INTERVAL = std::nullopt;
 
 	static inline constexpr std::size_t T_MAX = 5;
 	static inline constexpr std::optional<std::size_t> MAX_EPISODE_LENGTH = std::nullopt;
 
 	static inline constexpr std::optional<std::size_t> LOG_INTERVAL_STEPS = 10000;
 	static inline constexpr std::optional<std::size_t> SAVE_INTERVAL_STEPS = 1000000;
+
+	static inline constexpr bool AUTOTUNE_BATCH_SIZE = false;
+	static inline constexpr std::chrono::milliseconds AUTOTUNE_INTERVAL = std::chrono::milliseconds{10000};
+
+	static inline constexpr std::optional<std::string_view> METRICS_FILE = std::nullopt;
+	static inline constexpr std::chrono::milliseconds METRICS_INTERVAL = std::chrono::milliseconds{10000};
+
+	static inline constexpr bool PIN_THREADS = false;
+
+	static inline constexpr std::optional<std::size_t> MAX_POLICY_LAG = std::nullopt;
+	static inline constexpr bool THROTTLE_STALE_AGENTS = false;
+
+	static inline constexpr std::optional<std::size_t> REPLAY_CAPACITY = std::nullopt;
+	static inline constexpr double REPLAY_RATIO = 1.0;
+	static inline constexpr double REPLAY_PRIORITY_EXPONENT = 0.0;
+
+	static inline constexpr std::size_t BATCH_RENDER_THREADS = 0;
+	static inline constexpr std::string_view BATCH_HUGE_PAGES = "none";
+	static inline constexpr bool DEDUPLICATE_OBSERVATIONS = true;
 };
 
+// ParametersのうちSEPARATE_INFERENCE_MODEL以外は既定値としてのみ使われ、実行時にServerConfigで上書きできる
 template <class Environment, class Model, class Parameters = DefaultServerParams>
 class Server
 {
@@ -48,45 +96,71 @@ public:
 	using ObsBatch = typename Environment::ObsBatch;
 	using Action = typename Environment::Action;
 
-	static inline constexpr std::size_t NUM_AGENTS = Parameters::NUM_AGENTS;
-	static inline constexpr std::size_t NUM_PREDICTORS = Parameters::NUM_PREDICTORS;
-	static inline constexpr std::size_t NUM_TRAINERS = Parameters::NUM_TRAINERS;
-
-	static inline constexpr std::size_t MIN_PREDICTION_BATCH_SIZE = Parameters::MIN_PREDICTION_BATCH_SIZE;
-	static inline constexpr std::size_t MAX_PREDICTION_BATCH_SIZE = Parameters::MAX_PREDICTION_BATCH_SIZE;
-	static inline constexpr std::size_t MIN_TRAINING_BATCH_SIZE = Parameters::MIN_TRAINING_BATCH_SIZE;
-	static inline constexpr std::size_t MAX_TRAINING_BATCH_SIZE = Parameters::MAX_TRAINING_BATCH_SIZE;
-
-	static inline constexpr std::size_t T_MAX = Parameters::T_MAX;
-	static inline constexpr std::optional<std::size_t> MAX_EPISODE_LENGTH = Parameters::MAX_EPISODE_LENGTH;
+	static inline constexpr bool SEPARATE_INFERENCE_MODEL = Parameters::SEPARATE_INFERENCE_MODEL;
 
-	static inline constexpr std::optional<std::size_t> LOG_INTERVAL_STEPS = Parameters::LOG_INTERVAL_STEPS;
-	static inline constexpr std::optional<std::size_t> SAVE_INTERVAL_STEPS = Parameters::SAVE_INTERVAL_STEPS;
+	static ServerConfig defaultConfig()
+	{
+		return ServerConfig::fromParameters<Parameters>();
+	}
 
-	Server()
+	Server() : Server(defaultConfig()) {}
+	// model_argsはModelのコンストラクタに渡される
+	template <class... ModelArgs>
+	explicit Server(const ServerConfig& config, ModelArgs&&... model_args)
+	    : m_config{config},
+	      m_placement{{config.pin_threads, config.server_cpus, config.predictor_cpus, config.trainer_cpus, config.agent_cpus, config.render_cpus}, config.num_predictors, config.num_trainers, config.batch_render_threads, SEPARATE_INFERENCE_MODEL},
+	      m_model{std::forward<ModelArgs>(model_args)...},
+	      m_prediction_queue{config.num_agents, config.min_prediction_batch_size, config.max_prediction_batch_size, config.max_prediction_latency},
+	      m_training_queue{config.training_queue_capacity, freshBatchSize(config, config.min_training_batch_size), freshBatchSize(config, config.max_training_batch_size), config.max_training_latency},
+	      m_trajectory_pool{2 * config.num_agents + m_training_queue.capacity() + config.num_trainers * config.max_training_batch_size, [&config] { return TrainingData{config.t_max}; }},
+	      m_prediction_batches{config.num_predictors * config.prediction_pipeline_depth},
+	      m_training_batches{config.num_trainers * config.training_pipeline_depth}
 	{
-		for ([[maybe_unused]] auto&& i : ranges::view::indices(NUM_PREDICTORS)) {
-			m_predictors.emplace_back(*this);
+		assert(config.isValid(SEPARATE_INFERENCE_MODEL));
+		m_placement.print(std::cout, SEPARATE_INFERENCE_MODEL, m_config.num_agent_workers.value_or(m_config.num_agents));
+		// 既に別のServerが作ったワーカーは固定し直さない
+		ParallelExecutor::shared().reserveThreads(m_config.batch_render_threads, [placement = m_placement](std::size_t index) {
+			pinCurrentThreadOrWarn(placement.renderCpus(index), "render " + std::to_string(index));
+		});
+		batch_buffer::huge_page_mode = parseHugePageMode(m_config.batch_huge_pages).value();
+		if (m_config.replay_capacity.has_value()) {
+			m_replay_buffer.emplace(m_config.replay_capacity.value(), m_config.replay_priority_exponent, [&config] { return TrainingData{config.t_max}; });
+		}
+		for (auto&& i : ranges::view::indices(m_config.num_predictors)) {
+			m_predictors.emplace_back(*this, i);
+		}
+		for (auto&& i : ranges::view::indices(m_config.num_trainers)) {
+			m_trainers.emplace_back(*this, i);
+		}
+		if constexpr (SEPARATE_INFERENCE_MODEL) {
+			m_model.enableInferenceModel();
 		}
-		for ([[maybe_unused]] auto&& i : ranges::view::indices(NUM_TRAINERS)) {
-			m_trainers.emplace_back(*this);
+		if (m_config.num_agent_workers.has_value()) {
+			m_agent_scheduler.emplace(m_config.num_agent_workers.value(), m_placement);
 		}
-		for ([[maybe_unused]] auto&& i : ranges::view::indices(NUM_AGENTS)) {
-			m_agents.emplace_back(*this);
+		for (auto&& i : ranges::view::indices(m_config.num_agents)) {
+			m_agents.emplace_back(*this, i);
+		}
+		if (m_agent_scheduler.has_value()) {
+			for (auto&& agent : m_agents) {
+				agent.start();
+			}
 		}
 	}
 	~Server()
 	{
+		m_exit_flag = true;
 		for (auto&& predictor : m_predictors) {
 			predictor.exit();
 		}
-		m_predictor_event.notify_all();
+		m_prediction_queue.notifyExit();
 		m_predictors.clear();
 		for (auto&& trainer : m_trainers) {
 			trainer.exit();
 		}
-		m_trainer_event.notify_all();
+		m_training_queue.notifyExit();
 		m_trainers.clear();
+		m_agent_scheduler.reset();
 		for (auto&& agent : m_agents) {
 			agent.exit();
 		}
@@ -97,64 +171,171 @@ public:
 	{
 		static constexpr double average_loss_decay = 0.99;
 
+		const auto t_max = m_config.t_max;
+		const auto log_interval_steps = m_config.log_interval_steps;
+		const auto save_interval_steps = m_config.save_interval_steps;
+		const auto weight_publish_interval_updates = m_config.weight_publish_interval_updates;
+		const auto weight_publish_interval = m_config.weight_publish_interval;
+
+		// 学習キューから新しく取り出したセグメントの時刻数. リプレイしたセグメントは数えない
 		std::size_t trained_steps = 0;
 
+		pinCurrentThreadOrWarn(m_placement.serverCpus(), "server");
+
 		double average_v_loss = 0;
 		double average_pi_loss = 0;
 		double average_entropy_loss = 0;
 
+		// 推論用のモデルを分離した場合、推論は別スレッドで行い、このスレッドは学習と重みの公開のみを行う
+		std::thread inference_thread;
+		if constexpr (SEPARATE_INFERENCE_MODEL) {
+			m_inference_exit_flag = false;
+			inference_thread = std::thread{[this] {
+				pinCurrentThreadOrWarn(m_placement.inferenceCpus(), "inference");
+				runInference();
+			}};
+		}
+		std::thread metrics_thread;
+		if (m_config.metrics_file.has_value()) {
+			m_metrics_exit_flag = false;
+			metrics_thread = std::thread{[this] {
+				runMetricsExporter();
+			}};
+		}
+		std::size_t updates_since_publish = 0;
+		auto last_publish_time = std::chrono::steady_clock::now();
+
+		std::optional<BatchSizeAutotuner> autotuner;
+		auto autotune_snapshot = takeAutotuneSnapshot();
+		if (m_config.autotune_batch_size) {
+			autotuner.emplace(m_config);
+			applyBatchSizeBounds(autotuner.value());
+		}
+
+		Histogram::Snapshot last_lag_snapshot;
+
 		std::vector<TrainingBatch> training_batches;
 		std::vector<PredictionBatch> prediction_batches;
 		while (true) {
 			training_batches.clear();
 			prediction_batches.clear();
-			{
-				std::unique_lock lock{m_batches_lock};
-				m_server_event.wait(lock, [this] { return !m_training_batches.empty() || !m_prediction_batches.empty(); });
-				std::swap(m_training_batches, training_batches);
-				std::swap(m_prediction_batches, prediction_batches);
+			if constexpr (SEPARATE_INFERENCE_MODEL) {
+				m_server_event.wait([this] { return m_training_batches.sizeApprox() > 0; });
+			} else {
+				m_server_event.wait([this] { return m_training_batches.sizeApprox() > 0 || m_prediction_batches.sizeApprox() > 0; });
+			}
+			while (auto batch = m_training_batches.tryPop()) {
+				training_batches.emplace_back(std::move(batch.value()));
+			}
+			if constexpr (!SEPARATE_INFERENCE_MODEL) {
+				while (auto batch = m_prediction_batches.tryPop()) {
+					prediction_batches.emplace_back(std::move(batch.value()));
+				}
 			}
 			for (auto&& batch : training_batches) {
-				auto [v_loss, pi_loss, entropy_loss] = m_model.train(batch.states, batch.actions, batch.rewards, batch.policies, batch.data_sizes, batch.observation_sizes);
+				recordPolicyLag(batch);
+				const auto train_start = std::chrono::steady_clock::now();
+				auto loss = m_model.train(batch.states, batch.state_indices, batch.actions, batch.rewards, batch.policies, batch.data_sizes, batch.observation_sizes);
+				m_training_latency.add(std::chrono::steady_clock::now() - train_start);
 				batch.trainer.get().processFinished();
-				average_v_loss = average_loss_decay * average_v_loss + (1.0 - average_loss_decay) * v_loss;
-				average_pi_loss = average_loss_decay * average_pi_loss + (1.0 - average_loss_decay) * pi_loss;
-				average_entropy_loss = average_loss_decay * average_entropy_loss + (1.0 - average_loss_decay) * entropy_loss;
+				if (m_replay_buffer.has_value() && !loss.priorities.empty()) {
+					m_replay_buffer->updatePriorities(batch.replay_ids, loss.priorities);
+				}
+				m_weight_version.fetch_add(1, std::memory_order_relaxed);
+				if constexpr (SEPARATE_INFERENCE_MODEL) {
+					++updates_since_publish;
+					const auto now = std::chrono::steady_clock::now();
+					if ((weight_publish_interval_updates.has_value() && updates_since_publish >= weight_publish_interval_updates.value()) || (weight_publish_interval.has_value() && now - last_publish_time >= weight_publish_interval.value())) {
+						m_model.publishWeights();
+						updates_since_publish = 0;
+						last_publish_time = now;
+					}
+				}
+				average_v_loss = average_loss_decay * average_v_loss + (1.0 - average_loss_decay) * loss.v_loss;
+				average_pi_loss = average_loss_decay * average_pi_loss + (1.0 - average_loss_decay) * loss.pi_loss;
+				average_entropy_loss = average_loss_decay * average_entropy_loss + (1.0 - average_loss_decay) * loss.entropy_loss;
 				auto prev_trained_steps = trained_steps;
-				for (auto i : ranges::view::indices(T_MAX)) {
-					trained_steps += batch.data_sizes.at(i);
+				trained_steps += batch.fresh_steps;
+				std::size_t trained_samples = 0;
+				for (auto i : ranges::view::indices(t_max)) {
+					trained_samples += static_cast<std::size_t>(batch.data_sizes.at(i));
 				}
-				if constexpr (LOG_INTERVAL_STEPS.has_value()) {
-					if (trained_steps / LOG_INTERVAL_STEPS.value() != prev_trained_steps / LOG_INTERVAL_STEPS.value()) {
-						std::cout << "steps " << trained_steps << " , loss " << average_v_loss << " " << average_pi_loss << " " << average_entropy_loss << std::endl;
+				m_trained_samples.fetch_add(trained_samples, std::memory_order_relaxed);
+				if (log_interval_steps.has_value()) {
+					if (trained_steps / log_interval_steps.value() != prev_trained_steps / log_interval_steps.value()) {
+						std::cout << "steps " << trained_steps << " , loss " << average_v_loss << " " << average_pi_loss << " " << average_entropy_loss;
+						std::cout << " , flush(size/deadline) prediction " << m_prediction_queue.sizeFlushCount() << "/" << m_prediction_queue.deadlineFlushCount();
+						std::cout << " training " << m_training_queue.sizeFlushCount() << "/" << m_training_queue.deadlineFlushCount();
+						if constexpr (SEPARATE_INFERENCE_MODEL) {
+							std::cout << " , weight version learner " << m_weight_version.load() << " actor " << m_inference_weight_version.load();
+						}
+						const auto lag_snapshot = m_policy_lag.snapshot();
+						const auto lag = lag_snapshot.since(last_lag_snapshot);
+						std::cout << " , policy lag(p50/p99/max) " << lag.quantile(0.5) << "/" << lag.quantile(0.99) << "/" << lag.quantile(1.0);
+						if (m_config.max_policy_lag.has_value() && !m_config.throttle_stale_agents) {
+							std::cout << " dropped " << m_dropped_segments.load();
+						}
+						last_lag_snapshot = lag_snapshot;
+						if (m_replay_buffer.has_value()) {
+							std::cout << " , replayed " << m_replayed_segments.load() << " (buffer " << m_replay_buffer->size() << ")";
+						}
+						std::cout << std::endl;
 					}
 				}
-				if constexpr (SAVE_INTERVAL_STEPS.has_value()) {
-					if (trained_steps / SAVE_INTERVAL_STEPS.value() != prev_trained_steps / SAVE_INTERVAL_STEPS.value()) {
+				if (save_interval_steps.has_value()) {
+					if (trained_steps / save_interval_steps.value() != prev_trained_steps / save_interval_steps.value()) {
 						m_model.save(static_cast<int>(trained_steps));
 					}
 				}
+				batch.trainer.get().recycleBatch(std::move(batch));
 			}
 			for (auto&& batch : prediction_batches) {
-				auto actions_and_policies = m_model.predict(batch.states);
-				assert(actions_and_policies.size() == batch.agents.size());
-				batch.predictor.get().processFinished();
-				for (auto&& [agent, action_and_policy] : ranges::view::zip(batch.agents, actions_and_policies)) {
-					auto&& [action, policy] = action_and_policy;
-					agent.get().setNextActionAndPolicy(DiscreteActionTraits<Action>::convertFromID(action), policy);
-				}
+				processPredictionBatch(batch);
+			}
+			if (autotuner.has_value() && !autotuner->settled() && std::chrono::steady_clock::now() - autotune_snapshot.time >= m_config.autotune_interval) {
+				auto snapshot = takeAutotuneSnapshot();
+				autotuner->update(makeAutotuneMeasurement(autotune_snapshot, snapshot));
+				applyBatchSizeBounds(autotuner.value());
+				autotune_snapshot = snapshot;
 			}
 			if (trained_steps >= training_steps) {
 				std::cout << "training finished" << std::endl;
 				break;
 			}
 		}
+		if constexpr (SEPARATE_INFERENCE_MODEL) {
+			m_inference_exit_flag = true;
+			m_inference_event.notifyAll();
+			inference_thread.join();
+		}
+		if (metrics_thread.joinable()) {
+			m_metrics_exit_flag = true;
+			m_metrics_event.notifyAll();
+			metrics_thread.join();
+		}
+	}
+
+	// 全てのエージェントが進めた環境のステップ数
+	std::size_t countEnvSteps() const
+	{
+		std::size_t steps = 0;
+		for (auto&& agent : m_agents) {
+			steps += agent.steps();
+		}
+		return steps;
+	}
+
+	// 学習に使ったステップ数. リプレイで再び使ったものも含む
+	std::size_t trainedSamples() const noexcept
+	{
+		return m_trained_samples.load(std::memory_order_relaxed);
 	}
 
 private:
 	class Predictor;
 	class Trainer;
 	class Agent;
+	class AgentScheduler;
 
 	struct PredictionData
 	{
@@ -163,34 +344,313 @@ private:
 	};
 	struct PredictionBatch
 	{
+		// 異なる観測のみを描画したもの. 各エージェントの観測の位置はstate_indices
 		ObsBatch states;
+		std::vector<std::int64_t> state_indices;
 		std::vector<std::reference_wrapper<Agent>> agents;
 		std::reference_wrapper<Predictor> predictor;
+		// 推論に使われたモデルの更新回数
+		std::int64_t weight_version = 0;
 	};
+	// 最大t_maxステップ分の軌跡を保持する固定長の領域
+	// m_trajectory_poolから貸し出され、Trainerがバッチを作成した後に返却される
 	struct TrainingData
 	{
+		explicit TrainingData(std::size_t t_max) : observations(t_max + 1), actions(t_max), rewards(t_max), policies(t_max) {}
+
 		std::vector<Observation> observations;
 		std::vector<Action> actions;
 		std::vector<Reward> rewards;
 		std::vector<float> policies;
+		std::size_t num_observations = 0;
+		std::size_t num_actions = 0;
+		// 最初の行動を選んだモデルの更新回数. 以降の行動はこれ以降のモデルで選ばれている
+		std::int64_t behaviour_version = 0;
+		// m_replay_bufferに格納した際のid
+		std::uint64_t replay_id = 0;
+
+		void clear() noexcept
+		{
+			num_observations = 0;
+			num_actions = 0;
+		}
+		bool empty() const noexcept
+		{
+			return num_observations == 0;
+		}
+		// 領域を確保し直さずにotherの内容で上書きする
+		void assign(const TrainingData& other)
+		{
+			assert(observations.size() == other.observations.size());
+			for (std::size_t i = 0; i < other.num_observations; ++i) {
+				observations[i].assign(other.observations[i]);
+			}
+			std::copy_n(other.actions.begin(), other.num_actions, actions.begin());
+			std::copy_n(other.rewards.begin(), other.num_actions, rewards.begin());
+			std::copy_n(other.policies.begin(), other.num_actions, policies.begin());
+			num_observations = other.num_observations;
+			num_actions = other.num_actions;
+			behaviour_version = other.behaviour_version;
+			replay_id = other.replay_id;
+		}
+		void pushObservation(const Observation& observation)
+		{
+			assert(num_observations < observations.size());
+			observations[num_observations++].assign(observation);
+		}
+		void pushStep(const Observation& observation, Action action, Reward reward, float policy, std::int64_t weight_version)
+		{
+			assert(num_observations == num_actions && num_actions < actions.size());
+			if (num_actions == 0) {
+				behaviour_version = weight_version;
+			}
+			pushObservation(observation);
+			actions[num_actions] = action;
+			rewards[num_actions] = reward;
+			policies[num_actions] = policy;
+			++num_actions;
+		}
 	};
 	struct TrainingBatch
 	{
-		std::array<std::int64_t, T_MAX> data_sizes;
-		std::array<std::int64_t, T_MAX + 1> observation_sizes;
+		std::vector<std::int64_t> data_sizes;
+		std::vector<std::int64_t> observation_sizes;
+		// 異なる観測のみを描画したもの. 時刻優先の[t][列]の位置の観測のstatesでの位置はstate_indices
 		ObsBatch states;
+		std::vector<std::int64_t> state_indices;
 		std::vector<std::int64_t> actions;
 		std::vector<Reward> rewards;
 		std::vector<float> policies;
+		// 新しく取り出したセグメントのみで、リプレイしたものは含まない
+		std::vector<std::int64_t> behaviour_versions;
+		// 新しく取り出したセグメントの時刻数の合計
+		std::size_t fresh_steps = 0;
+		// 各列のセグメントのm_replay_bufferでのid. リプレイしない場合は空
+		std::vector<std::uint64_t> replay_ids;
 		std::reference_wrapper<Trainer> trainer;
 	};
 
+	// バッチサイズ自動調整の計測区間の境界で取得する各カウンタの値
+	struct AutotuneSnapshot
+	{
+		std::chrono::steady_clock::time_point time;
+		std::size_t env_steps;
+		std::size_t prediction_batches;
+		std::size_t prediction_popped;
+		std::size_t prediction_depth_sum;
+		std::size_t training_batches;
+		std::size_t training_popped;
+		std::size_t training_depth_sum;
+		std::uint64_t prediction_latency_ns;
+		std::uint64_t prediction_calls;
+		std::uint64_t training_latency_ns;
+		std::uint64_t training_calls;
+		Histogram::Snapshot prediction_dwell;
+		Histogram::Snapshot training_dwell;
+	};
+
+	AutotuneSnapshot takeAutotuneSnapshot() const
+	{
+		return {std::chrono::steady_clock::now(), countEnvSteps(),
+		    m_prediction_queue.sizeFlushCount() + m_prediction_queue.deadlineFlushCount(), m_prediction_queue.poppedCount(), m_prediction_queue.depthSum(),
+		    m_training_queue.sizeFlushCount() + m_training_queue.deadlineFlushCount(), m_training_queue.poppedCount(), m_training_queue.depthSum(),
+		    m_prediction_latency.total(), m_prediction_latency.count(),
+		    m_training_latency.total(), m_training_latency.count(),
+		    m_prediction_queue.dwellHistogram().snapshot(), m_training_queue.dwellHistogram().snapshot()};
+	}
+
+	static BatchSizeAutotuner::Measurement makeAutotuneMeasurement(const AutotuneSnapshot& prev, const AutotuneSnapshot& current)
+	{
+		auto average = [](double total, std::uint64_t count) {
+			return count == 0 ? 0.0 : total / static_cast<double>(count);
+		};
+		const auto seconds = std::chrono::duration<double>(current.time - prev.time).count();
+		const auto prediction_batches = current.prediction_batches - prev.prediction_batches;
+		const auto training_batches = current.training_batches - prev.training_batches;
+		return {static_cast<double>(current.env_steps - prev.env_steps) / seconds,
+		    average(static_cast<double>(current.prediction_popped - prev.prediction_popped), prediction_batches),
+		    average(static_cast<double>(current.training_popped - prev.training_popped), training_batches),
+		    average(static_cast<double>(current.prediction_depth_sum - prev.prediction_depth_sum), prediction_batches),
+		    average(static_cast<double>(current.training_depth_sum - prev.training_depth_sum), training_batches),
+		    average(static_cast<double>(current.prediction_latency_ns - prev.prediction_latency_ns), current.prediction_calls - prev.prediction_calls) / 1e6,
+		    average(static_cast<double>(current.training_latency_ns - prev.training_latency_ns), current.training_calls - prev.training_calls) / 1e6,
+		    static_cast<double>(current.prediction_dwell.since(prev.prediction_dwell).quantile(0.99)) / 1e6,
+		    static_cast<double>(current.training_dwell.since(prev.training_dwell).quantile(0.99)) / 1e6};
+	}
+
+	void applyBatchSizeBounds(const BatchSizeAutotuner& autotuner)
+	{
+		const auto prediction = autotuner.predictionBatchSizeBounds();
+		const auto training = autotuner.trainingBatchSizeBounds();
+		m_prediction_queue.setBatchSizeBounds(prediction.min, prediction.max);
+		m_training_queue.setBatchSizeBounds(freshBatchSize(m_config, training.min), freshBatchSize(m_config, training.max));
+	}
+
+	// リプレイを混ぜる場合、バッチサイズのうち学習キューから取り出す新しいセグメントの数
+	static std::size_t freshBatchSize(const ServerConfig& config, std::size_t batch_size)
+	{
+		if (!config.replay_capacity.has_value()) {
+			return batch_size;
+		}
+		return std::max<std::size_t>(static_cast<std::size_t>(std::lround(static_cast<double>(batch_size) / (1.0 + config.replay_ratio))), 1);
+	}
+
+	// 学習するセグメントの方策の遅れ(行動を選んだモデルから学習時点までの更新回数)を記録する
+	void recordPolicyLag(const TrainingBatch& batch)
+	{
+		const auto version = m_weight_version.load(std::memory_order_relaxed);
+		std::int64_t max_lag = 0;
+		for (auto behaviour_version : batch.behaviour_versions) {
+			const auto lag = std::max<std::int64_t>(version - behaviour_version, 0);
+			m_policy_lag.add(static_cast<std::uint64_t>(lag));
+			max_lag = std::max(max_lag, lag);
+		}
+		if (m_config.max_policy_lag.has_value() && m_config.throttle_stale_agents) {
+			const bool exceeded = static_cast<std::size_t>(max_lag) > m_config.max_policy_lag.value();
+			if (m_policy_lag_exceeded.exchange(exceeded, std::memory_order_relaxed) && !exceeded) {
+				m_policy_lag_event.notifyAll();
+			}
+		}
+	}
+
+	// 学習キューに溜まったデータの方策の遅れが大きい間、推論を止めてエージェントを待たせる
+	// キューに1バッチ分も無い場合は学習が進まず遅れも解消されないため、待たない
+	template <class ExitPredicate>
+	void waitForPolicyLag(ExitPredicate&& exit_requested)
+	{
+		if (!m_config.max_policy_lag.has_value() || !m_config.throttle_stale_agents) {
+			return;
+		}
+		auto throttled = [this] {
+			return m_policy_lag_exceeded.load(std::memory_order_relaxed) && m_training_queue.sizeApprox() >= m_training_queue.minBatchSize();
+		};
+		while (throttled() && !exit_requested()) {
+			// 学習キューが減っても通知されないため、一定間隔で確認する
+			m_policy_lag_event.waitUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds{1}, [&] { return !throttled() || exit_requested(); });
+		}
+	}
+
+	void processPredictionBatch(PredictionBatch& batch)
+	{
+		const auto predict_start = std::chrono::steady_clock::now();
+		auto prediction = m_model.predict(batch.states, batch.state_indices);
+		m_prediction_latency.add(std::chrono::steady_clock::now() - predict_start);
+		assert(prediction.actions_and_policies.size() == batch.agents.size());
+		batch.weight_version = prediction.weight_version;
+		m_inference_weight_version.store(prediction.weight_version, std::memory_order_relaxed);
+		// statesはPythonに複製せずに渡しているため、predictが返るまで再利用しない
+		batch.predictor.get().processFinished(std::move(batch.states));
+		for (auto&& [agent, action_and_policy] : ranges::view::zip(batch.agents, prediction.actions_and_policies)) {
+			auto&& [action, policy] = action_and_policy;
+			agent.get().setNextActionAndPolicy(DiscreteActionTraits<Action>::convertFromID(action), policy, batch.weight_version);
+		}
+		if (m_agent_scheduler.has_value()) {
+			m_agent_scheduler->schedule(batch.agents.begin(), batch.agents.end());
+		}
+	}
+
+	void runInference()
+	{
+		while (true) {
+			m_inference_event.wait([this] { return m_prediction_batches.sizeApprox() > 0 || m_inference_exit_flag; });
+			if (m_inference_exit_flag) {
+				break;
+			}
+			while (auto batch = m_prediction_batches.tryPop()) {
+				processPredictionBatch(batch.value());
+			}
+		}
+	}
+
+	// metrics_interval毎にメトリクスを書き出す。終了時にも最後の区間の分を書き出す
+	void runMetricsExporter()
+	{
+		MetricsState state{std::chrono::steady_clock::now(), countEnvSteps(), m_trained_samples.load(std::memory_order_relaxed), {}};
+		auto next_time = state.time + m_config.metrics_interval;
+		while (true) {
+			m_metrics_event.waitUntil(next_time, [this] { return m_metrics_exit_flag.load(); });
+			writeMetrics(state);
+			if (m_metrics_exit_flag) {
+				break;
+			}
+			next_time += m_config.metrics_interval;
+		}
+	}
+
+	// 前回の書き出し時点の値. 分位点とスループットはこの時点からの区間で計算する
+	struct MetricsState
+	{
+		std::chrono::steady_clock::time_point time;
+		std::size_t env_steps;
+		std::size_t trained_samples;
+		std::array<Histogram::Snapshot, 9> histograms;
+	};
+
+	void writeMetrics(MetricsState& state)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const auto env_steps = countEnvSteps();
+		const auto trained_samples = m_trained_samples.load(std::memory_order_relaxed);
+		const auto seconds = std::chrono::duration<double>(now - state.time).count();
+
+		PrometheusTextFile file{m_config.metrics_file.value()};
+		file.counter("impala_env_steps_total", "Environment steps taken by all agents.", static_cast<double>(env_steps));
+		file.counter("impala_trained_samples_total", "Timesteps consumed by training.", static_cast<double>(trained_samples));
+		file.gauge("impala_env_steps_per_second", "Environment steps per second over the last interval.", static_cast<double>(env_steps - state.env_steps) / seconds);
+		file.gauge("impala_trained_samples_per_second", "Trained timesteps per second over the last interval.", static_cast<double>(trained_samples - state.trained_samples) / seconds);
+		file.gauge("impala_prediction_queue_depth", "Observations waiting in the prediction queue.", static_cast<double>(m_prediction_queue.sizeApprox()));
+		file.gauge("impala_training_queue_depth", "Trajectories waiting in the training queue.", static_cast<double>(m_training_queue.sizeApprox()));
+		static constexpr double ns_to_seconds = 1e-9;
+		const std::array<std::tuple<std::string_view, std::string_view, std::reference_wrapper<Histogram>, double>, std::tuple_size_v<decltype(state.histograms)>> histograms = {{
+		    {"impala_agent_wait_seconds", "Time an agent waits for its next action.", m_agent_wait_latency, ns_to_seconds},
+		    {"impala_prediction_queue_dwell_seconds", "Time an observation spends in the prediction queue.", m_prediction_queue.dwellHistogram(), ns_to_seconds},
+		    {"impala_training_queue_dwell_seconds", "Time a trajectory spends in the training queue.", m_training_queue.dwellHistogram(), ns_to_seconds},
+		    {"impala_prediction_make_batch_seconds", "Environment::makeBatch time for prediction batches.", m_prediction_make_batch_latency, ns_to_seconds},
+		    {"impala_training_make_batch_seconds", "Environment::makeBatch time for training batches.", m_training_make_batch_latency, ns_to_seconds},
+		    {"impala_training_batch_assembly_seconds", "Time a trainer takes to assemble a batch, including makeBatch.", m_training_assembly_latency, ns_to_seconds},
+		    {"impala_predict_seconds", "Model predict call time.", m_prediction_latency, ns_to_seconds},
+		    {"impala_train_seconds", "Model train call time.", m_training_latency, ns_to_seconds},
+		    {"impala_policy_lag_updates", "Learner updates between the behaviour policy of a trained segment and the learner.", m_policy_lag, 1.0},
+		}};
+		for (auto i : ranges::view::indices(histograms.size())) {
+			auto&& [name, help, histogram, scale] = histograms[i];
+			auto snapshot = histogram.get().snapshot();
+			file.summary(name, help, snapshot.since(state.histograms[i]), snapshot, histogram.get().takeMax(), scale);
+			state.histograms[i] = snapshot;
+		}
+		file.counter("impala_prediction_observations_total", "Observations in prediction batches.", static_cast<double>(m_prediction_observations.load(std::memory_order_relaxed)));
+		file.counter("impala_prediction_unique_observations_total", "Distinct observations rendered and sent for prediction.", static_cast<double>(m_prediction_unique_observations.load(std::memory_order_relaxed)));
+		file.counter("impala_training_observations_total", "Observations in training batches.", static_cast<double>(m_training_observations.load(std::memory_order_relaxed)));
+		file.counter("impala_training_unique_observations_total", "Distinct observations rendered and sent for training.", static_cast<double>(m_training_unique_observations.load(std::memory_order_relaxed)));
+		file.counter("impala_dropped_stale_segments_total", "Segments dropped because their policy lag exceeded max_policy_lag.", static_cast<double>(m_dropped_segments.load(std::memory_order_relaxed)));
+		if (m_replay_buffer.has_value()) {
+			file.counter("impala_replayed_segments_total", "Segments sampled from the replay buffer into training batches.", static_cast<double>(m_replayed_segments.load(std::memory_order_relaxed)));
+			file.gauge("impala_replay_buffer_size", "Segments held in the replay buffer.", static_cast<double>(m_replay_buffer->size()));
+		}
+		if (!file.commit()) {
+			std::cerr << "failed to write metrics : " << m_config.metrics_file.value() << std::endl;
+		}
+		state.time = now;
+		state.env_steps = env_steps;
+		state.trained_samples = trained_samples;
+	}
+
+	void notifyPredictionBatch()
+	{
+		if constexpr (SEPARATE_INFERENCE_MODEL) {
+			m_inference_event.notifyOne();
+		} else {
+			m_server_event.notifyOne();
+		}
+	}
+
 	class Predictor
 	{
 	public:
-		explicit Predictor(Server& server) noexcept : m_server(server)
+		Predictor(Server& server, std::size_t index) : m_server(server)
 		{
-			m_thread = std::thread{[this] {
+			m_thread = std::thread{[this, index, cpus = server.m_placement.predictorCpus(index)] {
+				pinCurrentThreadOrWarn(cpus, "predictor " + std::to_string(index));
 				run();
 			}};
 		}
@@ -201,43 +661,50 @@ private:
 
 		void run()
 		{
+			std::vector<PredictionData> datas;
+			// 自動調整で最大バッチサイズが変わっても、設定された値を超えることはない
+			const auto max_batch_size = m_server.get().m_config.max_prediction_batch_size;
+			// サーバーで処理中のバッチがこの数に達するまで、次のバッチを先行して作成する
+			const auto pipeline_depth = m_server.get().m_config.prediction_pipeline_depth;
+			datas.reserve(max_batch_size);
+			ObservationDeduplicator<Observation> deduplicator{m_server.get().m_config.deduplicate_observations};
+			std::vector<const Observation*> unique_observations;
+			unique_observations.reserve(max_batch_size);
 			while (true) {
 				std::vector<std::reference_wrapper<std::add_const_t<Observation>>> observations;
 				std::vector<std::reference_wrapper<Agent>> agents;
-				observations.reserve(MAX_PREDICTION_BATCH_SIZE);
-				agents.reserve(MAX_PREDICTION_BATCH_SIZE);
-				bool data_remain = false;
-				{
-					std::unique_lock lock{m_server.get().m_prediction_queue_lock};
-					m_server.get().m_predictor_event.wait(lock, [this] { return m_server.get().m_prediction_queue.size() >= MIN_PREDICTION_BATCH_SIZE || m_exit_flag; });
-					if (m_exit_flag) {
-						break;
-					}
-					auto& queue = m_server.get().m_prediction_queue;
-					while (!queue.empty()) {
-						if (observations.size() >= MAX_PREDICTION_BATCH_SIZE) {
-							break;
-						}
-						auto& data = queue.front();
-						observations.emplace_back(data.observation);
-						agents.emplace_back(data.agent);
-						queue.pop_front();
-					}
-					data_remain = (queue.size() >= MIN_PREDICTION_BATCH_SIZE);
+				observations.reserve(max_batch_size);
+				agents.reserve(max_batch_size);
+				datas.clear();
+				m_server.get().waitForPolicyLag([this] { return m_exit_flag.load(); });
+				if (!m_server.get().m_prediction_queue.popBatch(datas, [this] { return m_exit_flag.load(); })) {
+					break;
 				}
-				if (data_remain) {
-					m_server.get().m_predictor_event.notify_one();
+				for (auto&& data : datas) {
+					observations.emplace_back(data.observation);
+					agents.emplace_back(data.agent);
 				}
-				PredictionBatch batch{Environment::makeBatch(observations.begin(), observations.end()), std::move(agents), *this};
+				const auto make_batch_start = std::chrono::steady_clock::now();
+				PredictionBatch batch{acquireStates(), {}, std::move(agents), *this};
+				deduplicator.deduplicate(observations.begin(), observations.end(), unique_observations, batch.state_indices);
+				if constexpr (HasInPlaceMakeBatchV<Environment>) {
+					Environment::makeBatch(unique_observations.cbegin(), unique_observations.cend(), batch.states);
+				} else {
+					batch.states = Environment::makeBatch(unique_observations.cbegin(), unique_observations.cend());
+				}
+				m_server.get().m_prediction_make_batch_latency.add(std::chrono::steady_clock::now() - make_batch_start);
+				m_server.get().m_prediction_observations.fetch_add(observations.size(), std::memory_order_relaxed);
+				m_server.get().m_prediction_unique_observations.fetch_add(unique_observations.size(), std::memory_order_relaxed);
 				{
-					std::lock_guard lock{m_server.get().m_batches_lock};
-					m_server.get().m_prediction_batches.emplace_back(std::move(batch));
-					m_processing_flag = true;
+					std::lock_guard lock{m_mutex};
+					++m_processing_count;
 				}
-				m_server.get().m_server_event.notify_one();
+				[[maybe_unused]] bool pushed = m_server.get().m_prediction_batches.tryPush(std::move(batch));
+				assert(pushed);
+				m_server.get().notifyPredictionBatch();
 				{
 					std::unique_lock lock{m_mutex};
-					m_event.wait(lock, [this] { return !m_processing_flag || m_exit_flag; });
+					m_event.wait(lock, [&] { return m_processing_count < pipeline_depth || m_exit_flag; });
 					if (m_exit_flag) {
 						break;
 					}
@@ -254,30 +721,47 @@ private:
 			m_event.notify_one();
 		}
 
-		void processFinished()
+		// statesの領域は次のバッチで再利用する
+		void processFinished(ObsBatch&& states)
 		{
 			{
 				std::lock_guard lock{m_mutex};
-				m_processing_flag = false;
+				assert(m_processing_count > 0);
+				--m_processing_count;
+				m_free_states.emplace_back(std::move(states));
 			}
 			m_event.notify_one();
 		}
 
 	private:
+		ObsBatch acquireStates()
+		{
+			std::lock_guard lock{m_mutex};
+			if (m_free_states.empty()) {
+				return ObsBatch{};
+			}
+			auto states = std::move(m_free_states.back());
+			m_free_states.pop_back();
+			return states;
+		}
+
 		std::reference_wrapper<Server> m_server;
 		std::thread m_thread;
 		std::mutex m_mutex;
 		std::condition_variable m_event;
-		bool m_processing_flag = false;
-		bool m_exit_flag = false;
+		std::size_t m_processing_count = 0;
+		// 推論が終わったバッチの観測の領域. 高々pipeline_depth個
+		std::vector<ObsBatch> m_free_states;
+		std::atomic<bool> m_exit_flag = false;
 	};
 
 	class Trainer
 	{
 	public:
-		explicit Trainer(Server& server) noexcept : m_server(server)
+		Trainer(Server& server, std::size_t index) : m_server(server)
 		{
-			m_thread = std::thread{[this] {
+			m_thread = std::thread{[this, index, cpus = server.m_placement.trainerCpus(index)] {
+				pinCurrentThreadOrWarn(cpus, "trainer " + std::to_string(index));
 				run();
 			}};
 		}
@@ -288,95 +772,78 @@ private:
 
 		void run()
 		{
-			std::vector<TrainingData> datas;
-			datas.reserve(MAX_TRAINING_BATCH_SIZE);
-			std::vector<std::optional<Observation>> observations;
-			observations.reserve(MAX_TRAINING_BATCH_SIZE * (T_MAX + 1));
+			const auto max_batch_size = m_server.get().m_config.max_training_batch_size;
+			const auto pipeline_depth = m_server.get().m_config.training_pipeline_depth;
+			const auto t_max = m_server.get().m_config.t_max;
+			std::vector<TrainingData*> datas;
+			datas.reserve(max_batch_size);
+			// 新しいセグメントとリプレイしたセグメントを合わせたバッチの列
+			std::vector<TrainingData*> segments;
+			segments.reserve(max_batch_size);
+			// リプレイバッファから取り出したセグメントの複製先
+			std::vector<TrainingData> replayed;
+			if (m_server.get().m_replay_buffer.has_value()) {
+				replayed.reserve(max_batch_size);
+				for (std::size_t i = 0; i < max_batch_size; ++i) {
+					replayed.emplace_back(t_max);
+				}
+			}
+			// 時刻優先([t][列])に並べた観測. 軌跡の無い位置はnullptr
+			std::vector<const Observation*> observations;
+			observations.reserve(max_batch_size * (t_max + 1));
+			ObservationDeduplicator<Observation> deduplicator{m_server.get().m_config.deduplicate_observations};
+			std::vector<const Observation*> unique_observations;
+			unique_observations.reserve(max_batch_size * (t_max + 1));
 			while (true) {
 				datas.clear();
-				observations.clear();
-				std::vector<std::int64_t> actions;
-				std::vector<Reward> rewards;
-				std::vector<float> policies;
-				actions.reserve(MAX_TRAINING_BATCH_SIZE * T_MAX);
-				rewards.reserve(MAX_TRAINING_BATCH_SIZE * T_MAX);
-				policies.reserve(MAX_TRAINING_BATCH_SIZE * T_MAX);
-				bool data_remain = false;
-				{
-					std::unique_lock lock{m_server.get().m_training_queue_lock};
-					m_server.get().m_trainer_event.wait(lock, [this] { return m_server.get().m_training_queue.size() >= MIN_TRAINING_BATCH_SIZE || m_exit_flag; });
-					if (m_exit_flag) {
-						break;
-					}
-					auto& queue = m_server.get().m_training_queue;
-					while (!queue.empty()) {
-						if (datas.size() >= MAX_TRAINING_BATCH_SIZE) {
-							break;
-						}
-						auto& data = queue.front();
-						datas.emplace_back(std::move(data));
-						queue.pop_front();
-					}
-					data_remain = (queue.size() >= MIN_TRAINING_BATCH_SIZE);
+				segments.clear();
+				if (!m_server.get().m_training_queue.popBatch(datas, [this] { return m_exit_flag.load(); })) {
+					break;
 				}
-				if (data_remain) {
-					m_server.get().m_trainer_event.notify_one();
+				if (dropStaleSegments(datas)) {
+					continue;
 				}
-				std::sort(datas.begin(), datas.end(), [](const auto& a, const auto& b) {
-					if (a.actions.size() == b.actions.size()) {
-						return a.observations.size() > b.observations.size();
+				const auto assembly_start = std::chrono::steady_clock::now();
+				segments.assign(datas.begin(), datas.end());
+				mixReplayedSegments(datas, replayed, segments);
+				// 各時刻で有効な列が先頭に詰まるよう、長い順に並べる
+				std::sort(segments.begin(), segments.end(), [](const auto* a, const auto* b) {
+					if (a->num_actions == b->num_actions) {
+						return a->num_observations > b->num_observations;
 					}
-					return a.actions.size() > b.actions.size();
+					return a->num_actions > b->num_actions;
 				});
-				for (auto i : ranges::view::indices(T_MAX)) {
-					for (auto& data : datas) {
-						if (i >= data.actions.size()) {
-							if (i >= data.observations.size()) {
-								observations.emplace_back(std::nullopt);
-							} else {
-								observations.emplace_back(std::move(data.observations.at(i)));
-							}
-							actions.emplace_back(0);
-							rewards.emplace_back(Reward{});
-							policies.emplace_back(0.0f);
-						} else {
-							observations.emplace_back(std::move(data.observations.at(i)));
-							actions.emplace_back(DiscreteActionTraits<Action>::convertToID(data.actions.at(i)));
-							rewards.emplace_back(std::move(data.rewards.at(i)));
-							policies.emplace_back(std::move(data.policies.at(i)));
-						}
-					}
-				}
-				for (auto& data : datas) {
-					if (data.observations.size() >= T_MAX + 1) {
-						observations.emplace_back(std::move(data.observations.back()));
-					} else {
-						observations.emplace_back(std::nullopt);
-					}
-				}
+				auto batch = acquireBatch();
+				fillBatch(batch, segments, observations);
 
-				TrainingBatch batch{{}, {}, Environment::makeBatch(observations.cbegin(), observations.cend()), std::move(actions), std::move(rewards), std::move(policies), *this};
-				for (auto i : ranges::view::indices(T_MAX)) {
-					auto it = std::upper_bound(datas.begin(), datas.end(), i + 1, [](std::size_t x, const auto& y) {
-						return x > y.actions.size();
-					});
-					batch.data_sizes.at(i) = it - datas.begin();
+				const auto make_batch_start = std::chrono::steady_clock::now();
+				deduplicator.deduplicate(observations.cbegin(), observations.cend(), unique_observations, batch.state_indices);
+				if constexpr (HasInPlaceMakeBatchV<Environment>) {
+					Environment::makeBatch(unique_observations.cbegin(), unique_observations.cend(), batch.states);
+				} else {
+					batch.states = Environment::makeBatch(unique_observations.cbegin(), unique_observations.cend());
 				}
-				for (auto i : ranges::view::indices(T_MAX + 1)) {
-					auto it = std::upper_bound(datas.begin(), datas.end(), i + 1, [](std::size_t x, const auto& y) {
-						return x > y.observations.size();
-					});
-					batch.observation_sizes.at(i) = it - datas.begin();
+				m_server.get().m_training_make_batch_latency.add(std::chrono::steady_clock::now() - make_batch_start);
+				m_server.get().m_training_observations.fetch_add(static_cast<std::size_t>(std::count_if(observations.begin(), observations.end(), [](const auto* obs) { return obs != nullptr; })), std::memory_order_relaxed);
+				m_server.get().m_training_unique_observations.fetch_add(unique_observations.size(), std::memory_order_relaxed);
+				batch.behaviour_versions.clear();
+				batch.fresh_steps = 0;
+				for (auto* data : datas) {
+					batch.behaviour_versions.emplace_back(data->behaviour_version);
+					batch.fresh_steps += data->num_actions;
+					m_server.get().m_trajectory_pool.release(data);
 				}
+				m_server.get().m_training_assembly_latency.add(std::chrono::steady_clock::now() - assembly_start);
 				{
-					std::lock_guard lock{m_server.get().m_batches_lock};
-					m_server.get().m_training_batches.emplace_back(std::move(batch));
-					m_processing_flag = true;
+					std::lock_guard lock{m_mutex};
+					++m_processing_count;
 				}
-				m_server.get().m_server_event.notify_one();
+				[[maybe_unused]] bool pushed = m_server.get().m_training_batches.tryPush(std::move(batch));
+				assert(pushed);
+				m_server.get().m_server_event.notifyOne();
 				{
 					std::unique_lock lock{m_mutex};
-					m_event.wait(lock, [this] { return !m_processing_flag || m_exit_flag; });
+					m_event.wait(lock, [&] { return m_processing_count < pipeline_depth || m_exit_flag; });
 					if (m_exit_flag) {
 						break;
 					}
@@ -397,142 +864,209 @@ private:
 		{
 			{
 				std::lock_guard lock{m_mutex};
-				m_processing_flag = false;
+				assert(m_processing_count > 0);
+				--m_processing_count;
 			}
 			m_event.notify_one();
 		}
 
+		// 学習が終わったバッチの領域を、次のバッチで再利用するために返却する
+		void recycleBatch(TrainingBatch&& batch)
+		{
+			std::lock_guard lock{m_mutex};
+			m_free_batches.emplace_back(std::move(batch));
+		}
+
 	private:
+		// 返却されたバッチがあれば再利用し、無ければ新しく作る
+		// パイプラインの深さ程度の数のバッチが使い回される
+		TrainingBatch acquireBatch()
+		{
+			std::lock_guard lock{m_mutex};
+			if (m_free_batches.empty()) {
+				return TrainingBatch{{}, {}, {}, {}, {}, {}, {}, {}, 0, {}, *this};
+			}
+			auto batch = std::move(m_free_batches.back());
+			m_free_batches.pop_back();
+			return batch;
+		}
+
+		// 長い順に並んだsegmentsを、batchの時刻優先の[t][列]の位置に直接書き込む
+		// data_sizes/observation_sizesは各列の長さを数えて求め、observationsには描画する観測を同じ並びで入れる
+		void fillBatch(TrainingBatch& batch, const std::vector<TrainingData*>& segments, std::vector<const Observation*>& observations)
+		{
+			const auto t_max = m_server.get().m_config.t_max;
+			const auto batch_size = segments.size();
+			batch.data_sizes.assign(t_max, 0);
+			batch.observation_sizes.assign(t_max + 1, 0);
+			batch.actions.resize(t_max * batch_size);
+			batch.rewards.resize(t_max * batch_size);
+			batch.policies.resize(t_max * batch_size);
+			observations.assign((t_max + 1) * batch_size, nullptr);
+			batch.replay_ids.clear();
+			for (auto column : ranges::view::indices(batch_size)) {
+				const auto* data = segments[column];
+				for (auto t : ranges::view::indices(data->num_observations)) {
+					observations[t * batch_size + column] = &data->observations[t];
+					++batch.observation_sizes[t];
+				}
+				for (auto t : ranges::view::indices(t_max)) {
+					const auto index = t * batch_size + column;
+					if (t < data->num_actions) {
+						batch.actions[index] = DiscreteActionTraits<Action>::convertToID(data->actions[t]);
+						batch.rewards[index] = data->rewards[t];
+						batch.policies[index] = data->policies[t];
+						++batch.data_sizes[t];
+					} else {
+						batch.actions[index] = 0;
+						batch.rewards[index] = Reward{};
+						batch.policies[index] = 0.0f;
+					}
+				}
+				if (m_server.get().m_replay_buffer.has_value()) {
+					batch.replay_ids.emplace_back(data->replay_id);
+				}
+			}
+		}
+
+		// リプレイバッファからdatasの数のreplay_ratio倍のセグメントをreplayedに複製してsegmentsに加え、
+		// その後datasをリプレイバッファに格納する. 同じバッチに同じセグメントが2度入らないよう、取り出しを先に行う
+		void mixReplayedSegments(const std::vector<TrainingData*>& datas, std::vector<TrainingData>& replayed, std::vector<TrainingData*>& segments)
+		{
+			auto& server = m_server.get();
+			if (!server.m_replay_buffer.has_value()) {
+				return;
+			}
+			const auto count = std::min(static_cast<std::size_t>(std::lround(static_cast<double>(datas.size()) * server.m_config.replay_ratio)), replayed.size());
+			std::size_t num_replayed = 0;
+			server.m_replay_buffer->sample(count, m_random_engine, [&](const TrainingData& data, std::uint64_t id) {
+				auto& dest = replayed[num_replayed++];
+				dest.assign(data);
+				dest.replay_id = id;
+				segments.emplace_back(&dest);
+			});
+			for (auto* data : datas) {
+				data->replay_id = server.m_replay_buffer->insert(*data);
+			}
+			server.m_replayed_segments.fetch_add(num_replayed, std::memory_order_relaxed);
+		}
+
+		// max_policy_lagを超えたセグメントを取り除いてプールに返す。全て取り除いた場合はtrueを返す
+		bool dropStaleSegments(std::vector<TrainingData*>& datas)
+		{
+			auto& server = m_server.get();
+			if (!server.m_config.max_policy_lag.has_value() || server.m_config.throttle_stale_agents) {
+				return false;
+			}
+			const auto oldest_version = server.m_weight_version.load(std::memory_order_relaxed) - static_cast<std::int64_t>(server.m_config.max_policy_lag.value());
+			auto stale = std::partition(datas.begin(), datas.end(), [&](const auto* data) {
+				return data->behaviour_version >= oldest_version;
+			});
+			for (auto it = stale; it != datas.end(); ++it) {
+				server.m_trajectory_pool.release(*it);
+			}
+			server.m_dropped_segments.fetch_add(static_cast<std::size_t>(datas.end() - stale), std::memory_order_relaxed);
+			datas.erase(stale, datas.end());
+			return datas.empty();
+		}
+
 		std::reference_wrapper<Server> m_server;
 		std::thread m_thread;
 		std::mutex m_mutex;
 		std::condition_variable m_event;
-		bool m_processing_flag = false;
-		bool m_exit_flag = false;
+		std::size_t m_processing_count = 0;
+		std::atomic<bool> m_exit_flag = false;
+		// m_mutexで保護される
+		std::vector<TrainingBatch> m_free_batches;
+		std::mt19937 m_random_engine{std::random_device{}()};
 	};
 
 	class Agent
 	{
 	public:
-		explicit Agent(Server& server) noexcept : m_server(server)
+		Agent(Server& server, std::size_t index) : m_server(server)
 		{
-			m_thread = std::thread{[this] {
-				run();
-			}};
+			if (!server.m_agent_scheduler.has_value()) {
+				m_thread = std::thread{[this, index, cpus = server.m_placement.agentCpus(index)] {
+					pinCurrentThreadOrWarn(cpus, "agent " + std::to_string(index));
+					run();
+				}};
+			}
 		}
 		~Agent()
 		{
-			m_thread.join();
+			if (m_thread.joinable()) {
+				m_thread.join();
+			}
 		}
 
 		void run()
 		{
-			std::vector<Observation> prev_obss;
-			std::vector<Action> prev_actions;
-			std::vector<Reward> prev_rewards;
-			std::vector<float> prev_policies;
-			prev_obss.reserve(T_MAX + 1);
-			prev_actions.reserve(T_MAX + 1);
-			prev_rewards.reserve(T_MAX + 1);
-			prev_policies.reserve(T_MAX + 1);
+			start();
 			while (true) {
-				prev_obss.clear();
-				prev_actions.clear();
-				prev_rewards.clear();
-				prev_policies.clear();
-				Reward sum_of_reward = Reward{};
-				std::size_t t = 0;
-				Observation observation = m_env.reset();
-				while (true) {
-					if constexpr (MAX_EPISODE_LENGTH.has_value()) {
-						if (t >= MAX_EPISODE_LENGTH.value()) {
-							break;
-						}
-					}
-					{
-						bool enough_predictor_data = false;
-						{
-							std::lock_guard lock{m_server.get().m_prediction_queue_lock};
-							m_server.get().m_prediction_queue.emplace_back(PredictionData{std::cref(observation), *this});
-							m_predicting_flag = true;
-							enough_predictor_data = m_server.get().m_prediction_queue.size() >= MIN_PREDICTION_BATCH_SIZE;
-						}
-						if (enough_predictor_data) {
-							m_server.get().m_predictor_event.notify_one();
-						}
-					}
-					Action next_action;
-					float policy;
-					{
-						std::unique_lock lock{m_mutex};
-						m_event.wait(lock, [this] { return !m_predicting_flag || m_exit_flag; });
-						if (m_exit_flag) {
-							return;
-						}
-						next_action = m_action;
-						policy = m_policy;
+				{
+					std::unique_lock lock{m_mutex};
+					m_event.wait(lock, [this] { return !m_predicting_flag || m_exit_flag; });
+					if (m_exit_flag) {
+						return;
 					}
-					auto&& [next_obs, current_reward, status] = m_env.step(next_action);
-					++t;
-					sum_of_reward += current_reward;
-					if (status == EnvState::FINISHED || prev_obss.size() >= T_MAX || (MAX_EPISODE_LENGTH.has_value() && t >= MAX_EPISODE_LENGTH.value())) {
-						assert(prev_obss.size() == prev_actions.size() && prev_obss.size() == prev_rewards.size());
-						TrainingData data;
-						std::optional<TrainingData> data2;
-						for (auto&& [obs, action, reward, policy] : ranges::view::zip(prev_obss, prev_actions, prev_rewards, prev_policies)) {
-							data.observations.emplace_back(std::move(obs));
-							data.actions.emplace_back(std::move(action));
-							data.rewards.emplace_back(std::move(reward));
-							data.policies.emplace_back(std::move(policy));
-						}
-						if (status == EnvState::FINISHED) {
-							if (data.actions.size() < T_MAX) {
-								data.observations.emplace_back(std::move(observation));
-								data.actions.emplace_back(std::move(next_action));
-								data.rewards.emplace_back(std::move(current_reward));
-								data.policies.emplace_back(std::move(policy));
-							} else {
-								data.observations.emplace_back(observation.clone());
-								data2.emplace();
-								data2->observations.emplace_back(std::move(observation));
-								data2->actions.emplace_back(std::move(next_action));
-								data2->rewards.emplace_back(std::move(current_reward));
-								data2->policies.emplace_back(std::move(policy));
-							}
-						} else {
-							data.observations.emplace_back(observation.clone());
-						}
-						bool enough_trainer_data = false;
-						{
-							std::lock_guard lock{m_server.get().m_training_queue_lock};
-							auto& queue = m_server.get().m_training_queue;
-							queue.emplace_back(std::move(data));
-							if (data2) {
-								queue.emplace_back(std::move(data2.value()));
-							}
-							enough_trainer_data = (queue.size() >= MIN_TRAINING_BATCH_SIZE);
-						}
-						if (enough_trainer_data) {
-							m_server.get().m_trainer_event.notify_one();
-						}
-						prev_obss.clear();
-						prev_actions.clear();
-						prev_rewards.clear();
-						prev_policies.clear();
-						if (status == EnvState::FINISHED) {
-							break;
-						}
+				}
+				resume();
+			}
+		}
+
+		// エピソードを開始し、最初の行動の推論を要求する
+		void start()
+		{
+			m_segment = &acquireTrainingData();
+			beginEpisode();
+			requestPrediction();
+		}
+
+		// 推論された行動で環境を1ステップ進め、次の行動の推論を要求した時点で中断する
+		void resume()
+		{
+			m_server.get().m_agent_wait_latency.add(std::chrono::steady_clock::now() - m_request_time);
+			const auto t_max = m_server.get().m_config.t_max;
+			const auto max_episode_length = m_server.get().m_config.max_episode_length;
+			Action next_action = m_action;
+			float policy = m_policy;
+			const auto weight_version = m_weight_version;
+			auto [current_reward, status] = stepEnvironment(next_action);
+			m_steps.store(m_steps.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			++m_t;
+			m_sum_of_reward += current_reward;
+			if (status == EnvState::FINISHED || m_segment->num_actions >= t_max || (max_episode_length.has_value() && m_t >= max_episode_length.value())) {
+				assert(m_segment->num_observations == m_segment->num_actions);
+				auto& data = *m_segment;
+				TrainingData* data2 = nullptr;
+				if (status == EnvState::FINISHED) {
+					if (data.num_actions < t_max) {
+						data.pushStep(m_observation, next_action, current_reward, policy, weight_version);
+					} else {
+						data.pushObservation(m_observation);
+						data2 = &acquireTrainingData();
+						data2->pushStep(m_observation, next_action, current_reward, policy, weight_version);
 					}
-					prev_obss.emplace_back(std::move(observation));
-					observation = std::move(next_obs);
-					prev_actions.emplace_back(std::move(next_action));
-					prev_rewards.emplace_back(std::move(current_reward));
-					prev_policies.emplace_back(std::move(policy));
+				} else {
+					data.pushObservation(m_observation);
 				}
+				pushTrainingData(data);
+				if (data2 != nullptr) {
+					pushTrainingData(*data2);
+				}
+				m_segment = &acquireTrainingData();
+			}
+			if (status == EnvState::FINISHED || (max_episode_length.has_value() && m_t >= max_episode_length.value())) {
 				if (this == &m_server.get().m_agents.front()) {
-					std::cout << "finish episode : " << t << " " << std::setprecision(5) << sum_of_reward << std::endl;
+					std::cout << "finish episode : " << m_t << " " << std::setprecision(5) << m_sum_of_reward << std::endl;
 				}
+				beginEpisode();
+			} else {
+				m_segment->pushStep(m_observation, next_action, current_reward, policy, weight_version);
+				std::swap(m_observation, m_next_observation);
 			}
+			requestPrediction();
 		}
 
 		void exit()
@@ -544,43 +1078,221 @@ private:
 			m_event.notify_one();
 		}
 
-		void setNextActionAndPolicy(Action action, float policy)
+		// これまでに進めた環境のステップ数. 他のスレッドから読んでよい
+		std::size_t steps() const noexcept
 		{
-			{
-				std::lock_guard lock{m_mutex};
+			return m_steps.load(std::memory_order_relaxed);
+		}
+
+		void setNextActionAndPolicy(Action action, float policy, std::int64_t weight_version)
+		{
+			if (m_server.get().m_agent_scheduler.has_value()) {
+				// 推論待ちの間は他のスレッドがこのエージェントに触れないため、再開はAgentSchedulerのキューを介して同期される
 				m_action = action;
 				m_policy = policy;
-				m_predicting_flag = false;
+				m_weight_version = weight_version;
+			} else {
+				{
+					std::lock_guard lock{m_mutex};
+					m_action = action;
+					m_policy = policy;
+					m_weight_version = weight_version;
+					m_predicting_flag = false;
+				}
+				m_event.notify_one();
 			}
-			m_event.notify_one();
 		}
 
 	private:
+		void beginEpisode()
+		{
+			m_segment->clear();
+			m_sum_of_reward = Reward{};
+			m_t = 0;
+			if constexpr (HasInPlaceStepV<Environment>) {
+				m_env.reset(m_observation);
+			} else {
+				m_observation = m_env.reset();
+			}
+		}
+
+		// 環境を1ステップ進め、次の観測をm_next_observationに置く
+		// 環境が書き込み先を受け取るstepを持つ場合、観測の領域は2つを交互に使い回す
+		std::tuple<Reward, EnvState> stepEnvironment(Action action)
+		{
+			if constexpr (HasInPlaceStepV<Environment>) {
+				return m_env.step(action, m_next_observation);
+			} else {
+				auto [next_obs, reward, status] = m_env.step(action);
+				m_next_observation = std::move(next_obs);
+				return {reward, status};
+			}
+		}
+
+		void requestPrediction()
+		{
+			if (!m_server.get().m_agent_scheduler.has_value()) {
+				std::lock_guard lock{m_mutex};
+				m_predicting_flag = true;
+			}
+			m_request_time = std::chrono::steady_clock::now();
+			// 推論待ちのデータはエージェント毎に高々1つなので、キューが溢れることはない
+			[[maybe_unused]] bool pushed = m_server.get().m_prediction_queue.tryPush(PredictionData{std::cref(m_observation), *this});
+			assert(pushed);
+		}
+
+		TrainingData& acquireTrainingData()
+		{
+			// プールはエージェント毎に2つ、キューとTrainerが保持できる分を加えた数だけ用意されているため、枯渇しない
+			auto* data = m_server.get().m_trajectory_pool.tryAcquire();
+			// 枯渇した場合はプールの大きさの計算が誤っている. NDEBUGでもnullptrを使わずに止める
+			if (data == nullptr) {
+				std::cerr << "trajectory pool exhausted" << std::endl;
+				std::terminate();
+			}
+			data->clear();
+			return *data;
+		}
+
+		void pushTrainingData(TrainingData& data)
+		{
+			auto& queue = m_server.get().m_training_queue;
+			TrainingData* ptr = &data;
+			while (!queue.tryPush(std::move(ptr))) {
+				if (m_server.get().m_exit_flag) {
+					m_server.get().m_trajectory_pool.release(ptr);
+					return;
+				}
+				std::this_thread::yield();
+			}
+		}
+
 		std::reference_wrapper<Server> m_server;
 		std::thread m_thread;
 		std::mutex m_mutex;
 		std::condition_variable m_event;
 		Action m_action;
 		float m_policy;
+		std::int64_t m_weight_version = 0;
 		bool m_predicting_flag = false;
 		bool m_exit_flag = false;
 		Environment m_env;
+		Observation m_observation;
+		Observation m_next_observation;
+		TrainingData* m_segment = nullptr;
+		Reward m_sum_of_reward = Reward{};
+		std::size_t m_t = 0;
+		std::chrono::steady_clock::time_point m_request_time;
+		// このエージェントだけが書き込む
+		std::atomic<std::size_t> m_steps = 0;
+	};
+
+	// num_agent_workersが指定された場合、エージェントはスレッドを持たず、
+	// 推論結果が届いたものから少数のワーカースレッドで再開される
+	class AgentScheduler
+	{
+	public:
+		AgentScheduler(std::size_t num_workers, const ThreadPlacement& placement)
+		{
+			for (auto&& i : ranges::view::indices(num_workers)) {
+				m_threads.emplace_back([this, i, cpus = placement.agentCpus(i)] {
+					pinCurrentThreadOrWarn(cpus, "agent worker " + std::to_string(i));
+					run();
+				});
+			}
+		}
+		~AgentScheduler()
+		{
+			exit();
+			for (auto&& thread : m_threads) {
+				thread.join();
+			}
+		}
+
+		template <class InputIterator>
+		void schedule(InputIterator first, InputIterator last)
+		{
+			{
+				std::lock_guard lock{m_mutex};
+				m_ready_queue.insert(m_ready_queue.end(), first, last);
+			}
+			m_event.notify_all();
+		}
+
+		void exit()
+		{
+			{
+				std::lock_guard lock{m_mutex};
+				m_exit_flag = true;
+			}
+			m_event.notify_all();
+		}
+
+	private:
+		void run()
+		{
+			while (true) {
+				std::optional<std::reference_wrapper<Agent>> agent;
+				{
+					std::unique_lock lock{m_mutex};
+					m_event.wait(lock, [this] { return !m_ready_queue.empty() || m_exit_flag; });
+					if (m_exit_flag) {
+						break;
+					}
+					agent.emplace(m_ready_queue.front());
+					m_ready_queue.pop_front();
+				}
+				agent->get().resume();
+			}
+		}
+
+		std::vector<std::thread> m_threads;
+		std::deque<std::reference_wrapper<Agent>> m_ready_queue;
+		std::mutex m_mutex;
+		std::condition_variable m_event;
+		bool m_exit_flag = false;
 	};
 
-	boost::container::static_vector<Predictor, NUM_PREDICTORS> m_predictors;
-	boost::container::static_vector<Trainer, NUM_TRAINERS> m_trainers;
-	boost::container::static_vector<Agent, NUM_AGENTS> m_agents;
+	const ServerConfig m_config;
+	const ThreadPlacement m_placement;
+	std::deque<Predictor> m_predictors;
+	std::deque<Trainer> m_trainers;
+	std::deque<Agent> m_agents;
+	std::optional<AgentScheduler> m_agent_scheduler;
 	Model m_model;
-	std::deque<PredictionData> m_prediction_queue;
-	std::mutex m_prediction_queue_lock;
-	std::condition_variable m_predictor_event;
-	std::deque<TrainingData> m_training_queue;
-	std::mutex m_training_queue_lock;
-	std::condition_variable m_trainer_event;
-	std::vector<PredictionBatch> m_prediction_batches;
-	std::vector<TrainingBatch> m_training_batches;
-	std::mutex m_batches_lock;
-	std::condition_variable m_server_event;
+	BatchQueue<PredictionData> m_prediction_queue;
+	BatchQueue<TrainingData*> m_training_queue;
+	ObjectPool<TrainingData> m_trajectory_pool;
+	std::optional<ReplayBuffer<TrainingData>> m_replay_buffer;
+	BoundedMPMCQueue<PredictionBatch> m_prediction_batches;
+	BoundedMPMCQueue<TrainingBatch> m_training_batches;
+	EventNotifier m_server_event;
+	EventNotifier m_inference_event;
+	std::atomic<bool> m_inference_exit_flag = false;
+	// 学習スレッドだけが書き込む
+	std::atomic<std::int64_t> m_weight_version = 0;
+	std::atomic<std::int64_t> m_inference_weight_version = 0;
+	// リプレイしたセグメントを含む、学習に使った時刻数
+	std::atomic<std::size_t> m_trained_samples = 0;
+	LatencyHistogram m_agent_wait_latency;
+	LatencyHistogram m_prediction_make_batch_latency;
+	LatencyHistogram m_training_make_batch_latency;
+	LatencyHistogram m_training_assembly_latency;
+	LatencyHistogram m_prediction_latency;
+	LatencyHistogram m_training_latency;
+	Histogram m_policy_lag;
+	std::atomic<std::size_t> m_dropped_segments = 0;
+	std::atomic<std::size_t> m_replayed_segments = 0;
+	// バッチに含まれた観測と、そのうち異なるもの(描画してモデルに渡したもの)の数
+	std::atomic<std::size_t> m_prediction_observations = 0;
+	std::atomic<std::size_t> m_prediction_unique_observations = 0;
+	std::atomic<std::size_t> m_training_observations = 0;
+	std::atomic<std::size_t> m_training_unique_observations = 0;
+	std::atomic<bool> m_policy_lag_exceeded = false;
+	EventNotifier m_policy_lag_event;
+	EventNotifier m_metrics_event;
+	std::atomic<bool> m_metrics_exit_flag = false;
+	std::atomic<bool> m_exit_flag = false;
 };
 
 }  // namespace impala
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "batch_buffer.hpp"
+#include "config.hpp"
+
+namespace impala
+{
+
+// Serverの実行時設定
+// 既定値はParametersの定数から作り、設定ファイルやコマンドライン引数で上書きできる(config.hpp)
+struct ServerConfig : ConfigFields<ServerConfig>
+{
+	std::size_t num_agents;
+	std::size_t num_predictors;
+	std::size_t num_trainers;
+	std::optional<std::size_t> num_agent_workers;
+
+	std::size_t min_prediction_batch_size;
+	std::size_t max_prediction_batch_size;
+	std::size_t min_training_batch_size;
+	std::size_t max_training_batch_size;
+	std::size_t training_queue_capacity;
+	std::optional<std::chrono::microseconds> max_prediction_latency;
+	std::optional<std::chrono::microseconds> max_training_latency;
+	std::size_t prediction_pipeline_depth;
+	std::size_t training_pipeline_depth;
+
+	std::optional<std::size_t> weight_publish_interval_updates;
+	std::optional<std::chrono::milliseconds> weight_publish_interval;
+
+	std::size_t t_max;
+	std::optional<std::size_t> max_episode_length;
+
+	std::optional<std::size_t> log_interval_steps;
+	std::optional<std::size_t> save_interval_steps;
+
+	// 有効な場合、実行中にスループットを計測しながらバッチサイズの上下限を調整する
+	// 調整範囲の上限は上で指定した最大バッチサイズ
+	bool autotune_batch_size;
+	std::chrono::milliseconds autotune_interval;
+
+	// 指定された場合、各段の所要時間やスループットをPrometheusのテキスト形式で定期的に書き出す
+	std::optional<std::string> metrics_file;
+	std::chrono::milliseconds metrics_interval;
+
+	// 有効な場合、各スレッドをCPUに固定する。CPUリストは"0-3,8"の形式で、指定しない役割は自動で割り当てる
+	bool pin_threads;
+	std::optional<std::string> server_cpus;
+	std::optional<std::string> predictor_cpus;
+	std::optional<std::string> trainer_cpus;
+	std::optional<std::string> agent_cpus;
+	std::optional<std::string> render_cpus;
+
+	// 学習時点で方策の遅れがこの更新回数を超えたセグメントは、学習せずに捨てる
+	// throttle_stale_agentsが有効な場合は捨てる代わりに、遅れが解消されるまで推論を止めてエージェントを待たせる
+	std::optional<std::size_t> max_policy_lag;
+	bool throttle_stale_agents;
+
+	// 指定された場合、学習したセグメントをこの数まで保持し、新しいセグメント1つにつきreplay_ratio個の割合で混ぜて再び学習する
+	// バッチサイズは変えず、学習キューから取り出す新しいセグメントの数を1/(1+replay_ratio)にするため、環境のステップあたりの更新回数が増える
+	// replay_priority_exponentが正の場合、TD誤差の絶対値のこの乗に比例した確率で選ぶ。0の場合は一様に選ぶ
+	std::optional<std::size_t> replay_capacity;
+	double replay_ratio;
+	double replay_priority_exponent;
+
+	// 観測のバッチを描画する際に、呼び出したPredictor/Trainerのスレッドを手伝うスレッドの数. 0の場合は呼び出したスレッドだけで描画する
+	// スレッドはプロセス全体で共有される
+	std::size_t batch_render_threads;
+	// 2MiB以上のバッチの領域にヒュージページを使うか. "none", "transparent", "explicit" のいずれか
+	std::string batch_huge_pages;
+	// 有効な場合、バッチ内の同じ観測は1度だけ描画してモデルに渡し、各位置の観測はインデックスで参照する
+	bool deduplicate_observations;
+
+	template <class Parameters>
+	static ServerConfig fromParameters()
+	{
+		ServerConfig config;
+		config.num_agents = Parameters::NUM_AGENTS;
+		config.num_predictors = Parameters::NUM_PREDICTORS;
+		config.num_trainers = Parameters::NUM_TRAINERS;
+		config.num_agent_workers = Parameters::NUM_AGENT_WORKERS;
+		config.min_prediction_batch_size = Parameters::MIN_PREDICTION_BATCH_SIZE;
+		config.max_prediction_batch_size = Parameters::MAX_PREDICTION_BATCH_SIZE;
+		config.min_training_batch_size = Parameters::MIN_TRAINING_BATCH_SIZE;
+		config.max_training_batch_size = Parameters::MAX_TRAINING_BATCH_SIZE;
+		config.training_queue_capacity = Parameters::TRAINING_QUEUE_CAPACITY;
+		config.max_prediction_latency = Parameters::MAX_PREDICTION_LATENCY;
+		config.max_training_latency = Parameters::MAX_TRAINING_LATENCY;
+		config.prediction_pipeline_depth = Parameters::PREDICTION_PIPELINE_DEPTH;
+		config.training_pipeline_depth = Parameters::TRAINING_PIPELINE_DEPTH;
+		config.weight_publish_interval_updates = Parameters::WEIGHT_PUBLISH_INTERVAL_UPDATES;
+		config.weight_publish_interval = Parameters::WEIGHT_PUBLISH_INTERVAL;
+		config.t_max = Parameters::T_MAX;
+		config.max_episode_length = Parameters::MAX_EPISODE_LENGTH;
+		config.log_interval_steps = Parameters::LOG_INTERVAL_STEPS;
+		config.save_interval_steps = Parameters::SAVE_INTERVAL_STEPS;
+		config.autotune_batch_size = Parameters::AUTOTUNE_BATCH_SIZE;
+		config.autotune_interval = Parameters::AUTOTUNE_INTERVAL;
+		if constexpr (Parameters::METRICS_FILE.has_value()) {
+			config.metrics_file = std::string{Parameters::METRICS_FILE.value()};
+		}
+		config.metrics_interval = Parameters::METRICS_INTERVAL;
+		config.pin_threads = Parameters::PIN_THREADS;
+		config.max_policy_lag = Parameters::MAX_POLICY_LAG;
+		config.throttle_stale_agents = Parameters::THROTTLE_STALE_AGENTS;
+		config.replay_capacity = Parameters::REPLAY_CAPACITY;
+		config.replay_ratio = Parameters::REPLAY_RATIO;
+		config.replay_priority_exponent = Parameters::REPLAY_PRIORITY_EXPONENT;
+		config.batch_render_threads = Parameters::BATCH_RENDER_THREADS;
+		config.batch_huge_pages = std::string{Parameters::BATCH_HUGE_PAGES};
+		config.deduplicate_observations = Parameters::DEDUPLICATE_OBSERVATIONS;
+		return config;
+	}
+
+	template <class Function>
+	void forEachField(Function&& f)
+	{
+		f("num_agents", num_agents);
+		f("num_predictors", num_predictors);
+		f("num_trainers", num_trainers);
+		f("num_agent_workers", num_agent_workers);
+		f("min_prediction_batch_size", min_prediction_batch_size);
+		f("max_prediction_batch_size", max_prediction_batch_size);
+		f("min_training_batch_size", min_training_batch_size);
+		f("max_training_batch_size", max_training_batch_size);
+		f("training_queue_capacity", training_queue_capacity);
+		f("max_prediction_latency_us", max_prediction_latency);
+		f("max_training_latency_us", max_training_latency);
+		f("prediction_pipeline_depth", prediction_pipeline_depth);
+		f("training_pipeline_depth", training_pipeline_depth);
+		f("weight_publish_interval_updates", weight_publish_interval_updates);
+		f("weight_publish_interval_ms", weight_publish_interval);
+		f("t_max", t_max);
+		f("max_episode_length", max_episode_length);
+		f("log_interval_steps", log_interval_steps);
+		f("save_interval_steps", save_interval_steps);
+		f("autotune_batch_size", autotune_batch_size);
+		f("autotune_interval_ms", autotune_interval);
+		f("metrics_file", metrics_file);
+		f("metrics_interval_ms", metrics_interval);
+		f("pin_threads", pin_threads);
+		f("server_cpus", server_cpus);
+		f("predictor_cpus", predictor_cpus);
+		f("trainer_cpus", trainer_cpus);
+		f("agent_cpus", agent_cpus);
+		f("render_cpus", render_cpus);
+		f("max_policy_lag", max_policy_lag);
+		f("throttle_stale_agents", throttle_stale_agents);
+		f("replay_capacity", replay_capacity);
+		f("replay_ratio", replay_ratio);
+		f("replay_priority_exponent", replay_priority_exponent);
+		f("batch_render_threads", batch_render_threads);
+		f("batch_huge_pages", batch_huge_pages);
+		f("deduplicate_observations", deduplicate_observations);
+	}
+
+	// 推論用のモデルを分離する場合のみ、重みを公開する間隔の指定を必須とする
+	// 推論待ちはエージェント毎に高々1つ、学習キューはtraining_queue_capacityまでしか溜まらないため、最小バッチサイズがそれを超えると遅延の上限がない場合に永久に待つ
+	bool isValid(bool separate_inference_model) const
+	{
+		return num_agents > 0 && num_predictors > 0 && num_trainers > 0 && (!num_agent_workers.has_value() || num_agent_workers.value() > 0)
+		       && 0 < min_prediction_batch_size && min_prediction_batch_size <= max_prediction_batch_size && max_prediction_batch_size <= num_agents
+		       && 0 < min_training_batch_size && min_training_batch_size <= max_training_batch_size && min_training_batch_size <= training_queue_capacity
+		       && training_queue_capacity > 0 && prediction_pipeline_depth > 0 && training_pipeline_depth > 0
+		       && (!separate_inference_model || weight_publish_interval_updates.has_value() || weight_publish_interval.has_value())
+		       && t_max > 0 && (!max_episode_length.has_value() || max_episode_length.value() > 0)
+		       && autotune_interval.count() > 0 && (!metrics_file.has_value() || !metrics_file->empty()) && metrics_interval.count() > 0
+		       && (!replay_capacity.has_value() || replay_capacity.value() > 0) && replay_ratio >= 0.0 && replay_priority_exponent >= 0.0
+		       && parseHugePageMode(batch_huge_pages).has_value();
+	}
+};
+
+}  // namespace impala
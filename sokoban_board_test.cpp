@@ -0,0 +1,214 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <tuple>
+
+#include "sokoban_env.hpp"
+
+// ビットボードのSokobanEnv::Board::stepを、セルを走査していた以前の実装と同じ盤面・行動列で比べる
+namespace
+{
+
+using namespace impala;
+
+using CellState = SokobanEnv::CellState;
+using Observation = SokobanEnv::Observation;
+using Reward = SokobanEnv::Reward;
+
+constexpr int ROOM_WIDTH = SokobanEnv::ROOM_WIDTH;
+constexpr int ROOM_HEIGHT = SokobanEnv::ROOM_HEIGHT;
+
+// ビットボードに置き換える前のSokobanEnv::step. statesを書き換え、報酬と終了したかを返す
+std::tuple<Reward, EnvState> referenceStep(Observation& states, FourDirections action)
+{
+	int player_x;
+	int player_y;
+	bool found = [&]() -> bool {
+		for (int y = 0; y < ROOM_HEIGHT; ++y) {
+			for (int x = 0; x < ROOM_WIDTH; ++x) {
+				if (states[y][x] == CellState::PLAYER || states[y][x] == CellState::PLAYER_TARGET) {
+					player_x = x;
+					player_y = y;
+					return true;
+				}
+			}
+		}
+		return false;
+	}();
+	if (!found) {
+		std::cerr << "cannot found player" << std::endl;
+		std::terminate();
+	}
+	int diff_x;
+	int diff_y;
+	if (action == FourDirections::LEFT) {
+		diff_x = -1;
+		diff_y = 0;
+	} else if (action == FourDirections::RIGHT) {
+		diff_x = 1;
+		diff_y = 0;
+	} else if (action == FourDirections::UP) {
+		diff_x = 0;
+		diff_y = -1;
+	} else if (action == FourDirections::DOWN) {
+		diff_x = 0;
+		diff_y = 1;
+	} else {
+		assert(false);
+		diff_x = 0;
+		diff_y = 0;
+	}
+	Reward reward = -0.1f;
+	if (player_x + diff_x < 0 || player_x + diff_x >= ROOM_WIDTH || player_y + diff_y < 0 || player_y + diff_y >= ROOM_HEIGHT) {
+		return {reward, EnvState::RUNNING};
+	}
+	auto& player_cell = states[player_y][player_x];
+	auto& target = states[player_y + diff_y][player_x + diff_x];
+	if (target == CellState::EMPTY) {
+		if (player_cell == CellState::PLAYER_TARGET) {
+			player_cell = CellState::TARGET;
+		} else {
+			player_cell = CellState::EMPTY;
+		}
+		target = CellState::PLAYER;
+	} else if (target == CellState::TARGET) {
+		if (player_cell == CellState::PLAYER_TARGET) {
+			player_cell = CellState::TARGET;
+		} else {
+			player_cell = CellState::EMPTY;
+		}
+		target = CellState::PLAYER_TARGET;
+	} else if (target == CellState::BOX) {
+		if (player_x + diff_x * 2 < 0 || player_x + diff_x * 2 >= ROOM_WIDTH || player_y + diff_y * 2 < 0 || player_y + diff_y * 2 >= ROOM_HEIGHT) {
+			return {reward, EnvState::RUNNING};
+		}
+		auto& target_next = states[player_y + diff_y * 2][player_x + diff_x * 2];
+		if (target_next == CellState::EMPTY) {
+			target_next = CellState::BOX;
+			target = CellState::PLAYER;
+			if (player_cell == CellState::PLAYER_TARGET) {
+				player_cell = CellState::TARGET;
+			} else {
+				player_cell = CellState::EMPTY;
+			}
+		} else if (target_next == CellState::TARGET) {
+			target_next = CellState::BOX_TARGET;
+			target = CellState::PLAYER;
+			if (player_cell == CellState::PLAYER_TARGET) {
+				player_cell = CellState::TARGET;
+			} else {
+				player_cell = CellState::EMPTY;
+			}
+			reward += 1.0f;
+		}
+	} else if (target == CellState::BOX_TARGET) {
+		if (player_x + diff_x * 2 < 0 || player_x + diff_x * 2 >= ROOM_WIDTH || player_y + diff_y * 2 < 0 || player_y + diff_y * 2 >= ROOM_HEIGHT) {
+			return {reward, EnvState::RUNNING};
+		}
+		auto& target_next = states[player_y + diff_y * 2][player_x + diff_x * 2];
+		if (target_next == CellState::EMPTY) {
+			target_next = CellState::BOX;
+			target = CellState::PLAYER_TARGET;
+			if (player_cell == CellState::PLAYER_TARGET) {
+				player_cell = CellState::TARGET;
+			} else {
+				player_cell = CellState::EMPTY;
+			}
+			reward -= 1.0f;
+		} else if (target_next == CellState::TARGET) {
+			target_next = CellState::BOX_TARGET;
+			target = CellState::PLAYER_TARGET;
+			if (player_cell == CellState::PLAYER_TARGET) {
+				player_cell = CellState::TARGET;
+			} else {
+				player_cell = CellState::EMPTY;
+			}
+		}
+	}
+	bool done = [&]() -> bool {
+		for (int y = 0; y < ROOM_HEIGHT; ++y) {
+			for (int x = 0; x < ROOM_WIDTH; ++x) {
+				if (states[y][x] == CellState::BOX) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}();
+	if (done) {
+		reward += 10.0f;
+	}
+	return {reward, done ? EnvState::FINISHED : EnvState::RUNNING};
+}
+
+// 壁・箱・目標の密度を変えたランダムな盤面. プレイヤーは1人で、箱と目標の数は揃えない
+Observation makeRandomBoard(std::mt19937& random_engine)
+{
+	auto below = [&](unsigned int n) {
+		return static_cast<int>(random_engine() % n);
+	};
+	const int wall_percent = below(30);
+	const int box_percent = below(25);
+	const int target_percent = below(25);
+	Observation obs;
+	for (int y = 0; y < ROOM_HEIGHT; ++y) {
+		for (int x = 0; x < ROOM_WIDTH; ++x) {
+			const int r = below(100);
+			auto cell = CellState::EMPTY;
+			if (r < wall_percent) {
+				cell = CellState::WALL;
+			} else if (r < wall_percent + box_percent) {
+				cell = below(3) == 0 ? CellState::BOX_TARGET : CellState::BOX;
+			} else if (r < wall_percent + box_percent + target_percent) {
+				cell = CellState::TARGET;
+			}
+			obs[y][x] = cell;
+		}
+	}
+	const int player = below(ROOM_WIDTH * ROOM_HEIGHT);
+	obs[player / ROOM_WIDTH][player % ROOM_WIDTH] = below(4) == 0 ? CellState::PLAYER_TARGET : CellState::PLAYER;
+	return obs;
+}
+
+bool sameObservation(const Observation& a, const Observation& b)
+{
+	return std::memcmp(a.data(), b.data(), sizeof(CellState) * a.sizeOfAll()) == 0;
+}
+
+}  // namespace
+
+int main()
+{
+	constexpr int NUM_GAMES = 20000;
+	constexpr int MAX_STEPS = 200;
+
+	std::mt19937 random_engine{7};
+	long steps = 0;
+	long finished = 0;
+	for (int game = 0; game < NUM_GAMES; ++game) {
+		auto expected = makeRandomBoard(random_engine);
+		SokobanEnv::Board board{expected};
+		if (!sameObservation(board.toObservation(), expected)) {
+			std::cerr << "game " << game << " : board does not round-trip" << std::endl;
+			return EXIT_FAILURE;
+		}
+		for (int t = 0; t < MAX_STEPS; ++t) {
+			const auto action = static_cast<FourDirections>(random_engine() % 4);
+			const auto [expected_reward, expected_state] = referenceStep(expected, action);
+			const auto [reward, state] = board.step(action);
+			++steps;
+			if (!sameObservation(board.toObservation(), expected) || reward != expected_reward || state != expected_state) {
+				std::cerr << "game " << game << " step " << t << " : mismatch, reward " << reward << " expected " << expected_reward << std::endl;
+				return EXIT_FAILURE;
+			}
+			if (state == EnvState::FINISHED) {
+				++finished;
+				break;
+			}
+		}
+	}
+	std::cout << "ok : " << steps << " steps, " << finished << " finished" << std::endl;
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+
+#include "sokoban_env.hpp"
+
+// SokobanEnv::EarlyTerminationのstate_cyclesで、同じ状態に戻ったエピソードが打ち切られることを確かめる
+namespace
+{
+
+using namespace impala;
+
+using Reward = SokobanEnv::Reward;
+
+constexpr int ROOM_WIDTH = SokobanEnv::ROOM_WIDTH;
+constexpr int ROOM_HEIGHT = SokobanEnv::ROOM_HEIGHT;
+constexpr Reward PENALTY = 10.0f;
+constexpr const char* PROBLEM_PATH = "./sokoban_early_termination_test.bin";
+
+int cell(int x, int y)
+{
+	return y * ROOM_WIDTH + x;
+}
+
+// 外周が壁の部屋. 箱と目標はプレイヤーから離しておく
+SokobanEnv::PackedProblem makeProblem(int player_x, int player_y)
+{
+	SokobanEnv::PackedProblem problem{};
+	for (int y = 0; y < ROOM_HEIGHT; ++y) {
+		for (int x = 0; x < ROOM_WIDTH; ++x) {
+			if (x == 0 || x == ROOM_WIDTH - 1 || y == 0 || y == ROOM_HEIGHT - 1) {
+				problem.walls |= std::uint64_t{1} << cell(x, y);
+			}
+		}
+	}
+	problem.boxes = std::uint64_t{1} << cell(5, 5);
+	problem.targets = std::uint64_t{1} << cell(6, 6);
+	problem.player = cell(player_x, player_y);
+	return problem;
+}
+
+void loadSingleProblem(const SokobanEnv::PackedProblem& problem)
+{
+	{
+		std::ofstream out{PROBLEM_PATH, std::ios::binary | std::ios::trunc};
+		SokobanEnv::writeProblemFile(out, std::vector<SokobanEnv::PackedProblem>{problem});
+	}
+	SokobanEnv::mapProblemFile(PROBLEM_PATH);
+	std::remove(PROBLEM_PATH);
+}
+
+// actionsを順に適用し、各ステップで終了したかがexpectedと一致するかを返す
+bool play(const char* name, std::initializer_list<FourDirections> actions, std::initializer_list<EnvState> expected)
+{
+	SokobanEnv env;
+	env.reset();
+	auto expected_it = expected.begin();
+	int t = 0;
+	for (auto action : actions) {
+		const auto [obs, reward, state] = env.step(action);
+		if (state != *expected_it) {
+			std::cerr << name << " step " << t << " : unexpected state" << std::endl;
+			return false;
+		}
+		if (state == EnvState::FINISHED && reward != -0.1f - PENALTY) {
+			std::cerr << name << " step " << t << " : reward " << reward << " expected " << -0.1f - PENALTY << std::endl;
+			return false;
+		}
+		++expected_it;
+		++t;
+	}
+	return true;
+}
+
+}  // namespace
+
+int main()
+{
+	constexpr auto L = FourDirections::LEFT;
+	constexpr auto R = FourDirections::RIGHT;
+	constexpr auto U = FourDirections::UP;
+	constexpr auto D = FourDirections::DOWN;
+	constexpr auto RUN = EnvState::RUNNING;
+	constexpr auto FIN = EnvState::FINISHED;
+
+	loadSingleProblem(makeProblem(1, 1));
+	bool ok = true;
+
+	SokobanEnv::setEarlyTermination({false, false, true, PENALTY});
+	// 左右の往復は、元のセルに戻った時点で打ち切る
+	ok = play("ping-pong", {R, L}, {RUN, FIN}) && ok;
+	// 一周して戻った場合も同じ
+	ok = play("square", {R, D, L, U}, {RUN, RUN, RUN, FIN}) && ok;
+	// 壁に当たって動けない場合は状態が変わらないため、何度でも続く
+	ok = play("wall bump", {L, U, L, U, R}, {RUN, RUN, RUN, RUN, RUN}) && ok;
+
+	SokobanEnv::setEarlyTermination({false, false, false, PENALTY});
+	ok = play("disabled", {R, L, R, L, R, L}, {RUN, RUN, RUN, RUN, RUN, RUN}) && ok;
+
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "ok" << std::endl;
+	return 0;
+}
@@ -1,7 +1,23 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "sokoban_env.hpp"
+#include "sokoban_level_generator.hpp"
 
 namespace impala
 {
@@ -248,25 +264,222 @@ constexpr ImageData BOX_TARGET = {{
 
 constexpr std::array<ImageData, 7> images = {{EMPTY, WALL, PLAYER, BOX, TARGET, PLAYER_TARGET, BOX_TARGET}};
 
+// タイルの1行(8画素)
+template <class Pixel>
+using TileRow = std::array<Pixel, 8>;
+
+// imagesを[チャンネル][タイル内の行][CellState]の順に並べ替えたもの
+// 画像の1行を描画する間に参照する7種類のタイルの行が(floatで)224バイトに収まり、各行は32バイト境界に揃う
+template <class Pixel>
+struct alignas(32) TileAtlas
+{
+	std::array<std::array<std::array<TileRow<Pixel>, images.size()>, 8>, 3> rows;
+};
+
+// 画素値をPixelに変換する. uint8の場合はSokobanQuantizedEnv::PIXEL_SCALE単位に丸める
+template <class Pixel>
+constexpr Pixel toPixel(float value)
+{
+	if constexpr (std::is_same_v<Pixel, float>) {
+		return value;
+	} else {
+		return static_cast<Pixel>(value / SokobanQuantizedEnv::PIXEL_SCALE + 0.5f);
+	}
+}
+
+template <class Pixel>
+constexpr TileAtlas<Pixel> makeTileAtlas()
+{
+	TileAtlas<Pixel> atlas{};
+	for (std::size_t c = 0; c < 3; ++c) {
+		for (std::size_t dy = 0; dy < 8; ++dy) {
+			for (std::size_t state = 0; state < images.size(); ++state) {
+				for (std::size_t dx = 0; dx < 8; ++dx) {
+					atlas.rows[c][dy][state][dx] = toPixel<Pixel>(images[state][c][dy][dx]);
+				}
+			}
+		}
+	}
+	return atlas;
+}
+
+template <class Pixel>
+constexpr TileAtlas<Pixel> tile_atlas = makeTileAtlas<Pixel>();
+
 }  // namespace sokoban_image
 
-std::tuple<SokobanEnv::Observation, SokobanEnv::Reward, EnvState> SokobanEnv::step(const Action& action)
+namespace
 {
-	int player_x;
-	int player_y;
-	bool found = [&]() -> bool {
-		for (int y = 0; y < ROOM_HEIGHT; ++y) {
-			for (int x = 0; x < ROOM_WIDTH; ++x) {
-				if (m_states[y][x] == CellState::PLAYER || m_states[y][x] == CellState::PLAYER_TARGET) {
-					player_x = x;
-					player_y = y;
-					return true;
+
+constexpr int TILES_X = SokobanEnv::ROOM_WIDTH + SokobanEnv::BORDER_WIDTH * 2;
+constexpr int TILES_Y = SokobanEnv::ROOM_HEIGHT + SokobanEnv::BORDER_WIDTH * 2;
+
+// 外周の壁を含めた各タイルのCellState
+using TileCodes = std::array<std::array<std::uint8_t, TILES_X>, TILES_Y>;
+
+using BlitFunction = void (*)(const TileCodes&, float*);
+
+// 外周の壁を付け加える
+TileCodes makeTileCodes(const SokobanEnv::Observation& obs)
+{
+	TileCodes tiles;
+	for (auto& row : tiles) {
+		row.fill(static_cast<std::uint8_t>(SokobanEnv::CellState::WALL));
+	}
+	for (int y = 0; y < SokobanEnv::ROOM_HEIGHT; ++y) {
+		for (int x = 0; x < SokobanEnv::ROOM_WIDTH; ++x) {
+			tiles[y + SokobanEnv::BORDER_WIDTH][x + SokobanEnv::BORDER_WIDTH] = static_cast<std::uint8_t>(obs[y][x]);
+		}
+	}
+	return tiles;
+}
+
+// 画像の各行について、タイル毎に8画素をまとめてコピーする
+template <class Pixel>
+void blitTiles(const TileCodes& tiles, Pixel* dest)
+{
+	for (std::size_t c = 0; c < 3; ++c) {
+		for (int ty = 0; ty < TILES_Y; ++ty) {
+			for (std::size_t dy = 0; dy < 8; ++dy) {
+				const auto& rows = sokoban_image::tile_atlas<Pixel>.rows[c][dy];
+				Pixel* line = dest + (c * SokobanEnv::IMAGE_HEIGHT + static_cast<std::size_t>(ty) * 8 + dy) * SokobanEnv::IMAGE_WIDTH;
+				for (int tx = 0; tx < TILES_X; ++tx) {
+					std::memcpy(line + tx * 8, rows[tiles[ty][tx]].data(), sizeof(sokoban_image::TileRow<Pixel>));
 				}
 			}
 		}
-		return false;
-	}();
-	if (!found) {
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// blitTilesと同じ処理を、タイルの1行を1つのAVXレジスタで読み書きして行う
+__attribute__((target("avx"))) void blitTilesAvx(const TileCodes& tiles, float* dest)
+{
+	for (std::size_t c = 0; c < 3; ++c) {
+		for (int ty = 0; ty < TILES_Y; ++ty) {
+			for (std::size_t dy = 0; dy < 8; ++dy) {
+				const auto& rows = sokoban_image::tile_atlas<float>.rows[c][dy];
+				float* line = dest + (c * SokobanEnv::IMAGE_HEIGHT + static_cast<std::size_t>(ty) * 8 + dy) * SokobanEnv::IMAGE_WIDTH;
+				for (int tx = 0; tx < TILES_X; ++tx) {
+					_mm256_storeu_ps(line + tx * 8, _mm256_load_ps(rows[tiles[ty][tx]].data()));
+				}
+			}
+		}
+	}
+}
+#endif
+
+// 実行中のCPUで使える最も速い実装を選ぶ
+BlitFunction selectBlitFunction()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx")) {
+		return blitTilesAvx;
+	}
+#endif
+	return blitTiles<float>;
+}
+
+}  // namespace
+
+SokobanEnv::Board::Board(const Observation& obs)
+{
+	for (int y = 0; y < ROOM_HEIGHT; ++y) {
+		for (int x = 0; x < ROOM_WIDTH; ++x) {
+			const auto index = y * ROOM_WIDTH + x;
+			switch (obs[y][x]) {
+			case CellState::EMPTY:
+				break;
+			case CellState::WALL:
+				m_walls |= bit(index);
+				break;
+			case CellState::PLAYER:
+				m_player = m_player < 0 ? index : m_player;
+				break;
+			case CellState::BOX:
+				m_boxes |= bit(index);
+				break;
+			case CellState::TARGET:
+				m_targets |= bit(index);
+				break;
+			case CellState::PLAYER_TARGET:
+				m_player = m_player < 0 ? index : m_player;
+				m_targets |= bit(index);
+				break;
+			case CellState::BOX_TARGET:
+				m_boxes |= bit(index);
+				m_targets |= bit(index);
+				break;
+			}
+		}
+	}
+	m_boxes_off_target = __builtin_popcountll(m_boxes & ~m_targets);
+}
+
+SokobanEnv::Board::Board(const PackedProblem& problem)
+    : m_walls{problem.walls}, m_boxes{problem.boxes}, m_targets{problem.targets}, m_player{problem.player}, m_boxes_off_target{__builtin_popcountll(problem.boxes & ~problem.targets)}
+{
+	assert(problem.isValid());
+}
+
+SokobanEnv::PackedProblem SokobanEnv::Board::pack() const
+{
+	return PackedProblem{m_walls, m_boxes, m_targets, m_player, 0};
+}
+
+SokobanEnv::Observation SokobanEnv::Board::toObservation() const
+{
+	Observation obs;
+	writeObservation(obs);
+	return obs;
+}
+
+namespace
+{
+
+// 8ビットの各ビットを、uint64の対応するバイトの0か1にしたもの
+constexpr std::array<std::uint64_t, 256> makeByteSpreadTable()
+{
+	std::array<std::uint64_t, 256> table{};
+	for (std::size_t value = 0; value < table.size(); ++value) {
+		for (std::size_t i = 0; i < 8; ++i) {
+			if ((value >> i) & 1) {
+				table[value] |= std::uint64_t{1} << (8 * i);
+			}
+		}
+	}
+	return table;
+}
+
+constexpr std::array<std::uint64_t, 256> byte_spread_table = makeByteSpreadTable();
+
+}  // namespace
+
+// 1行(8セル)ずつ、各バイトにセルの状態を並べたuint64を作る
+// 壁は箱・目標と重ならないため、WALL(1) + 3 * BOX + 4 * TARGET - BOX * TARGET が桁上がりせずにセルの状態になる
+void SokobanEnv::Board::writeObservation(Observation& obs) const
+{
+	static_assert(ROOM_WIDTH == 8 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+	static_assert(static_cast<int>(CellState::WALL) == 1 && static_cast<int>(CellState::BOX) == 3 && static_cast<int>(CellState::TARGET) == 4 && static_cast<int>(CellState::BOX_TARGET) == 6);
+	std::array<std::uint8_t, ROOM_WIDTH * ROOM_HEIGHT> cells;
+	for (int y = 0; y < ROOM_HEIGHT; ++y) {
+		const auto shift = y * ROOM_WIDTH;
+		const auto walls = byte_spread_table[(m_walls >> shift) & 0xff];
+		const auto boxes = byte_spread_table[(m_boxes >> shift) & 0xff];
+		const auto targets = byte_spread_table[(m_targets >> shift) & 0xff];
+		const auto row = walls + 3 * boxes + 4 * targets - (boxes & targets);
+		std::memcpy(cells.data() + shift, &row, sizeof(row));
+	}
+	if (m_player >= 0) {
+		cells[static_cast<std::size_t>(m_player)] = static_cast<std::uint8_t>((m_targets & bit(m_player)) != 0 ? CellState::PLAYER_TARGET : CellState::PLAYER);
+	}
+	static_assert(sizeof(CellState) == sizeof(std::uint8_t));
+	std::memcpy(obs.data(), cells.data(), cells.size());
+}
+
+std::tuple<SokobanEnv::Reward, EnvState> SokobanEnv::Board::step(Action action)
+{
+	if (m_player < 0) {
 		std::cerr << "cannot found player" << std::endl;
 		std::terminate();
 	}
@@ -289,133 +502,312 @@ std::tuple<SokobanEnv::Observation, SokobanEnv::Reward, EnvState> SokobanEnv::st
 		diff_x = 0;
 		diff_y = 0;
 	}
-	float reward = -0.1f;
-	if (player_x + diff_x < 0 || player_x + diff_x >= ROOM_WIDTH || player_y + diff_y < 0 || player_y + diff_y >= ROOM_HEIGHT) {
-		return std::make_tuple(m_states.clone(), reward, EnvState::RUNNING);
-	}
-	auto& player_cell = m_states[player_y][player_x];
-	auto& target = m_states[player_y + diff_y][player_x + diff_x];
-	if (target == CellState::EMPTY) {
-		if (player_cell == CellState::PLAYER_TARGET) {
-			player_cell = CellState::TARGET;
-		} else {
-			player_cell = CellState::EMPTY;
+	auto inside = [](int x, int y) {
+		return 0 <= x && x < ROOM_WIDTH && 0 <= y && y < ROOM_HEIGHT;
+	};
+	const int player_x = m_player % ROOM_WIDTH;
+	const int player_y = m_player / ROOM_WIDTH;
+	const int offset = diff_y * ROOM_WIDTH + diff_x;
+	Reward reward = -0.1f;
+	// 部屋の外へは動けず、終了判定も行わない
+	if (!inside(player_x + diff_x, player_y + diff_y)) {
+		return std::make_tuple(reward, EnvState::RUNNING);
+	}
+	const auto next = m_player + offset;
+	if ((m_walls & bit(next)) != 0) {
+		// 壁には動けない
+	} else if ((m_boxes & bit(next)) == 0) {
+		m_player = next;
+	} else {
+		if (!inside(player_x + diff_x * 2, player_y + diff_y * 2)) {
+			return std::make_tuple(reward, EnvState::RUNNING);
 		}
-		target = CellState::PLAYER;
-	} else if (target == CellState::TARGET) {
-		if (player_cell == CellState::PLAYER_TARGET) {
-			player_cell = CellState::TARGET;
-		} else {
-			player_cell = CellState::EMPTY;
+		const auto beyond = next + offset;
+		if (((m_walls | m_boxes) & bit(beyond)) == 0) {
+			m_boxes ^= bit(next) | bit(beyond);
+			m_player = next;
+			// 箱が目標から外れた場合は-1、目標に乗った場合は+1
+			const int on_target_diff = static_cast<int>((m_targets >> beyond) & 1) - static_cast<int>((m_targets >> next) & 1);
+			m_boxes_off_target -= on_target_diff;
+			if (on_target_diff != 0) {
+				reward += static_cast<Reward>(on_target_diff);
+			}
 		}
-		target = CellState::PLAYER_TARGET;
-	} else if (target == CellState::BOX) {
-		if (player_x + diff_x * 2 < 0 || player_x + diff_x * 2 >= ROOM_WIDTH || player_y + diff_y * 2 < 0 || player_y + diff_y * 2 >= ROOM_HEIGHT) {
-			return std::make_tuple(m_states.clone(), reward, EnvState::RUNNING);
+	}
+	const bool done = m_boxes_off_target == 0;
+	if (done) {
+		reward += 10.0f;
+	}
+	return std::make_tuple(reward, done ? EnvState::FINISHED : EnvState::RUNNING);
+}
+
+std::uint64_t SokobanEnv::Board::stateHash() const noexcept
+{
+	auto hash = (m_boxes * 0x9e3779b97f4a7c15ull) ^ static_cast<std::uint64_t>(m_player + 1);
+	hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdull;
+	hash = (hash ^ (hash >> 33)) * 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash != 0 ? hash : 1;
+}
+
+bool SokobanEnv::Board::isFrozenOffTarget(int cell) const
+{
+	std::uint64_t frozen_boxes = 0;
+	return isFrozen(cell, 0, frozen_boxes) && (frozen_boxes & ~m_targets) != 0;
+}
+
+// 箱は反対側にプレイヤーが立てる向きにしか押せないため、目標から逆向きに箱を引いて届く床だけが生きている
+std::uint64_t SokobanEnv::Board::computeDeadSquares(std::uint64_t walls, std::uint64_t targets) noexcept
+{
+	static_assert(ROOM_WIDTH == 8 && ROOM_HEIGHT == 8);
+	constexpr std::uint64_t COLUMN_0 = 0x0101010101010101ull;
+	constexpr std::uint64_t COLUMN_7 = COLUMN_0 << 7;
+	// 各セルを(dx, dy)だけ動かす. 盤面の外に出たものは消える
+	auto shift = [](std::uint64_t mask, int dx, int dy) {
+		if (dx > 0) {
+			mask = (mask & ~COLUMN_7) << 1;
+		} else if (dx < 0) {
+			mask = (mask & ~COLUMN_0) >> 1;
 		}
-		auto& target_next = m_states[player_y + diff_y * 2][player_x + diff_x * 2];
-		if (target_next == CellState::EMPTY) {
-			target_next = CellState::BOX;
-			target = CellState::PLAYER;
-			if (player_cell == CellState::PLAYER_TARGET) {
-				player_cell = CellState::TARGET;
-			} else {
-				player_cell = CellState::EMPTY;
-			}
-		} else if (target_next == CellState::TARGET) {
-			target_next = CellState::BOX_TARGET;
-			target = CellState::PLAYER;
-			if (player_cell == CellState::PLAYER_TARGET) {
-				player_cell = CellState::TARGET;
-			} else {
-				player_cell = CellState::EMPTY;
-			}
-			reward += 1.0f;
+		if (dy > 0) {
+			mask <<= ROOM_WIDTH;
+		} else if (dy < 0) {
+			mask >>= ROOM_WIDTH;
 		}
-	} else if (target == CellState::BOX_TARGET) {
-		if (player_x + diff_x * 2 < 0 || player_x + diff_x * 2 >= ROOM_WIDTH || player_y + diff_y * 2 < 0 || player_y + diff_y * 2 >= ROOM_HEIGHT) {
-			return std::make_tuple(m_states.clone(), reward, EnvState::RUNNING);
+		return mask;
+	};
+	const auto floor = ~walls;
+	auto live = targets & floor;
+	while (true) {
+		auto next = live;
+		for (auto [dx, dy] : {std::pair{1, 0}, std::pair{-1, 0}, std::pair{0, 1}, std::pair{0, -1}}) {
+			// (dx, dy)に押すと生きている床に運べ、押すためにプレイヤーが立つ(-dx, -dy)のセルが床であるセル
+			next |= shift(live, -dx, -dy) & floor & shift(floor, dx, dy);
 		}
-		auto& target_next = m_states[player_y + diff_y * 2][player_x + diff_x * 2];
-		if (target_next == CellState::EMPTY) {
-			target_next = CellState::BOX;
-			target = CellState::PLAYER_TARGET;
-			if (player_cell == CellState::PLAYER_TARGET) {
-				player_cell = CellState::TARGET;
-			} else {
-				player_cell = CellState::EMPTY;
-			}
-			reward -= 1.0f;
-		} else if (target_next == CellState::TARGET) {
-			target_next = CellState::BOX_TARGET;
-			target = CellState::PLAYER_TARGET;
-			if (player_cell == CellState::PLAYER_TARGET) {
-				player_cell = CellState::TARGET;
-			} else {
-				player_cell = CellState::EMPTY;
-			}
+		if (next == live) {
+			return floor & ~live;
 		}
+		live = next;
 	}
-	bool done = [&]() -> bool {
-		for (int y = 0; y < ROOM_HEIGHT; ++y) {
-			for (int x = 0; x < ROOM_WIDTH; ++x) {
-				if (m_states[y][x] == CellState::BOX) {
-					return false;
-				}
-			}
-		}
+}
+
+bool SokobanEnv::Board::isBlockedAlong(int cell, int axis, std::uint64_t blockers, std::uint64_t& frozen_boxes) const
+{
+	const int dx = axis == 0 ? 1 : 0;
+	const int dy = axis == 0 ? 0 : 1;
+	const int x = cell % ROOM_WIDTH;
+	const int y = cell / ROOM_WIDTH;
+	auto solid = [&](int cx, int cy) {
+		return cx < 0 || ROOM_WIDTH <= cx || cy < 0 || ROOM_HEIGHT <= cy || ((m_walls | blockers) & bit(cy * ROOM_WIDTH + cx)) != 0;
+	};
+	if (solid(x - dx, y - dy) || solid(x + dx, y + dy)) {
+		return true;
+	}
+	const int before = cell - (dy * ROOM_WIDTH + dx);
+	const int after = cell + (dy * ROOM_WIDTH + dx);
+	// どちらに押しても箱が死んだ床に入る
+	if ((m_dead_squares & bit(before)) != 0 && (m_dead_squares & bit(after)) != 0) {
 		return true;
-	}();
-	if (done) {
-		reward += 10.0f;
 	}
-	return std::make_tuple(m_states.clone(), reward, done ? EnvState::FINISHED : EnvState::RUNNING);
+	// 隣の箱が動かせなければ、この箱もこの向きには動かせない. 循環しないよう、この箱は壁とみなす
+	blockers |= bit(cell);
+	return ((m_boxes & bit(before)) != 0 && isFrozen(before, blockers, frozen_boxes))
+	       || ((m_boxes & bit(after)) != 0 && isFrozen(after, blockers, frozen_boxes));
 }
 
+bool SokobanEnv::Board::isFrozen(int cell, std::uint64_t blockers, std::uint64_t& frozen_boxes) const
+{
+	const auto saved = frozen_boxes;
+	if (isBlockedAlong(cell, 0, blockers, frozen_boxes) && isBlockedAlong(cell, 1, blockers, frozen_boxes)) {
+		frozen_boxes |= bit(cell);
+		return true;
+	}
+	frozen_boxes = saved;
+	return false;
+}
 
-void SokobanEnv::writeData(const Observation& obs, TensorRef<float, 3, IMAGE_HEIGHT, IMAGE_WIDTH>& dest)
+std::tuple<SokobanEnv::Observation, SokobanEnv::Reward, EnvState> SokobanEnv::step(const Action& action)
 {
-	auto copy_image = [&](int x, int y, CellState state) {
-		auto& image = sokoban_image::images[static_cast<std::size_t>(state)];
-		for (int dy = 0; dy < 8; ++dy) {
-			for (int dx = 0; dx < 8; ++dx) {
-				dest[0][y * 8 + dy][x * 8 + dx] = image[0][dy][dx];
-			}
+	auto [reward, state] = stepBoard(action);
+	return std::make_tuple(m_board.toObservation(), reward, state);
+}
+
+std::tuple<SokobanEnv::Reward, EnvState> SokobanEnv::stepBoard(Action action)
+{
+	const auto boxes = m_board.boxes();
+	auto [reward, state] = m_board.step(action);
+	if (state == EnvState::FINISHED) {
+		return std::make_tuple(reward, state);
+	}
+	bool hopeless = false;
+	if (const auto pushed = m_board.boxes() & ~boxes; pushed != 0) {
+		hopeless = (m_early_termination.dead_squares && m_board.hasBoxOnDeadSquare())
+		           || (m_early_termination.freeze_deadlocks && m_board.isFrozenOffTarget(__builtin_ctzll(pushed)));
+	}
+	if (m_early_termination.state_cycles) {
+		// 壁に当たって動けなかった場合は状態が変わらないため、巡回とみなさない. 直前の状態に引き返した場合は巡回とする
+		if (const auto hash = m_board.stateHash(); hash != m_current_state) {
+			hopeless = !insertVisitedState(hash) || hopeless;
+			m_current_state = hash;
 		}
-		for (int dy = 0; dy < 8; ++dy) {
-			for (int dx = 0; dx < 8; ++dx) {
-				dest[1][y * 8 + dy][x * 8 + dx] = image[1][dy][dx];
+	}
+	if (hopeless) {
+		return std::make_tuple(reward - m_early_termination.penalty, EnvState::FINISHED);
+	}
+	return std::make_tuple(reward, state);
+}
+
+bool SokobanEnv::insertVisitedState(std::uint64_t hash)
+{
+	// 使用率が1/2を超える前に倍の大きさにして入れ直す
+	if ((m_num_visited_states + 1) * 2 > m_visited_states.size()) {
+		std::vector<std::uint64_t> old(std::max<std::size_t>(m_visited_states.size() * 2, 256), 0);
+		old.swap(m_visited_states);
+		m_num_visited_states = 0;
+		for (auto h : old) {
+			if (h != 0) {
+				insertVisitedState(h);
 			}
 		}
-		for (int dy = 0; dy < 8; ++dy) {
-			for (int dx = 0; dx < 8; ++dx) {
-				dest[2][y * 8 + dy][x * 8 + dx] = image[2][dy][dx];
-			}
+	}
+	const auto mask = m_visited_states.size() - 1;
+	for (auto i = static_cast<std::size_t>(hash) & mask;; i = (i + 1) & mask) {
+		if (m_visited_states[i] == hash) {
+			return false;
 		}
-	};
-	for (int x = 0; x < ROOM_WIDTH + BORDER_WIDTH * 2; ++x) {
-		for (int b = 0; b < BORDER_WIDTH; ++b) {
-			copy_image(x, b, CellState::WALL);
-			copy_image(x, ROOM_HEIGHT + BORDER_WIDTH + b, CellState::WALL);
+		if (m_visited_states[i] == 0) {
+			m_visited_states[i] = hash;
+			++m_num_visited_states;
+			return true;
 		}
 	}
-	for (int y = BORDER_WIDTH; y < ROOM_HEIGHT + BORDER_WIDTH; ++y) {
-		for (int b = 0; b < BORDER_WIDTH; ++b) {
-			copy_image(b, y, CellState::WALL);
-			copy_image(ROOM_WIDTH + BORDER_WIDTH + b, y, CellState::WALL);
+}
+
+
+void SokobanEnv::writeData(const Observation& obs, TensorRef<float, 3, IMAGE_HEIGHT, IMAGE_WIDTH>& dest)
+{
+	static const BlitFunction blit = selectBlitFunction();
+	blit(makeTileCodes(obs), dest.data());
+}
+
+// タイルの1行が8バイトなので、memcpyは1回のロードとストアになる
+void SokobanQuantizedEnv::writeData(const Observation& obs, TensorRef<std::uint8_t, 3, IMAGE_HEIGHT, IMAGE_WIDTH>& dest)
+{
+	blitTiles(makeTileCodes(obs), dest.data());
+}
+
+namespace
+{
+
+// mmapした問題集. プロセスの終了時か、別の問題集を読み込んだ時に解放する
+struct ProblemFileMapping
+{
+	void* address = nullptr;
+	std::size_t size = 0;
+
+	~ProblemFileMapping()
+	{
+		reset();
+	}
+	void reset() noexcept
+	{
+		if (address != nullptr) {
+			::munmap(address, size);
+			address = nullptr;
+			size = 0;
 		}
 	}
-	for (int y = 0; y < ROOM_HEIGHT; ++y) {
-		for (int x = 0; x < ROOM_WIDTH; ++x) {
-			copy_image(x + BORDER_WIDTH, y + BORDER_WIDTH, obs[y][x]);
+};
+
+ProblemFileMapping problem_file_mapping;
+
+// バイナリ形式はメモリ上の表現をそのまま読み書きする
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+}  // namespace
+
+void SokobanEnv::loadProblems()
+{
+	constexpr const char* BINARY_PATH = "./sokoban_problems.bin";
+	if (::access(BINARY_PATH, F_OK) == 0) {
+		mapProblemFile(BINARY_PATH);
+		std::cout << "load " << m_num_problems << " problems from " << BINARY_PATH << std::endl;
+		return;
+	}
+	constexpr const char* TEXT_PATH = "./sokoban_problems.txt";
+	std::ifstream in{TEXT_PATH};
+	if (!in) {
+		std::cerr << "cannot open problem file : " << TEXT_PATH << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	m_parsed_problems = parseProblemText(in, TEXT_PATH);
+	if (m_parsed_problems.empty()) {
+		std::cerr << "no problems in problem file : " << TEXT_PATH << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	problem_file_mapping.reset();
+	m_problems = m_parsed_problems.data();
+	m_num_problems = m_parsed_problems.size();
+	std::cout << "load " << m_num_problems << " problems" << std::endl;
+}
+
+void SokobanEnv::mapProblemFile(const char* path)
+{
+	auto fail = [&](const char* message) {
+		std::cerr << message << " : " << path << std::endl;
+		std::exit(EXIT_FAILURE);
+	};
+	const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fail("cannot open problem file");
+	}
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(ProblemFileHeader)) {
+		::close(fd);
+		fail("invalid problem file");
+	}
+	const auto size = static_cast<std::size_t>(st.st_size);
+	// 複数のプロセスが同じファイルを読み取り専用で共有するため、問題はページキャッシュに1つだけ載る
+	void* address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED) {
+		fail("cannot map problem file");
+	}
+	ProblemFileHeader header;
+	std::memcpy(&header, address, sizeof(header));
+	if (header.magic != ProblemFileHeader::MAGIC || header.version != ProblemFileHeader::VERSION || header.record_size != sizeof(PackedProblem)
+	    || header.room_width != ROOM_WIDTH || header.room_height != ROOM_HEIGHT
+	    || header.count == 0 || (size - sizeof(ProblemFileHeader)) % sizeof(PackedProblem) != 0
+	    || header.count != (size - sizeof(ProblemFileHeader)) / sizeof(PackedProblem)) {
+		::munmap(address, size);
+		fail("invalid problem file");
+	}
+	// 壊れた問題で範囲外のシフトや書き込みをしないよう、全ての問題を読み込む前に検査する
+	const auto* problems = reinterpret_cast<const PackedProblem*>(static_cast<const std::byte*>(address) + sizeof(ProblemFileHeader));
+	for (std::uint64_t i = 0; i < header.count; ++i) {
+		if (!problems[i].isValid()) {
+			::munmap(address, size);
+			std::cerr << "invalid problem #" << i << " in problem file : " << path << std::endl;
+			std::exit(EXIT_FAILURE);
 		}
 	}
+	// 問題はランダムに選ばれるため、先読みしない
+	::madvise(address, size, MADV_RANDOM);
+	problem_file_mapping.reset();
+	problem_file_mapping.address = address;
+	problem_file_mapping.size = size;
+	m_parsed_problems = std::vector<PackedProblem>{};
+	m_problems = problems;
+	m_num_problems = static_cast<std::size_t>(header.count);
 }
 
-void SokobanEnv::loadProblems()
+std::vector<SokobanEnv::PackedProblem> SokobanEnv::parseProblemText(std::istream& in, const char* name)
 {
-	m_problems.clear();
-	std::ifstream in{"./sokoban_problems.txt"};
+	std::vector<PackedProblem> problems;
+	auto fail = [&](const char* message) {
+		std::cerr << message << " #" << problems.size() << " in problem file : " << name << std::endl;
+		std::exit(EXIT_FAILURE);
+	};
 	[&] {
 		while (in) {
 			Observation obs;
@@ -424,20 +816,90 @@ void SokobanEnv::loadProblems()
 					int data;
 					in >> data;
 					if (!in) {
+						// 問題の区切りでファイルが終わった場合のみ正常. 問題の途中で終わった場合や数値でない場合は壊れている
+						if (!in.eof() || x != 0 || y != 0) {
+							fail("truncated problem");
+						}
 						return;
 					}
-					assert(0 <= data && data < 7);
+					if (data < 0 || data >= 7) {
+						fail("invalid cell in problem");
+					}
 					obs[y][x] = static_cast<CellState>(data);
 				}
 			}
-			m_problems.emplace_back(std::move(obs));
+			// mapProblemFileと同じ検査. 壊れた問題はBoardの範囲外のシフトや書き込みになる
+			const auto problem = Board{obs}.pack();
+			if (!problem.isValid()) {
+				fail("invalid problem");
+			}
+			problems.emplace_back(problem);
 		}
 	}();
-	m_problems.shrink_to_fit();
-	std::cout << "load " << m_problems.size() << " problems" << std::endl;
+	problems.shrink_to_fit();
+	return problems;
+}
+
+void SokobanEnv::writeProblemFile(std::ostream& out, const std::vector<PackedProblem>& problems)
+{
+	ProblemFileHeader header{ProblemFileHeader::MAGIC, ProblemFileHeader::VERSION, sizeof(PackedProblem), ROOM_WIDTH, ROOM_HEIGHT, problems.size()};
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(problems.data()), static_cast<std::streamsize>(problems.size() * sizeof(PackedProblem)));
+}
+
+void SokobanEnv::startLevelGenerator(std::size_t num_threads, std::size_t capacity, std::size_t num_boxes, std::size_t difficulty, std::optional<std::uint64_t> seed)
+{
+	if (num_boxes == 0 || num_boxes > SokobanLevelGenerator::MAX_BOXES || difficulty == 0) {
+		std::cerr << "level generator supports 1 to " << SokobanLevelGenerator::MAX_BOXES << " boxes and difficulty >= 1" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	const auto base_seed = seed.has_value() ? seed.value() : (std::uint64_t{std::random_device{}()} << 32 | std::random_device{}());
+	m_level_supply.reset();
+	m_level_supply = std::make_unique<SokobanLevelSupply>(SokobanLevelGenerator{num_boxes, difficulty}, base_seed, num_threads, capacity);
+	std::cout << "generate problems with " << num_boxes << " boxes , difficulty " << difficulty << " , seed " << base_seed << std::endl;
+}
+
+void SokobanEnv::configure(const SokobanEnvConfig& config, std::size_t level_capacity)
+{
+	if (config.level_generator_threads > 0) {
+		startLevelGenerator(config.level_generator_threads, level_capacity, config.level_generator_boxes, config.level_generator_difficulty, config.level_generator_seed);
+	} else {
+		loadProblems();
+	}
+	setEarlyTermination({config.terminate_on_dead_squares, config.terminate_on_freeze_deadlocks, config.terminate_on_state_cycles, static_cast<Reward>(config.early_termination_penalty)});
+}
+
+std::size_t SokobanEnv::levelGeneratorMisses()
+{
+	return m_level_supply != nullptr ? m_level_supply->numMisses() : 0;
+}
+
+void SokobanEnv::resetBoard()
+{
+	if (m_level_supply != nullptr) {
+		m_board = Board{m_level_supply->next()};
+	} else {
+		assert(m_num_problems > 0);
+		auto index = std::uniform_int_distribution<std::size_t>{0, m_num_problems - 1}(m_random_engine);
+		m_board = Board{m_problems[index]};
+	}
+	// 打ち切りの判定に使う場合のみ、エピソードの開始時に求める
+	if (m_early_termination.dead_squares || m_early_termination.freeze_deadlocks) {
+		m_board.findDeadSquares();
+	}
+	if (m_early_termination.state_cycles) {
+		std::fill(m_visited_states.begin(), m_visited_states.end(), 0);
+		m_num_visited_states = 0;
+		m_current_state = m_board.stateHash();
+		insertVisitedState(m_current_state);
+	}
 }
 
-std::vector<SokobanEnv::Observation> SokobanEnv::m_problems;
+const SokobanEnv::PackedProblem* SokobanEnv::m_problems = nullptr;
+std::size_t SokobanEnv::m_num_problems = 0;
+std::vector<SokobanEnv::PackedProblem> SokobanEnv::m_parsed_problems;
+std::unique_ptr<SokobanLevelSupply> SokobanEnv::m_level_supply;
+SokobanEnv::EarlyTermination SokobanEnv::m_early_termination;
 
 
 }  // namespace impala
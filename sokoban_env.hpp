@@ -1,20 +1,31 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <cstdint>
 #include <functional>
+#include <istream>
+#include <iterator>
+#include <memory>
 #include <optional>
+#include <ostream>
 #include <random>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include "action.hpp"
+#include "config.hpp"
 #include "environment.hpp"
-#include "python_util.hpp"
 #include "tensor.hpp"
 
 namespace impala
 {
 
+class SokobanLevelSupply;
+struct SokobanEnvConfig;
+
 class SokobanEnv
 {
 public:
@@ -35,55 +46,378 @@ public:
 	static constexpr int IMAGE_WIDTH = 8 * (ROOM_WIDTH + BORDER_WIDTH * 2);
 	static constexpr int IMAGE_HEIGHT = 8 * (ROOM_HEIGHT + BORDER_WIDTH * 2);
 
-	using Observation = Tensor<CellState, ROOM_HEIGHT, ROOM_WIDTH>;
-	using ObsBatch = std::vector<float>;
+	using Observation = InlineTensor<CellState, ROOM_HEIGHT, ROOM_WIDTH>;
+	using BatchTraits = TensorBatchTraits<float, 3, IMAGE_HEIGHT, IMAGE_WIDTH>;
+	using ObsBatch = BatchTraits::Buffer;
 	using Reward = float;
 	using Action = FourDirections;
 
+	// 問題集のバイナリ形式(sokoban_problems.bin)の1問. Boardのビットマスクをそのまま持つ
+	struct PackedProblem
+	{
+		std::uint64_t walls;
+		std::uint64_t boxes;
+		std::uint64_t targets;
+		// プレイヤーのいるセル. いない場合は-1
+		std::int32_t player;
+		std::uint32_t reserved;
+
+		// プレイヤーが盤面内の壁や箱のないセルにいて、壁が箱や目標と重ならず、箱と目標の数が等しい
+		bool isValid() const noexcept
+		{
+			static_assert(ROOM_WIDTH * ROOM_HEIGHT == 64);
+			if (player != -1 && (player < 0 || player >= ROOM_WIDTH * ROOM_HEIGHT || (((walls | boxes) >> player) & 1) != 0)) {
+				return false;
+			}
+			return (walls & (boxes | targets)) == 0 && __builtin_popcountll(boxes) == __builtin_popcountll(targets);
+		}
+	};
+	static_assert(sizeof(PackedProblem) == 32 && std::is_trivially_copyable_v<PackedProblem>);
+
+	// バイナリ形式の先頭. この後にcount個のPackedProblemが隙間なく並ぶ. 値は全てリトルエンディアン
+	struct ProblemFileHeader
+	{
+		static inline constexpr std::array<char, 8> MAGIC = {'S', 'O', 'K', 'O', 'P', 'R', 'O', 'B'};
+		static inline constexpr std::uint32_t VERSION = 1;
+
+		std::array<char, 8> magic;
+		std::uint32_t version;
+		std::uint32_t record_size;
+		std::uint32_t room_width;
+		std::uint32_t room_height;
+		std::uint64_t count;
+	};
+	static_assert(sizeof(ProblemFileHeader) == 32 && std::is_trivially_copyable_v<ProblemFileHeader>);
+
+	// 壁・箱・目標の位置をビットマスクで持つ盤面. ビット y * ROOM_WIDTH + x が(x, y)のセルに対応する
+	// 目標に乗っていない箱の数を保持するため、行動と終了判定はセルを走査せずに行える
+	class Board
+	{
+	public:
+		static_assert(ROOM_WIDTH * ROOM_HEIGHT <= 64);
+
+		Board() = default;
+		explicit Board(const Observation& obs);
+		explicit Board(const PackedProblem& problem);
+
+		PackedProblem pack() const;
+
+		Observation toObservation() const;
+		void writeObservation(Observation& obs) const;
+		// 行動を適用し、報酬と終了したかを返す
+		std::tuple<Reward, EnvState> step(Action action);
+
+		std::uint64_t boxes() const noexcept
+		{
+			return m_boxes;
+		}
+		// 箱とプレイヤーの位置から求める0以外の値
+		std::uint64_t stateHash() const noexcept;
+		// 箱を置くと解けなくなる床を求める. hasBoxOnDeadSquareとisFrozenOffTargetの前に呼ぶこと
+		void findDeadSquares() noexcept
+		{
+			m_dead_squares = computeDeadSquares(m_walls, m_targets);
+		}
+		// どの目標にも押して運べないセルに箱があるか
+		bool hasBoxOnDeadSquare() const noexcept
+		{
+			return (m_boxes & m_dead_squares) != 0;
+		}
+		// cellの箱が縦横どちらにも動かせなくなり、それによって動かせない箱のいずれかが目標に乗っていないか
+		bool isFrozenOffTarget(int cell) const;
+
+	private:
+		static std::uint64_t bit(int index) noexcept
+		{
+			return std::uint64_t{1} << index;
+		}
+		static std::uint64_t computeDeadSquares(std::uint64_t walls, std::uint64_t targets) noexcept;
+		// cellの箱がaxis(0: 横, 1: 縦)の向きに動かせないか. blockersのセルは壁とみなす
+		bool isBlockedAlong(int cell, int axis, std::uint64_t blockers, std::uint64_t& frozen_boxes) const;
+		// cellの箱が動かせないか. 動かせない場合はcellと、その理由になった箱をfrozen_boxesに加える
+		bool isFrozen(int cell, std::uint64_t blockers, std::uint64_t& frozen_boxes) const;
+
+		std::uint64_t m_walls = 0;
+		std::uint64_t m_boxes = 0;
+		std::uint64_t m_targets = 0;
+		// 箱を置くと解けなくなる床. findDeadSquaresを呼ぶまでは空
+		std::uint64_t m_dead_squares = 0;
+		// プレイヤーのいるセル. いない場合は-1
+		int m_player = -1;
+		int m_boxes_off_target = 0;
+	};
+
+	// 解けなくなった状態でエピソードを打ち切る条件. 打ち切ったステップの報酬からpenaltyを引く
+	struct EarlyTermination
+	{
+		// 箱がどの目標にも運べないセルに入った
+		bool dead_squares = false;
+		// 押した箱が、壁や他の箱に挟まれて目標の外で動かせなくなった
+		bool freeze_deadlocks = false;
+		// エピソード中に同じ状態(箱とプレイヤーの位置)に戻った. 壁などで動けなかった場合は除く
+		bool state_cycles = false;
+		Reward penalty = 0.0f;
+	};
+
 	SokobanEnv() : m_random_engine{std::random_device{}()} {}
 
 	Observation reset()
 	{
-		auto index = std::uniform_int_distribution<std::size_t>{0, m_problems.size() - 1}(m_random_engine);
-		m_states = m_problems.at(index).clone();
-		return m_states.clone();
+		resetBoard();
+		return m_board.toObservation();
 	}
 	std::tuple<Observation, Reward, EnvState> step(const Action& action);
+	// 観測を新たに確保せず、呼び出し側のobsに書き込む
+	void reset(Observation& obs)
+	{
+		resetBoard();
+		m_board.writeObservation(obs);
+	}
+	std::tuple<Reward, EnvState> step(const Action& action, Observation& next_obs)
+	{
+		auto result = stepBoard(action);
+		m_board.writeObservation(next_obs);
+		return result;
+	}
 	void render() const {}
 
-	template <class ForwardIterator,
-	    std::enable_if_t<
-	        std::conjunction_v<
-	            std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>,
-	            std::disjunction<
-	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const Observation&>,
-	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const std::optional<Observation>&>>>,
-	        std::nullptr_t> = nullptr>
+	// Observation, Observationへのポインタ, std::optional<Observation> のいずれかを指すForwardIterator
+	template <class ForwardIterator>
+	using EnableIfObservationIterator = std::enable_if_t<
+	    std::conjunction_v<
+	        std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>,
+	        std::disjunction<
+	            std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const Observation&>,
+	            std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const Observation*>,
+	            std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const std::optional<Observation>&>>>,
+	    std::nullptr_t>;
+
+	template <class ForwardIterator, EnableIfObservationIterator<ForwardIterator> = nullptr>
 	static ObsBatch makeBatch(ForwardIterator first, ForwardIterator last)
 	{
-		return NdArrayTraits<float, 3, IMAGE_HEIGHT, IMAGE_WIDTH>::makeBufferForBatch(first, last, [](const auto& obs, auto& dest) {
-			if constexpr (std::is_convertible_v<decltype(obs), const Observation&>) {
-				writeData(obs, dest);
-			} else {
-				const std::optional<Observation>& opt = obs;
-				if (opt.has_value()) {
-					writeData(opt.value(), dest);
-				}
-			}
+		return BatchTraits::makeBufferForBatch(first, last, [](const auto& obs, auto& dest) {
+			writeBatchElement(obs, dest);
+		});
+	}
+	// destの領域を再利用する. nullptrやnulloptの位置は0で埋める
+	template <class ForwardIterator, EnableIfObservationIterator<ForwardIterator> = nullptr>
+	static void makeBatch(ForwardIterator first, ForwardIterator last, ObsBatch& dest)
+	{
+		BatchTraits::writeBufferForBatch(first, last, dest, [](const auto& obs, auto& ref) {
+			writeBatchElement(obs, ref);
 		});
 	}
 
+	// ./sokoban_problems.bin があればmmapし、なければ ./sokoban_problems.txt を読み込む
 	static void loadProblems();
+	// バイナリ形式の問題集を読み取り専用でmmapする. reset()はページキャッシュ上の問題を直接参照する
+	static void mapProblemFile(const char* path);
+	// テキスト形式(1問につき64個のCellStateの値を空白区切りで並べたもの)を読み込む
+	// 不正な値や不整合な問題があれば、nameと問題の番号を表示して終了する
+	static std::vector<PackedProblem> parseProblemText(std::istream& in, const char* name);
+	static void writeProblemFile(std::ostream& out, const std::vector<PackedProblem>& problems);
+	// 問題集の代わりに、num_threadsのスレッドで生成した問題をreset()で使う(sokoban_level_generator.hpp)
+	// 生成済みの問題はcapacity個まで蓄える. seedを指定しない場合はランダムに決める
+	static void startLevelGenerator(std::size_t num_threads, std::size_t capacity, std::size_t num_boxes, std::size_t difficulty, std::optional<std::uint64_t> seed);
+	// 生成が間に合わず、reset()を呼んだスレッドで生成した回数
+	static std::size_t levelGeneratorMisses();
+	// 全てのSokobanEnvに適用する. エージェントを作る前に呼ぶこと
+	static void setEarlyTermination(const EarlyTermination& early_termination)
+	{
+		m_early_termination = early_termination;
+	}
+	// configに従って問題集の読み込みか問題の生成を始め、打ち切りの条件を設定する. エージェントを作る前に呼ぶこと
+	// 生成する場合はlevel_capacity個(エージェントの数)まで蓄える
+	static void configure(const SokobanEnvConfig& config, std::size_t level_capacity);
+
+protected:
+	// バッチの要素が指す観測. nullptrやnulloptの場合はnullptr
+	template <class T>
+	static const Observation* observationPointer(const T& obs)
+	{
+		if constexpr (std::is_convertible_v<const T&, const Observation&>) {
+			return &static_cast<const Observation&>(obs);
+		} else if constexpr (std::is_convertible_v<const T&, const Observation*>) {
+			return obs;
+		} else {
+			const std::optional<Observation>& opt = obs;
+			return opt.has_value() ? &opt.value() : nullptr;
+		}
+	}
 
 private:
+	void resetBoard();
+	std::tuple<Reward, EnvState> stepBoard(Action action);
+	// 初めて訪れた状態の場合はtrueを返す
+	bool insertVisitedState(std::uint64_t hash);
+
+	template <class T>
+	static void writeBatchElement(const T& obs, TensorRef<float, 3, IMAGE_HEIGHT, IMAGE_WIDTH>& dest)
+	{
+		if (const auto* ptr = observationPointer(obs)) {
+			writeData(*ptr, dest);
+		} else {
+			std::fill_n(dest.data(), dest.sizeOfAll(), float{0});
+		}
+	}
+
 	static void writeData(const Observation& obs, TensorRef<float, 3, IMAGE_HEIGHT, IMAGE_WIDTH>& dest);
 
-	static std::vector<Observation> m_problems;
+	// mmapした問題集、またはテキストから読み込んだm_parsed_problemsを指す
+	static const PackedProblem* m_problems;
+	static std::size_t m_num_problems;
+	static std::vector<PackedProblem> m_parsed_problems;
+	// 指定された場合、問題集の代わりに使う
+	static std::unique_ptr<SokobanLevelSupply> m_level_supply;
 
-	Observation m_states;
+	static EarlyTermination m_early_termination;
+
+	Board m_board;
 	std::mt19937 m_random_engine;
+	// エピソード中に訪れた状態のハッシュ値を持つ開番地法の表. 0は空きを表す
+	std::vector<std::uint64_t> m_visited_states;
+	std::size_t m_num_visited_states = 0;
+	// 現在の状態のハッシュ値
+	std::uint64_t m_current_state = 0;
 };
 
 static_assert(IsEnvironmentV<SokobanEnv>);
+static_assert(HasInPlaceStepV<SokobanEnv>);
+static_assert(std::is_trivially_copyable_v<SokobanEnv::Observation>);
+
+// SokobanEnvの実行時設定. ServerConfigと同じく、既定値はParametersの定数から作り、設定ファイルやコマンドライン引数で上書きできる
+struct SokobanEnvConfig : ConfigFields<SokobanEnvConfig>
+{
+	// 0以外の場合、問題集を読み込む代わりに、このスレッド数で問題を生成し続ける(SokobanLevelSupply)
+	// 箱の数はlevel_generator_boxes、難しさはlevel_generator_difficultyで、同じseedからは同じ問題の列を生成する
+	std::size_t level_generator_threads;
+	std::size_t level_generator_boxes;
+	std::size_t level_generator_difficulty;
+	std::optional<std::size_t> level_generator_seed;
+
+	// 解けなくなった状態でエピソードを打ち切る条件(SokobanEnv::EarlyTermination). 打ち切ったステップの報酬からearly_termination_penaltyを引く
+	// 罰が小さいと、打ち切りで残りのステップの罰を逃れることが得になるため、最大エピソード長の分に近い値にする
+	bool terminate_on_dead_squares;
+	bool terminate_on_freeze_deadlocks;
+	bool terminate_on_state_cycles;
+	double early_termination_penalty;
+
+	template <class Parameters>
+	static SokobanEnvConfig fromParameters()
+	{
+		SokobanEnvConfig config;
+		config.level_generator_threads = Parameters::LEVEL_GENERATOR_THREADS;
+		config.level_generator_boxes = Parameters::LEVEL_GENERATOR_BOXES;
+		config.level_generator_difficulty = Parameters::LEVEL_GENERATOR_DIFFICULTY;
+		config.level_generator_seed = Parameters::LEVEL_GENERATOR_SEED;
+		config.terminate_on_dead_squares = Parameters::TERMINATE_ON_DEAD_SQUARES;
+		config.terminate_on_freeze_deadlocks = Parameters::TERMINATE_ON_FREEZE_DEADLOCKS;
+		config.terminate_on_state_cycles = Parameters::TERMINATE_ON_STATE_CYCLES;
+		config.early_termination_penalty = Parameters::EARLY_TERMINATION_PENALTY;
+		return config;
+	}
+
+	template <class Function>
+	void forEachField(Function&& f)
+	{
+		f("level_generator_threads", level_generator_threads);
+		f("level_generator_boxes", level_generator_boxes);
+		f("level_generator_difficulty", level_generator_difficulty);
+		f("level_generator_seed", level_generator_seed);
+		f("terminate_on_dead_squares", terminate_on_dead_squares);
+		f("terminate_on_freeze_deadlocks", terminate_on_freeze_deadlocks);
+		f("terminate_on_state_cycles", terminate_on_state_cycles);
+		f("early_termination_penalty", early_termination_penalty);
+	}
+
+	bool isValid() const
+	{
+		return level_generator_boxes > 0 && level_generator_difficulty > 0 && early_termination_penalty >= 0.0;
+	}
+};
+
+// 観測を描画せず、8x8のセルの値(CellState)のままバッチにするSokobanEnv
+// 描画(またはone-hotへの変換)はモデルの側で行う
+class SokobanCellEnv : public SokobanEnv
+{
+public:
+	using BatchTraits = TensorBatchTraits<std::uint8_t, ROOM_HEIGHT, ROOM_WIDTH>;
+	using ObsBatch = BatchTraits::Buffer;
+
+	template <class ForwardIterator, EnableIfObservationIterator<ForwardIterator> = nullptr>
+	static ObsBatch makeBatch(ForwardIterator first, ForwardIterator last)
+	{
+		return BatchTraits::makeBufferForBatch(first, last, [](const auto& obs, auto& dest) {
+			writeBatchElement(obs, dest);
+		});
+	}
+	// destの領域を再利用する. nullptrやnulloptの位置は0で埋める
+	template <class ForwardIterator, EnableIfObservationIterator<ForwardIterator> = nullptr>
+	static void makeBatch(ForwardIterator first, ForwardIterator last, ObsBatch& dest)
+	{
+		BatchTraits::writeBufferForBatch(first, last, dest, [](const auto& obs, auto& ref) {
+			writeBatchElement(obs, ref);
+		});
+	}
+
+private:
+	template <class T>
+	static void writeBatchElement(const T& obs, TensorRef<std::uint8_t, ROOM_HEIGHT, ROOM_WIDTH>& dest)
+	{
+		if (const auto* ptr = observationPointer(obs)) {
+			static_assert(sizeof(CellState) == sizeof(std::uint8_t));
+			std::transform(ptr->data(), ptr->data() + ptr->sizeOfAll(), dest.data(), [](CellState cell) {
+				return static_cast<std::uint8_t>(cell);
+			});
+		} else {
+			std::fill_n(dest.data(), dest.sizeOfAll(), std::uint8_t{0});
+		}
+	}
+};
+
+static_assert(IsEnvironmentV<SokobanCellEnv>);
+
+// SokobanEnvと同じ画像を、各画素をPIXEL_SCALE単位のuint8にしてバッチにするSokobanEnv
+// タイルの画素値は全て0.01の倍数なので、floatに戻すと元の画像と(floatの丸め誤差を除いて)一致する
+class SokobanQuantizedEnv : public SokobanEnv
+{
+public:
+	using BatchTraits = TensorBatchTraits<std::uint8_t, 3, IMAGE_HEIGHT, IMAGE_WIDTH>;
+	using ObsBatch = BatchTraits::Buffer;
+
+	// train.pyのPIXEL_SCALEと一致させること
+	static constexpr float PIXEL_SCALE = 0.01f;
+
+	template <class ForwardIterator, EnableIfObservationIterator<ForwardIterator> = nullptr>
+	static ObsBatch makeBatch(ForwardIterator first, ForwardIterator last)
+	{
+		return BatchTraits::makeBufferForBatch(first, last, [](const auto& obs, auto& dest) {
+			writeBatchElement(obs, dest);
+		});
+	}
+	// destの領域を再利用する. nullptrやnulloptの位置は0で埋める
+	template <class ForwardIterator, EnableIfObservationIterator<ForwardIterator> = nullptr>
+	static void makeBatch(ForwardIterator first, ForwardIterator last, ObsBatch& dest)
+	{
+		BatchTraits::writeBufferForBatch(first, last, dest, [](const auto& obs, auto& ref) {
+			writeBatchElement(obs, ref);
+		});
+	}
+
+private:
+	template <class T>
+	static void writeBatchElement(const T& obs, TensorRef<std::uint8_t, 3, IMAGE_HEIGHT, IMAGE_WIDTH>& dest)
+	{
+		if (const auto* ptr = observationPointer(obs)) {
+			writeData(*ptr, dest);
+		} else {
+			std::fill_n(dest.data(), dest.sizeOfAll(), std::uint8_t{0});
+		}
+	}
+
+	static void writeData(const Observation& obs, TensorRef<std::uint8_t, 3, IMAGE_HEIGHT, IMAGE_WIDTH>& dest);
+};
+
+static_assert(IsEnvironmentV<SokobanQuantizedEnv>);
 
 }  // namespace impala
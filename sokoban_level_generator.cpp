@@ -0,0 +1,250 @@
+#include "sokoban_level_generator.hpp"
+
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <utility>
+
+namespace impala
+{
+
+namespace
+{
+
+constexpr int ROOM_WIDTH = SokobanEnv::ROOM_WIDTH;
+constexpr int ROOM_HEIGHT = SokobanEnv::ROOM_HEIGHT;
+// 部屋の形を作るランダムウォークの歩数と、進む向きを変える確率(%)
+constexpr int ROOM_WALK_STEPS = (ROOM_WIDTH + ROOM_HEIGHT) * 3 / 2;
+constexpr int ROOM_TURN_PERCENT = 35;
+// 逆向きの移動で、後ろにある箱を引く確率(%)
+constexpr int PULL_PERCENT = 75;
+
+constexpr std::array<int, 4> DX = {0, 0, -1, 1};
+constexpr std::array<int, 4> DY = {-1, 1, 0, 0};
+
+// ランダムウォークの各位置で床にする3x3の形
+// clang-format off
+constexpr std::array<std::array<std::array<bool, 3>, 3>, 5> ROOM_MASKS = {{
+	{{{0, 0, 0}, {1, 1, 1}, {0, 0, 0}}},
+	{{{0, 1, 0}, {0, 1, 0}, {0, 1, 0}}},
+	{{{0, 0, 0}, {1, 1, 0}, {0, 1, 0}}},
+	{{{0, 0, 0}, {1, 1, 0}, {1, 1, 0}}},
+	{{{0, 0, 0}, {0, 1, 1}, {0, 1, 0}}}
+}};
+// clang-format on
+
+// 環境やスレッドによらず同じ列を返す乱数
+class SplitMix64
+{
+public:
+	explicit SplitMix64(std::uint64_t seed) noexcept : m_state{seed} {}
+
+	std::uint64_t operator()() noexcept
+	{
+		auto z = (m_state += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+	// [0, n)の整数
+	int below(int n) noexcept
+	{
+		return static_cast<int>((*this)() % static_cast<std::uint64_t>(n));
+	}
+
+private:
+	std::uint64_t m_state;
+};
+
+std::uint64_t levelSeed(std::uint64_t seed, std::uint64_t index) noexcept
+{
+	return SplitMix64{seed + index * 0xd1b54a32d192ed03ull}();
+}
+
+std::uint64_t bit(int index) noexcept
+{
+	return std::uint64_t{1} << index;
+}
+
+bool isInterior(int x, int y) noexcept
+{
+	return 0 < x && x < ROOM_WIDTH - 1 && 0 < y && y < ROOM_HEIGHT - 1;
+}
+
+// maskの立っているビットから1つを一様に選ぶ
+int randomCell(std::uint64_t mask, SplitMix64& rng) noexcept
+{
+	assert(mask != 0);
+	for (int n = rng.below(__builtin_popcountll(mask)); n > 0; --n) {
+		mask &= mask - 1;
+	}
+	return __builtin_ctzll(mask);
+}
+
+// 外周を除いた範囲で、3x3の形を置きながらランダムウォークした跡を床にする. 床は必ず連結になる
+std::uint64_t makeRoomFloor(SplitMix64& rng) noexcept
+{
+	std::uint64_t floor = 0;
+	int x = 1 + rng.below(ROOM_WIDTH - 2);
+	int y = 1 + rng.below(ROOM_HEIGHT - 2);
+	int direction = rng.below(4);
+	for (int step = 0; step < ROOM_WALK_STEPS; ++step) {
+		const auto& mask = ROOM_MASKS[static_cast<std::size_t>(rng.below(static_cast<int>(ROOM_MASKS.size())))];
+		for (int my = 0; my < 3; ++my) {
+			for (int mx = 0; mx < 3; ++mx) {
+				const int cx = x + mx - 1;
+				const int cy = y + my - 1;
+				if (mask[static_cast<std::size_t>(my)][static_cast<std::size_t>(mx)] && isInterior(cx, cy)) {
+					floor |= bit(cy * ROOM_WIDTH + cx);
+				}
+			}
+		}
+		if (rng.below(100) < ROOM_TURN_PERCENT) {
+			direction = rng.below(4);
+		}
+		const auto d = static_cast<std::size_t>(direction);
+		if (isInterior(x + DX[d], y + DY[d])) {
+			x += DX[d];
+			y += DY[d];
+		}
+	}
+	return floor;
+}
+
+struct ReversePlayState
+{
+	std::array<int, SokobanLevelGenerator::MAX_BOXES> box_cells;
+	std::uint64_t boxes;
+	int player;
+};
+
+// 解けた状態から逆向きに歩き、後ろの箱を引く
+// 評価値は(引く箱を替えた回数) * (箱と元の目標の距離の和)で、目標に乗ったままの箱がある場合は0
+std::pair<ReversePlayState, std::size_t> reversePlay(const ReversePlayState& solved, std::uint64_t floor, std::size_t num_boxes, std::size_t num_steps, SplitMix64& rng)
+{
+	auto state = solved;
+	std::size_t box_swaps = 0;
+	std::size_t last_pulled = num_boxes;
+	for (std::size_t step = 0; step < num_steps; ++step) {
+		const auto d = static_cast<std::size_t>(rng.below(4));
+		const int x = state.player % ROOM_WIDTH;
+		const int y = state.player / ROOM_WIDTH;
+		const int next = (y + DY[d]) * ROOM_WIDTH + (x + DX[d]);
+		if (!isInterior(x + DX[d], y + DY[d]) || (floor & bit(next)) == 0 || (state.boxes & bit(next)) != 0) {
+			continue;
+		}
+		const int behind = (y - DY[d]) * ROOM_WIDTH + (x - DX[d]);
+		if (isInterior(x - DX[d], y - DY[d]) && (state.boxes & bit(behind)) != 0 && rng.below(100) < PULL_PERCENT) {
+			std::size_t box = 0;
+			while (state.box_cells[box] != behind) {
+				++box;
+			}
+			state.box_cells[box] = state.player;
+			state.boxes ^= bit(behind) | bit(state.player);
+			if (box != last_pulled) {
+				++box_swaps;
+				last_pulled = box;
+			}
+		}
+		state.player = next;
+	}
+	std::size_t displacement = 0;
+	for (std::size_t i = 0; i < num_boxes; ++i) {
+		if ((solved.boxes & bit(state.box_cells[i])) != 0) {
+			return {state, 0};
+		}
+		displacement += static_cast<std::size_t>(std::abs(state.box_cells[i] % ROOM_WIDTH - solved.box_cells[i] % ROOM_WIDTH)
+		                                         + std::abs(state.box_cells[i] / ROOM_WIDTH - solved.box_cells[i] / ROOM_WIDTH));
+	}
+	return {state, box_swaps * displacement};
+}
+
+}  // namespace
+
+SokobanLevelGenerator::SokobanLevelGenerator(std::size_t num_boxes, std::size_t difficulty) : m_num_boxes{num_boxes}, m_difficulty{difficulty}
+{
+	assert(0 < num_boxes && num_boxes <= MAX_BOXES);
+	assert(difficulty > 0);
+}
+
+SokobanEnv::PackedProblem SokobanLevelGenerator::generate(std::uint64_t seed) const
+{
+	static_assert(ROOM_WIDTH * ROOM_HEIGHT == 64);
+	SplitMix64 rng{seed};
+	const auto num_trials = 4 * m_difficulty;
+	const auto num_steps = 8 * m_difficulty * m_num_boxes;
+	while (true) {
+		const auto floor = makeRoomFloor(rng);
+		if (static_cast<std::size_t>(__builtin_popcountll(floor)) < m_num_boxes + 2) {
+			continue;
+		}
+		ReversePlayState solved{};
+		for (std::size_t i = 0; i < m_num_boxes; ++i) {
+			solved.box_cells[i] = randomCell(floor & ~solved.boxes, rng);
+			solved.boxes |= bit(solved.box_cells[i]);
+		}
+		solved.player = randomCell(floor & ~solved.boxes, rng);
+		ReversePlayState best = solved;
+		std::size_t best_score = 0;
+		for (std::size_t trial = 0; trial < num_trials; ++trial) {
+			auto [state, score] = reversePlay(solved, floor, m_num_boxes, num_steps, rng);
+			if (score > best_score) {
+				best = state;
+				best_score = score;
+			}
+		}
+		// 全ての箱を目標から動かせなかった場合は部屋から作り直す
+		if (best_score > 0) {
+			return SokobanEnv::PackedProblem{~floor, best.boxes, solved.boxes, best.player, 0};
+		}
+	}
+}
+
+SokobanLevelSupply::SokobanLevelSupply(const SokobanLevelGenerator& generator, std::uint64_t seed, std::size_t num_threads, std::size_t capacity)
+    : m_generator{generator}, m_seed{seed}, m_queue{capacity}
+{
+	for (std::size_t i = 0; i < num_threads; ++i) {
+		m_threads.emplace_back([this] {
+			run();
+		});
+	}
+}
+
+SokobanLevelSupply::~SokobanLevelSupply()
+{
+	m_exit_flag.store(true, std::memory_order_relaxed);
+	for (auto&& thread : m_threads) {
+		thread.join();
+	}
+}
+
+SokobanEnv::PackedProblem SokobanLevelSupply::next()
+{
+	if (auto problem = m_queue.tryPop()) {
+		return problem.value();
+	}
+	m_misses.fetch_add(1, std::memory_order_relaxed);
+	return generateNext();
+}
+
+SokobanEnv::PackedProblem SokobanLevelSupply::generateNext()
+{
+	return m_generator.generate(levelSeed(m_seed, m_next_index.fetch_add(1, std::memory_order_relaxed)));
+}
+
+void SokobanLevelSupply::run()
+{
+	while (!m_exit_flag.load(std::memory_order_relaxed)) {
+		auto problem = generateNext();
+		// 満杯の間は、エージェントが取り出すまで待つ
+		while (!m_queue.tryPush(std::move(problem))) {
+			if (m_exit_flag.load(std::memory_order_relaxed)) {
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds{1});
+		}
+	}
+}
+
+}  // namespace impala
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "concurrent_queue.hpp"
+#include "sokoban_env.hpp"
+
+namespace impala
+{
+
+// Boxoban式の手続き的な問題生成
+// ランダムウォークで部屋の形を作り、箱を目標に置いた解けた状態から逆向きに箱を引いて初期状態を作るため、生成した問題は必ず解ける
+class SokobanLevelGenerator
+{
+public:
+	static inline constexpr std::size_t MAX_BOXES = 4;
+
+	// difficultyが大きいほど逆向きの手数と試行を増やし、箱を目標から遠ざける
+	SokobanLevelGenerator(std::size_t num_boxes, std::size_t difficulty);
+
+	// seedだけで決まる問題を生成する
+	SokobanEnv::PackedProblem generate(std::uint64_t seed) const;
+
+private:
+	std::size_t m_num_boxes;
+	std::size_t m_difficulty;
+};
+
+// バックグラウンドのスレッドで問題を生成し、ロックを取らないリングバッファを満たしておく
+// 決まるのは問題の内容だけで、i番目に生成する問題はseedとiだけで決まる
+// どのエージェントがどの問題をどの順に受け取るかはスレッドの進み方によるため、同じseedでも学習は再現しない
+class SokobanLevelSupply
+{
+public:
+	// リングバッファが満たされるのを待たずに戻る. それまでのnext()は呼び出したスレッドで生成する
+	SokobanLevelSupply(const SokobanLevelGenerator& generator, std::uint64_t seed, std::size_t num_threads, std::size_t capacity);
+	SokobanLevelSupply(const SokobanLevelSupply&) = delete;
+	SokobanLevelSupply& operator=(const SokobanLevelSupply&) = delete;
+	~SokobanLevelSupply();
+
+	// 生成済みの問題を取り出す. 尽きている場合は待たずに呼び出したスレッドで生成する
+	SokobanEnv::PackedProblem next();
+
+	// リングバッファが空で、呼び出したスレッドで生成した回数. 開始直後の満たされるまでの分も含む
+	std::size_t numMisses() const noexcept
+	{
+		return m_misses.load(std::memory_order_relaxed);
+	}
+
+private:
+	SokobanEnv::PackedProblem generateNext();
+	void run();
+
+	SokobanLevelGenerator m_generator;
+	std::uint64_t m_seed;
+	std::atomic<std::uint64_t> m_next_index = 0;
+	std::atomic<std::size_t> m_misses = 0;
+	std::atomic<bool> m_exit_flag = false;
+	BoundedMPMCQueue<SokobanEnv::PackedProblem> m_queue;
+	std::vector<std::thread> m_threads;
+};
+
+}  // namespace impala
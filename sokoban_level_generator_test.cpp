@@ -0,0 +1,68 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include "sokoban_level_generator.hpp"
+
+// SokobanLevelGenerator::generateが同じseedで同じ問題を返し、常に整合した問題を作ることを確かめる
+namespace
+{
+
+using namespace impala;
+
+constexpr std::uint64_t NUM_SEEDS = 200;
+
+bool samePacked(const SokobanEnv::PackedProblem& a, const SokobanEnv::PackedProblem& b)
+{
+	return a.walls == b.walls && a.boxes == b.boxes && a.targets == b.targets && a.player == b.player && a.reserved == b.reserved;
+}
+
+bool checkGenerator(std::size_t num_boxes, std::size_t difficulty)
+{
+	const SokobanLevelGenerator generator{num_boxes, difficulty};
+	// 別のオブジェクトでも同じ問題になる
+	const SokobanLevelGenerator other{num_boxes, difficulty};
+	std::size_t num_distinct = 0;
+	SokobanEnv::PackedProblem previous{};
+	for (std::uint64_t seed = 0; seed < NUM_SEEDS; ++seed) {
+		const auto problem = generator.generate(seed);
+		if (!samePacked(problem, generator.generate(seed)) || !samePacked(problem, other.generate(seed))) {
+			std::cerr << num_boxes << " boxes , difficulty " << difficulty << " , seed " << seed << " : not deterministic" << std::endl;
+			return false;
+		}
+		if (!problem.isValid() || problem.player < 0 || static_cast<std::size_t>(__builtin_popcountll(problem.boxes)) != num_boxes) {
+			std::cerr << num_boxes << " boxes , difficulty " << difficulty << " , seed " << seed << " : invalid problem" << std::endl;
+			return false;
+		}
+		// 逆向きに箱を引いているため、解けた状態のままの問題は無い
+		if ((problem.boxes & ~problem.targets) == 0) {
+			std::cerr << num_boxes << " boxes , difficulty " << difficulty << " , seed " << seed << " : already solved" << std::endl;
+			return false;
+		}
+		num_distinct += seed == 0 || !samePacked(problem, previous) ? 1 : 0;
+		previous = problem;
+	}
+	// seedを無視していないこと
+	if (num_distinct < NUM_SEEDS / 2) {
+		std::cerr << num_boxes << " boxes , difficulty " << difficulty << " : only " << num_distinct << " distinct problems" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+}  // namespace
+
+int main()
+{
+	bool ok = true;
+	for (std::size_t num_boxes = 1; num_boxes <= SokobanLevelGenerator::MAX_BOXES; ++num_boxes) {
+		for (std::size_t difficulty : {1, 2, 5}) {
+			ok = checkGenerator(num_boxes, difficulty) && ok;
+		}
+	}
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "ok" << std::endl;
+	return 0;
+}
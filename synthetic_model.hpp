@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <range/v3/span.hpp>
+
+#include "action.hpp"
+
+namespace impala
+{
+
+// Pythonを使わないNetworkの代替
+// 行動を一様に選び、predict/trainは指定された時間だけ待って返る。C++側のスループットの計測に使う
+template <class Action, class StateValueType = float>
+class SyntheticModel
+{
+public:
+	static_assert(IsDiscreteActionV<Action>);
+
+	struct Loss
+	{
+		double v_loss;
+		double pi_loss;
+		double entropy_loss;
+		// 空の場合、リプレイの優先度は更新されない
+		std::vector<float> priorities;
+	};
+	struct Prediction
+	{
+		std::vector<std::tuple<std::int64_t, float>> actions_and_policies;
+		std::int64_t weight_version;
+	};
+
+	using Reward = float;
+
+	SyntheticModel(std::chrono::microseconds predict_latency, std::chrono::microseconds train_latency)
+	    : m_predict_latency{predict_latency}, m_train_latency{train_latency}, m_random_engine{std::random_device{}()}
+	{
+	}
+
+	Prediction predict([[maybe_unused]] ranges::span<StateValueType> states, ranges::span<std::int64_t> state_indices)
+	{
+		const auto batch_size = static_cast<std::size_t>(state_indices.size());
+		sleepFor(m_predict_latency);
+		Prediction prediction;
+		prediction.actions_and_policies.reserve(batch_size);
+		{
+			std::lock_guard lock{m_random_lock};
+			std::uniform_int_distribution<std::int64_t> dist{0, NUM_ACTIONS - 1};
+			for (std::size_t i = 0; i < batch_size; ++i) {
+				prediction.actions_and_policies.emplace_back(dist(m_random_engine), POLICY);
+			}
+		}
+		prediction.weight_version = m_inference_model_enabled ? m_published_version.load(std::memory_order_relaxed) : m_weight_version.load(std::memory_order_relaxed);
+		return prediction;
+	}
+	Loss train([[maybe_unused]] ranges::span<StateValueType> states, [[maybe_unused]] ranges::span<std::int64_t> state_indices, [[maybe_unused]] ranges::span<std::int64_t> action_ids, [[maybe_unused]] ranges::span<Reward> rewards, [[maybe_unused]] ranges::span<float> behaviour_policies, [[maybe_unused]] ranges::span<std::int64_t> data_sizes, [[maybe_unused]] ranges::span<std::int64_t> observation_sizes)
+	{
+		sleepFor(m_train_latency);
+		m_weight_version.fetch_add(1, std::memory_order_relaxed);
+		return {0.0, 0.0, 0.0, {}};
+	}
+	void save([[maybe_unused]] int index) {}
+
+	void enableInferenceModel()
+	{
+		m_inference_model_enabled = true;
+	}
+	void publishWeights()
+	{
+		m_published_version.store(m_weight_version.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+private:
+	static inline constexpr std::int64_t NUM_ACTIONS = DiscreteActionTraits<Action>::num_actions;
+	static inline constexpr float POLICY = 1.0f / static_cast<float>(NUM_ACTIONS);
+
+	static void sleepFor(std::chrono::microseconds latency)
+	{
+		if (latency.count() > 0) {
+			std::this_thread::sleep_for(latency);
+		}
+	}
+
+	const std::chrono::microseconds m_predict_latency;
+	const std::chrono::microseconds m_train_latency;
+	std::mutex m_random_lock;
+	std::mt19937 m_random_engine;
+	bool m_inference_model_enabled = false;
+	std::atomic<std::int64_t> m_weight_version = 0;
+	std::atomic<std::int64_t> m_published_version = 0;
+};
+
+}  // namespace impala
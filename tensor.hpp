@@ -1,19 +1,28 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstddef>
+#include <functional>
 #include <iterator>
+#include <optional>
 #include <type_traits>
+#include <vector>
 
 #include <boost/container/vector.hpp>
 
+#include "batch_buffer.hpp"
+#include "parallel_executor.hpp"
+
 namespace impala
 {
 
 template <class T, std::size_t N, std::size_t... Ns>
 class Tensor;
 template <class T, std::size_t N, std::size_t... Ns>
+class InlineTensor;
+template <class T, std::size_t N, std::size_t... Ns>
 class TensorRef;
 
 template <class T, std::size_t... Ns>
@@ -242,6 +251,11 @@ public:
 		std::copy_n(src.data(), sizeOfAll(), m_data);
 		return *this;
 	}
+	TensorRef& assign(const InlineTensor<T, N, Ns...>& src)
+	{
+		std::copy_n(src.data(), sizeOfAll(), m_data);
+		return *this;
+	}
 	TensorRef& assign(TensorRef<std::add_const_t<T>, N, Ns...> src)
 	{
 		std::copy_n(src.data(), sizeOfAll(), m_data);
@@ -363,4 +377,212 @@ private:
 	boost::container::vector<T> m_data;
 };
 
+namespace detail
+{
+
+// 64バイト以上のものはキャッシュラインの境界に揃え、1要素が余分なキャッシュラインにまたがらないようにする
+template <class T, std::size_t Size>
+inline constexpr std::size_t inline_tensor_alignment = sizeof(T) * Size >= 64 ? std::max<std::size_t>(alignof(T), 64) : alignof(T);
+
+}  // namespace detail
+
+// 要素をヒープではなくオブジェクト内(std::array)に持つTensor
+// trivially copyableで、コピーは要素のコピーだけで済むため、観測をキューや軌跡の配列に値で並べられる
+// 既定の構築では要素を初期化しない
+template <class T, std::size_t N, std::size_t... Ns>
+class alignas(detail::inline_tensor_alignment<T, (N * ... * Ns)>) InlineTensor
+{
+public:
+	static_assert(!std::is_const_v<T>);
+	static_assert(((N > 0) && ... && (Ns > 0)));
+	static_assert(std::is_trivially_copyable_v<T>);
+
+	using Traits = detail::TensorTraits<T, N, Ns...>;
+	using ConstTraits = detail::TensorTraits<std::add_const_t<T>, N, Ns...>;
+	using iterator = typename Traits::iterator;
+	using const_iterator = typename ConstTraits::iterator;
+	using reference = typename Traits::reference;
+	using const_reference = typename ConstTraits::reference;
+
+	InlineTensor() = default;
+
+	T* data() noexcept
+	{
+		return m_data.data();
+	}
+	std::add_const_t<T>* data() const noexcept
+	{
+		return m_data.data();
+	}
+	constexpr std::size_t size() const noexcept
+	{
+		return N;
+	}
+	constexpr std::size_t sizeOfAll() const noexcept
+	{
+		return (N * ... * Ns);
+	}
+	reference operator[](std::size_t n) noexcept
+	{
+		assert(n < size());
+		return Traits::makeReference(data() + n * (1 * ... * Ns));
+	}
+	const_reference operator[](std::size_t n) const noexcept
+	{
+		assert(n < size());
+		return ConstTraits::makeReference(data() + n * (1 * ... * Ns));
+	}
+	iterator begin() noexcept
+	{
+		return Traits::makeIterator(data());
+	}
+	iterator end() noexcept
+	{
+		return Traits::makeIterator(data() + (N * ... * Ns));
+	}
+	const_iterator begin() const noexcept
+	{
+		return ConstTraits::makeIterator(data());
+	}
+	const_iterator end() const noexcept
+	{
+		return ConstTraits::makeIterator(data() + (N * ... * Ns));
+	}
+	const_iterator cbegin() const noexcept
+	{
+		return begin();
+	}
+	const_iterator cend() const noexcept
+	{
+		return end();
+	}
+
+	TensorRef<T, N, Ns...> ref() noexcept
+	{
+		return TensorRef<T, N, Ns...>(data());
+	}
+	TensorRef<std::add_const_t<T>, N, Ns...> cref() const noexcept
+	{
+		return TensorRef<std::add_const_t<T>, N, Ns...>(data());
+	}
+
+	InlineTensor clone() const
+	{
+		return *this;
+	}
+	InlineTensor& assign(const InlineTensor& src)
+	{
+		m_data = src.m_data;
+		return *this;
+	}
+	InlineTensor& assign(TensorRef<std::add_const_t<T>, N, Ns...> src)
+	{
+		std::copy_n(src.data(), sizeOfAll(), data());
+		return *this;
+	}
+
+private:
+	std::array<T, (N * ... * Ns)> m_data;
+};
+
+// Tensorをバッチ単位で連続した領域に並べる
+// 領域は64バイト境界に揃う. nulloptの要素は0で埋め、callbackを渡す場合はcallbackが全ての要素を書き込むこと
+template <class T, std::size_t... Ns>
+class TensorBatchTraits
+{
+public:
+	using value_type = T;
+	using Buffer = BatchBuffer<T>;
+
+	static inline constexpr std::size_t size_of_all = (Ns * ...);
+
+	template <class ForwardIterator,
+	    std::enable_if_t<
+	        std::conjunction_v<
+	            std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>,
+	            std::disjunction<
+	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const Tensor<T, Ns...>&>,
+	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const std::optional<Tensor<T, Ns...>>&>,
+	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const InlineTensor<T, Ns...>&>,
+	                std::is_convertible<typename std::iterator_traits<ForwardIterator>::reference, const std::optional<InlineTensor<T, Ns...>>&>>>,
+	        std::nullptr_t> = nullptr>
+	static Buffer makeBufferForBatch(ForwardIterator first, ForwardIterator last)
+	{
+		const auto batch_size = static_cast<std::size_t>(std::distance(first, last));
+		Buffer buffer(batch_size * size_of_all);
+		writeElements(first, batch_size, buffer.data(), [](const auto& element, TensorRef<T, Ns...>& dest) {
+			if (const auto* src = elementData(element)) {
+				std::copy_n(src, size_of_all, dest.data());
+			} else {
+				std::fill_n(dest.data(), size_of_all, T{});
+			}
+		});
+		return buffer;
+	}
+	template <class ForwardIterator, class Callback,
+	    std::enable_if_t<
+	        std::conjunction_v<
+	            std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>,
+	            std::is_invocable<Callback, typename std::iterator_traits<ForwardIterator>::reference, TensorRef<T, Ns...>&>>,
+	        std::nullptr_t> = nullptr>
+	static Buffer makeBufferForBatch(ForwardIterator first, ForwardIterator last, Callback&& callback)
+	{
+		const auto batch_size = static_cast<std::size_t>(std::distance(first, last));
+		Buffer buffer(batch_size * size_of_all);
+		writeElements(first, batch_size, buffer.data(), callback);
+		return buffer;
+	}
+	// makeBufferForBatchと同様だが、bufferの領域を再利用して書き込む
+	template <class ForwardIterator, class Callback,
+	    std::enable_if_t<
+	        std::conjunction_v<
+	            std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>,
+	            std::is_invocable<Callback, typename std::iterator_traits<ForwardIterator>::reference, TensorRef<T, Ns...>&>>,
+	        std::nullptr_t> = nullptr>
+	static void writeBufferForBatch(ForwardIterator first, ForwardIterator last, Buffer& buffer, Callback&& callback)
+	{
+		const auto batch_size = static_cast<std::size_t>(std::distance(first, last));
+		buffer.resize(batch_size * size_of_all);
+		writeElements(first, batch_size, buffer.data(), callback);
+	}
+
+private:
+	// TensorかInlineTensor、またはそのstd::optionalの要素の先頭. nulloptの場合はnullptr
+	template <class Element>
+	static const T* elementData(const Element& element)
+	{
+		if constexpr (std::is_convertible_v<const Element&, const Tensor<T, Ns...>&>) {
+			return static_cast<const Tensor<T, Ns...>&>(element).data();
+		} else if constexpr (std::is_convertible_v<const Element&, const InlineTensor<T, Ns...>&>) {
+			return static_cast<const InlineTensor<T, Ns...>&>(element).data();
+		} else if constexpr (std::is_convertible_v<const Element&, const std::optional<Tensor<T, Ns...>>&>) {
+			const std::optional<Tensor<T, Ns...>>& src = element;
+			return src.has_value() ? src.value().data() : nullptr;
+		} else {
+			const std::optional<InlineTensor<T, Ns...>>& src = element;
+			return src.has_value() ? src.value().data() : nullptr;
+		}
+	}
+
+	// 各要素をcallbackでbufferの対応する位置に書き込む
+	// ランダムアクセスできる場合はParallelExecutor::shared()で並列に行い、1度に書き込む領域は2次キャッシュに収まる大きさにする
+	template <class ForwardIterator, class Callback>
+	static void writeElements(ForwardIterator first, std::size_t batch_size, T* buffer, Callback&& callback)
+	{
+		auto write = [&](std::size_t begin, std::size_t end) {
+			auto it = std::next(first, static_cast<typename std::iterator_traits<ForwardIterator>::difference_type>(begin));
+			for (auto i = begin; i < end; ++i, ++it) {
+				TensorRef<T, Ns...> tensor_ref{buffer + i * size_of_all};
+				std::invoke(callback, *it, tensor_ref);
+			}
+		};
+		if constexpr (std::is_base_of_v<std::random_access_iterator_tag, typename std::iterator_traits<ForwardIterator>::iterator_category>) {
+			const auto chunk_size = ParallelExecutor::l2CacheSize() / (sizeof(T) * size_of_all);
+			ParallelExecutor::shared().parallelFor(batch_size, chunk_size, write);
+		} else {
+			write(0, batch_size);
+		}
+	}
+};
+
 }  // namespace impala
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace impala
+{
+
+// "0-3,8,10-11" 形式のCPUリストを解釈する。解釈できない場合や、CPU_SETSIZE以上の番号を含む場合はnullopt
+inline std::optional<std::vector<int>> parseCpuList(std::string_view str)
+{
+	std::vector<int> cpus;
+	auto parseNumber = [](std::string_view s) -> std::optional<int> {
+		if (s.empty() || s.find_first_not_of("0123456789") != std::string_view::npos) {
+			return std::nullopt;
+		}
+		int value = 0;
+		for (char c : s) {
+			value = value * 10 + (c - '0');
+			if (value >= CPU_SETSIZE) {
+				return std::nullopt;
+			}
+		}
+		return value;
+	};
+	while (!str.empty()) {
+		const auto comma = str.find(',');
+		const auto item = str.substr(0, comma);
+		str = comma == std::string_view::npos ? std::string_view{} : str.substr(comma + 1);
+		const auto dash = item.find('-');
+		const auto first = parseNumber(item.substr(0, dash));
+		const auto last = dash == std::string_view::npos ? first : parseNumber(item.substr(dash + 1));
+		if (!first || !last || first.value() > last.value()) {
+			return std::nullopt;
+		}
+		for (int cpu = first.value(); cpu <= last.value(); ++cpu) {
+			cpus.emplace_back(cpu);
+		}
+	}
+	if (cpus.empty()) {
+		return std::nullopt;
+	}
+	std::sort(cpus.begin(), cpus.end());
+	cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+	return cpus;
+}
+
+// 呼び出したスレッドをcpusのいずれかで動くよう固定する。cpusが空の場合は何もしない
+inline bool pinCurrentThread(const std::vector<int>& cpus)
+{
+	if (cpus.empty()) {
+		return true;
+	}
+	::cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto cpu : cpus) {
+		if (cpu < 0 || cpu >= CPU_SETSIZE) {
+			return false;
+		}
+		CPU_SET(cpu, &set);
+	}
+	return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+}
+
+// pinCurrentThreadと同様だが、失敗した場合はスレッドの役割を添えて報告する。固定せずにそのまま動かす
+inline void pinCurrentThreadOrWarn(const std::vector<int>& cpus, const std::string& role)
+{
+	if (!pinCurrentThread(cpus)) {
+		std::cerr << "failed to pin the " + role + " thread\n" << std::flush;
+	}
+}
+
+// このプロセスが使えるCPUのNUMAノード毎の一覧
+class CpuTopology
+{
+public:
+	static CpuTopology detect()
+	{
+		CpuTopology topology;
+		std::vector<int> allowed;
+		::cpu_set_t set;
+		CPU_ZERO(&set);
+		if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+				if (CPU_ISSET(cpu, &set)) {
+					allowed.emplace_back(cpu);
+				}
+			}
+		}
+		for (int node = 0;; ++node) {
+			std::ifstream in{"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+			std::string line;
+			if (!in || !std::getline(in, line)) {
+				break;
+			}
+			auto cpus = parseCpuList(line);
+			if (!cpus) {
+				continue;
+			}
+			std::vector<int> usable;
+			std::set_intersection(cpus->begin(), cpus->end(), allowed.begin(), allowed.end(), std::back_inserter(usable));
+			if (!usable.empty()) {
+				topology.m_nodes.push_back({node, std::move(usable)});
+			}
+		}
+		if (topology.m_nodes.empty() && !allowed.empty()) {
+			// NUMAの情報が取れない場合は全体を1つのノードとみなす
+			topology.m_nodes.push_back({0, std::move(allowed)});
+		}
+		return topology;
+	}
+
+	struct Node
+	{
+		int id;
+		std::vector<int> cpus;
+	};
+
+	const std::vector<Node>& nodes() const noexcept
+	{
+		return m_nodes;
+	}
+	// 不明な場合は-1
+	int nodeOf(int cpu) const
+	{
+		for (auto&& node : m_nodes) {
+			if (std::binary_search(node.cpus.begin(), node.cpus.end(), cpu)) {
+				return node.id;
+			}
+		}
+		return -1;
+	}
+
+private:
+	std::vector<Node> m_nodes;
+};
+
+// Serverの各スレッドを固定するCPU
+// 明示されなかった役割は、最初のNUMAノードにサーバー・推論・Predictor・Trainer・バッチ描画のスレッドを1コアずつ割り当て、
+// エージェントを残りのコアに分散させる
+// スレッドを固定するだけで、メモリの配置は指定しない
+class ThreadPlacement
+{
+public:
+	struct Options
+	{
+		bool enabled;
+		std::optional<std::string> server_cpus;
+		std::optional<std::string> predictor_cpus;
+		std::optional<std::string> trainer_cpus;
+		std::optional<std::string> agent_cpus;
+		std::optional<std::string> render_cpus;
+	};
+
+	ThreadPlacement(const Options& options, std::size_t num_predictors, std::size_t num_trainers, std::size_t num_render_threads, bool separate_inference_thread)
+	    : m_enabled{options.enabled}, m_topology{CpuTopology::detect()}
+	{
+		if (!m_enabled || m_topology.nodes().empty()) {
+			m_enabled = false;
+			return;
+		}
+		const auto& home = m_topology.nodes().front().cpus;
+		std::size_t next_home_cpu = 0;
+		std::vector<int> used;
+		// サーバーのノードから空いているコアを1つ取る。足りない場合はノード全体で共有する
+		auto takeHomeCpu = [&]() -> std::vector<int> {
+			if (next_home_cpu < home.size()) {
+				used.emplace_back(home[next_home_cpu]);
+				return {home[next_home_cpu++]};
+			}
+			return home;
+		};
+		auto explicitCpus = [](const std::optional<std::string>& list, const char* name) -> std::optional<std::vector<int>> {
+			if (!list.has_value()) {
+				return std::nullopt;
+			}
+			auto cpus = parseCpuList(list.value());
+			if (!cpus) {
+				std::cerr << "invalid cpu list for " << name << " : " << list.value() << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			return cpus;
+		};
+
+		if (auto cpus = explicitCpus(options.server_cpus, "server_cpus")) {
+			m_server = m_inference = cpus.value();
+		} else {
+			m_server = takeHomeCpu();
+			m_inference = separate_inference_thread ? takeHomeCpu() : m_server;
+		}
+		auto assign = [&](std::vector<std::vector<int>>& dest, std::size_t count, const std::optional<std::string>& list, const char* name) {
+			if (auto cpus = explicitCpus(list, name)) {
+				for (std::size_t i = 0; i < count; ++i) {
+					dest.push_back({cpus.value()[i % cpus->size()]});
+				}
+			} else {
+				for (std::size_t i = 0; i < count; ++i) {
+					dest.emplace_back(takeHomeCpu());
+				}
+			}
+		};
+		assign(m_predictors, num_predictors, options.predictor_cpus, "predictor_cpus");
+		assign(m_trainers, num_trainers, options.trainer_cpus, "trainer_cpus");
+		assign(m_renderers, num_render_threads, options.render_cpus, "render_cpus");
+		if (auto cpus = explicitCpus(options.agent_cpus, "agent_cpus")) {
+			m_agents = std::move(cpus.value());
+		} else {
+			std::sort(used.begin(), used.end());
+			for (auto&& node : m_topology.nodes()) {
+				std::set_difference(node.cpus.begin(), node.cpus.end(), used.begin(), used.end(), std::back_inserter(m_agents));
+			}
+			if (m_agents.empty()) {
+				for (auto&& node : m_topology.nodes()) {
+					m_agents.insert(m_agents.end(), node.cpus.begin(), node.cpus.end());
+				}
+			}
+		}
+	}
+
+	bool enabled() const noexcept
+	{
+		return m_enabled;
+	}
+
+	// 固定しない場合は空を返す
+	std::vector<int> serverCpus() const
+	{
+		return m_enabled ? m_server : std::vector<int>{};
+	}
+	std::vector<int> inferenceCpus() const
+	{
+		return m_enabled ? m_inference : std::vector<int>{};
+	}
+	std::vector<int> predictorCpus(std::size_t index) const
+	{
+		return m_enabled ? m_predictors.at(index) : std::vector<int>{};
+	}
+	std::vector<int> trainerCpus(std::size_t index) const
+	{
+		return m_enabled ? m_trainers.at(index) : std::vector<int>{};
+	}
+	// ParallelExecutor::shared()のワーカー
+	std::vector<int> renderCpus(std::size_t index) const
+	{
+		return m_enabled ? m_renderers.at(index) : std::vector<int>{};
+	}
+	// エージェント(またはエージェントのワーカー)をindex順にコアへ割り当てる
+	std::vector<int> agentCpus(std::size_t index) const
+	{
+		return m_enabled ? std::vector<int>{m_agents[index % m_agents.size()]} : std::vector<int>{};
+	}
+
+	void print(std::ostream& out, bool separate_inference_thread, std::size_t num_agent_threads) const
+	{
+		if (!m_enabled) {
+			out << "thread placement : not pinned" << std::endl;
+			return;
+		}
+		out << "thread placement :";
+		for (auto&& node : m_topology.nodes()) {
+			out << " node " << node.id << " cpus ";
+			printCpus(out, node.cpus);
+		}
+		out << "\n";
+		printRole(out, "server", m_server);
+		if (separate_inference_thread) {
+			printRole(out, "inference", m_inference);
+		}
+		for (std::size_t i = 0; i < m_predictors.size(); ++i) {
+			printRole(out, "predictor " + std::to_string(i), m_predictors[i]);
+		}
+		for (std::size_t i = 0; i < m_trainers.size(); ++i) {
+			printRole(out, "trainer " + std::to_string(i), m_trainers[i]);
+		}
+		for (std::size_t i = 0; i < m_renderers.size(); ++i) {
+			printRole(out, "render " + std::to_string(i), m_renderers[i]);
+		}
+		out << "  " << num_agent_threads << " agent threads over cpus ";
+		printCpus(out, m_agents);
+		out << std::endl;
+	}
+
+private:
+	void printRole(std::ostream& out, const std::string& role, const std::vector<int>& cpus) const
+	{
+		out << "  " << role << " : cpus ";
+		printCpus(out, cpus);
+		out << " (node " << m_topology.nodeOf(cpus.front()) << ")\n";
+	}
+	static void printCpus(std::ostream& out, const std::vector<int>& cpus)
+	{
+		for (std::size_t i = 0; i < cpus.size(); ++i) {
+			out << (i == 0 ? "" : ",") << cpus[i];
+		}
+	}
+
+	bool m_enabled;
+	CpuTopology m_topology;
+	std::vector<int> m_server;
+	std::vector<int> m_inference;
+	std::vector<std::vector<int>> m_predictors;
+	std::vector<std::vector<int>> m_trainers;
+	std::vector<std::vector<int>> m_renderers;
+	std::vector<int> m_agents;
+};
+
+}  // namespace impala
@@ -2,34 +2,74 @@ import torch
 import torch.nn.functional as F
 import torch.optim as optim
 import math
+import threading
 import numpy as np
 from pathlib import Path
 
 import models
 
 
-def predict_func(states):
+def to_device_states(states):
     states = torch.from_numpy(states).to(device)
-    model.eval()
-    with torch.no_grad():
-        pi = model.pi(states)
-        probs = F.softmax(pi, dim=1)
-        actions = probs.multinomial(1)
-        policies = probs.gather(1, actions)
-        actions = np.squeeze(actions.cpu().numpy(), axis=1)
-        policies = np.squeeze(policies.cpu().numpy(), axis=1)
-        return actions, policies
+    if observation_format == "image_u8":
+        # 転送はuint8のまま行い、GPU上でfloatに戻す
+        states = states.float() * pixel_scale
+    return states
+
+
+# statesはバッチ内の異なる観測のみで、state_indicesが各エージェントの観測のstatesでの位置
+def predict_func(states, state_indices):
+    states = to_device_states(states)
+    state_indices = torch.from_numpy(state_indices).to(device).view(-1)
+    with inference_lock:
+        if inference_model is None:
+            predictor = model
+            version = weight_version
+        else:
+            predictor = inference_model
+            version = inference_weight_version
+        predictor.eval()
+        with torch.no_grad():
+            pi = predictor.pi(states)[state_indices]
+            probs = F.softmax(pi, dim=1)
+            actions = probs.multinomial(1)
+            policies = probs.gather(1, actions)
+            actions = np.squeeze(actions.cpu().numpy(), axis=1)
+            policies = np.squeeze(policies.cpu().numpy(), axis=1)
+            return actions, policies, version
+
+
+def make_model():
+    if observation_format == "cell_codes":
+        return models.A3CCellModel().to(device)
+    return models.A3CModel().to(device)
 
 
-def calc_vs_and_pg_advantages(states, actions, rewards, behaviour_policies,
+def enable_inference_model():
+    global inference_model
+    inference_model = make_model()
+    inference_model.eval()
+    publish_weights()
+
+
+def publish_weights():
+    global inference_weight_version
+    with inference_lock, torch.no_grad():
+        inference_model.load_state_dict(model.state_dict())
+        inference_weight_version = weight_version
+
+
+def calc_vs_and_pg_advantages(states, state_indices, actions, rewards, behaviour_policies,
                               data_sizes, observation_sizes):
     t_max = len(data_sizes)
     model.eval()
     vs_list = []
     pg_advantage_list = []
     with torch.no_grad():
+        # 異なる観測についてまとめて推論し、各時刻の列の位置に並べ直す
+        pi_all, value_all = model.forward(states)
         prev_obs_size = observation_sizes[t_max]
-        prev_value = model.v(states[t_max][:prev_obs_size])
+        prev_value = value_all[state_indices[t_max][:prev_obs_size]]
         prev_v = prev_value
         sum_delta = torch.zeros(prev_obs_size, 1).to(device)
         for i in reversed(range(0, t_max)):
@@ -42,9 +82,9 @@ def calc_vs_and_pg_advantages(states, actions, rewards, behaviour_policies,
                     data_size - prev_obs_size, 1).to(device)), 0)
                 sum_delta = torch.cat((sum_delta, torch.zeros(
                     data_size - prev_obs_size, 1).to(device)), 0)
-            pi, value_obs = model.forward(states[i][:obs_size])
+            value_obs = value_all[state_indices[i][:obs_size]]
             value = value_obs[:data_size]
-            pi = pi[:data_size]
+            pi = pi_all[state_indices[i][:data_size]]
             probs = F.softmax(pi, dim=1)
             target_policy = probs.gather(1, actions[i][:data_size])
             policy_ratio = target_policy / behaviour_policies[i][:data_size]
@@ -67,36 +107,50 @@ def calc_vs_and_pg_advantages(states, actions, rewards, behaviour_policies,
         return vs_list, pg_advantage_list
 
 
-def calc_loss(states, actions, vs, pg_advantages, data_sizes):
+def calc_loss(states, state_indices, actions, vs, pg_advantages, data_sizes, batch_size):
     num_of_data = sum(data_sizes)
     v_loss = 0
     pi_loss = 0
     entropy_loss = 0
+    # 各列(セグメント)のTD誤差の絶対値の平均. リプレイの優先度に使う
+    td_error_sum = torch.zeros(batch_size).to(device)
+    td_error_count = torch.zeros(batch_size).to(device)
+    # 同じ観測の勾配は並べ直す際に合算される
+    pi_all, v_all = model.forward(states)
     for i in range(0, len(data_sizes)):
         data_size = data_sizes[i]
-        pi, v = model.forward(states[i][:data_size])
+        indices = state_indices[i][:data_size]
+        pi, v = pi_all[indices], v_all[indices]
         v_loss += 0.5 * (v - vs[i]).pow(2).sum()
+        td_error_sum[:data_size] += (v - vs[i]).detach().abs().squeeze(1)
+        td_error_count[:data_size] += 1
         probs = F.softmax(pi, dim=1)
         pi_loss += -(torch.max(F.log_softmax(pi, 1).gather(1, actions[i][:data_size]),
                                log_epsilon) * pg_advantages[i]).sum()
         entropy_loss += (torch.max(F.log_softmax(pi, 1), log_epsilon) * probs).sum()
-    return v_loss / num_of_data, pi_loss / num_of_data, entropy_loss / num_of_data
+    td_errors = td_error_sum / torch.clamp(td_error_count, min=1)
+    return v_loss / num_of_data, pi_loss / num_of_data, entropy_loss / num_of_data, td_errors
 
 
-def train_func(states, actions, rewards, behaviour_policies, data_sizes, observation_sizes):
-    states = torch.from_numpy(states).to(device)
+# statesはバッチ内の異なる観測のみで、state_indices[t][列]がその位置の観測のstatesでの位置
+def train_func(states, state_indices, actions, rewards, behaviour_policies, data_sizes, observation_sizes):
+    global weight_version
+    states = to_device_states(states)
+    state_indices = torch.from_numpy(state_indices).to(device).squeeze(2)
     actions = torch.from_numpy(actions).to(device)
     rewards = torch.from_numpy(rewards).to(device)
     behaviour_policies = torch.from_numpy(behaviour_policies).to(device)
     vs, pg_advantages = calc_vs_and_pg_advantages(
-        states, actions, rewards, behaviour_policies, data_sizes, observation_sizes)
+        states, state_indices, actions, rewards, behaviour_policies, data_sizes, observation_sizes)
     model.train()
     optimizer.zero_grad()
-    v_loss, pi_loss, entropy_loss = calc_loss(states, actions, vs, pg_advantages, data_sizes)
+    v_loss, pi_loss, entropy_loss, td_errors = calc_loss(
+        states, state_indices, actions, vs, pg_advantages, data_sizes, observation_sizes[0])
     loss = (0.5 * v_loss + pi_loss + beta * entropy_loss)
     loss.backward()
     optimizer.step()
-    return v_loss.item(), pi_loss.item(), entropy_loss.item()
+    weight_version += 1
+    return v_loss.item(), pi_loss.item(), entropy_loss.item(), td_errors.cpu().numpy()
 
 
 def save_model(index):
@@ -113,8 +167,18 @@ def load_model(index):
 
 
 device = torch.device("cuda")
-model = models.A3CModel().to(device)
+# C++側(BasicNetwork)が実行前に設定する. "image"は描画した画像、"image_u8"はそれをuint8にしたもの、"cell_codes"は8x8のセルの値
+observation_format = globals().get("observation_format", "image")
+# SokobanQuantizedEnv::PIXEL_SCALEと一致させること
+pixel_scale = 0.01
+model = make_model()
 optimizer = optim.SGD(model.parameters(), lr=0.003)
+weight_version = 0
+
+# enable_inference_model()が呼ばれた場合、predict_funcは別スレッドからこの複製を使って推論する
+inference_model = None
+inference_weight_version = 0
+inference_lock = threading.Lock()
 
 gamma = 0.99
 log_epsilon = torch.Tensor([math.log(1e-6)]).to(device)